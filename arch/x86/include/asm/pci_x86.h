@@ -105,6 +105,7 @@ extern const struct pci_raw_ops *raw_pci_ext_ops;
 
 extern const struct pci_raw_ops pci_mmcfg;
 extern const struct pci_raw_ops pci_direct_conf1;
+extern const struct pci_raw_ops pci_direct_conf2;
 extern bool port_cf9_safe;
 
 /* arch_initcall level */
@@ -148,6 +149,40 @@ extern struct pci_mmcfg_region *pci_mmconfig_lookup(int segment, int bus);
 
 extern struct list_head pci_mmcfg_list;
 
+#ifdef CONFIG_PCI_MMCONFIG
+/*
+ * pci=mmconf_hybrid: domain 0 buses whose MMCONFIG window has been seen
+ * to return the same IDs as type 1 also use it below offset 256.
+ */
+extern bool pci_mmcfg_hybrid;
+extern unsigned long pci_mmcfg_fast_buses[];
+extern void pci_mmcfg_check_bus(unsigned int bus, unsigned int devfn, u32 id);
+
+static inline const struct pci_raw_ops *pci_mmcfg_bus_ops(unsigned int bus)
+{
+	if (pci_mmcfg_hybrid && bus < 256 &&
+	    test_bit(bus, pci_mmcfg_fast_buses))
+		return &pci_mmcfg;
+	return NULL;
+}
+
+static inline bool pci_raw_ops_is_mmcfg(const struct pci_raw_ops *ops)
+{
+	return ops == &pci_mmcfg;
+}
+#else
+static inline void pci_mmcfg_check_bus(unsigned int bus, unsigned int devfn,
+				       u32 id) { }
+static inline const struct pci_raw_ops *pci_mmcfg_bus_ops(unsigned int bus)
+{
+	return NULL;
+}
+static inline bool pci_raw_ops_is_mmcfg(const struct pci_raw_ops *ops)
+{
+	return false;
+}
+#endif
+
 #define PCI_MMCFG_BUS_OFFSET(bus)      ((bus) << 20)
 
 /*
@@ -11,6 +11,8 @@
 #include <linux/init.h>
 #include <linux/dmi.h>
 #include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <asm-generic/pci-bridge.h>
 #include <asm/acpi.h>
@@ -38,24 +40,102 @@ unsigned long pirq_table_addr;
 const struct pci_raw_ops *__read_mostly raw_pci_ops;
 const struct pci_raw_ops *__read_mostly raw_pci_ext_ops;
 
+/*
+ * Per-mechanism access counts and latency histograms, exported through
+ * debugfs.  Latencies are only sampled while pci_config_timing is set.
+ */
+enum {
+	PCI_ACCESS_IO,		/* type 1/2 I/O ports */
+	PCI_ACCESS_MMCFG,
+	PCI_ACCESS_OTHER,	/* BIOS, platform ext ops, e.g. NumaChip */
+	PCI_ACCESS_NR,
+};
+
+#define PCI_ACCESS_LAT_BUCKETS	16	/* log2(ns), last one is >= 32us */
+
+struct pci_access_stats {
+	unsigned long count[PCI_ACCESS_NR];
+	unsigned long lat[PCI_ACCESS_NR][PCI_ACCESS_LAT_BUCKETS];
+	unsigned long io_bus[256];	/* PCI_ACCESS_IO accesses per bus */
+};
+
+static DEFINE_PER_CPU(struct pci_access_stats, pci_access_stats);
+static u32 __read_mostly pci_config_timing;
+
+static const struct pci_raw_ops *raw_pci_pick(unsigned int domain,
+					      unsigned int bus, int reg)
+{
+	const struct pci_raw_ops *ops;
+
+	if (domain == 0 && reg < 256 && raw_pci_ops) {
+		ops = pci_mmcfg_bus_ops(bus);
+		return ops ? ops : raw_pci_ops;
+	}
+	return raw_pci_ext_ops;
+}
+
+static void raw_pci_account(const struct pci_raw_ops *ops, unsigned int bus,
+			    u64 start)
+{
+	int type;
+
+	if (pci_raw_ops_is_mmcfg(ops))
+		type = PCI_ACCESS_MMCFG;
+	else if (ops == &pci_direct_conf1 || ops == &pci_direct_conf2)
+		type = PCI_ACCESS_IO;
+	else
+		type = PCI_ACCESS_OTHER;
+
+	this_cpu_inc(pci_access_stats.count[type]);
+	if (type == PCI_ACCESS_IO && bus < 256)
+		this_cpu_inc(pci_access_stats.io_bus[bus]);
+
+	if (start) {
+		u64 delta = local_clock() - start;
+		int b = delta ? min_t(int, ilog2(delta),
+				      PCI_ACCESS_LAT_BUCKETS - 1) : 0;
+
+		this_cpu_inc(pci_access_stats.lat[type][b]);
+	}
+}
+
 int raw_pci_read(unsigned int domain, unsigned int bus, unsigned int devfn,
 						int reg, int len, u32 *val)
 {
-	if (domain == 0 && reg < 256 && raw_pci_ops)
-		return raw_pci_ops->read(domain, bus, devfn, reg, len, val);
-	if (raw_pci_ext_ops)
-		return raw_pci_ext_ops->read(domain, bus, devfn, reg, len, val);
-	return -EINVAL;
+	const struct pci_raw_ops *ops = raw_pci_pick(domain, bus, reg);
+	u64 start = 0;
+	int ret;
+
+	if (!ops)
+		return -EINVAL;
+
+	if (unlikely(pci_config_timing))
+		start = local_clock();
+	ret = ops->read(domain, bus, devfn, reg, len, val);
+	raw_pci_account(ops, bus, start);
+
+	if (ops == raw_pci_ops && reg == PCI_VENDOR_ID && len == 4 && !ret)
+		pci_mmcfg_check_bus(bus, devfn, *val);
+
+	return ret;
 }
 
 int raw_pci_write(unsigned int domain, unsigned int bus, unsigned int devfn,
 						int reg, int len, u32 val)
 {
-	if (domain == 0 && reg < 256 && raw_pci_ops)
-		return raw_pci_ops->write(domain, bus, devfn, reg, len, val);
-	if (raw_pci_ext_ops)
-		return raw_pci_ext_ops->write(domain, bus, devfn, reg, len, val);
-	return -EINVAL;
+	const struct pci_raw_ops *ops = raw_pci_pick(domain, bus, reg);
+	u64 start = 0;
+	int ret;
+
+	if (!ops)
+		return -EINVAL;
+
+	if (unlikely(pci_config_timing))
+		start = local_clock();
+	ret = ops->write(domain, bus, devfn, reg, len, val);
+	raw_pci_account(ops, bus, start);
+
+	return ret;
 }
 
 static int pci_read(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *value)
@@ -70,6 +150,95 @@ static int pci_write(struct pci_bus *bus, unsigned int devfn, int where, int siz
 				  devfn, where, size, value);
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int pci_access_stats_show(struct seq_file *m, void *v)
+{
+	static const char * const names[PCI_ACCESS_NR] = {
+		"io", "mmconfig", "other",
+	};
+	struct pci_access_stats *sum;
+	int cpu, type, i;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct pci_access_stats *s = per_cpu_ptr(&pci_access_stats, cpu);
+
+		for (type = 0; type < PCI_ACCESS_NR; type++) {
+			sum->count[type] += s->count[type];
+			for (i = 0; i < PCI_ACCESS_LAT_BUCKETS; i++)
+				sum->lat[type][i] += s->lat[type][i];
+		}
+		for (i = 0; i < 256; i++)
+			sum->io_bus[i] += s->io_bus[i];
+	}
+
+	seq_puts(m, "accesses:\n");
+	for (type = 0; type < PCI_ACCESS_NR; type++)
+		seq_printf(m, "  %-8s %lu\n", names[type], sum->count[type]);
+
+	seq_puts(m, "latency (ns, log2 buckets):\n");
+	for (type = 0; type < PCI_ACCESS_NR; type++) {
+		seq_printf(m, "  %-8s", names[type]);
+		for (i = 0; i < PCI_ACCESS_LAT_BUCKETS; i++)
+			seq_printf(m, " %lu", sum->lat[type][i]);
+		seq_putc(m, '\n');
+	}
+
+	seq_puts(m, "io accesses by bus:\n");
+	for (i = 0; i < 256; i++)
+		if (sum->io_bus[i])
+			seq_printf(m, "  0000:%02x %lu\n", i, sum->io_bus[i]);
+
+#ifdef CONFIG_PCI_MMCONFIG
+	if (pci_mmcfg_hybrid)
+		seq_printf(m, "mmconfig buses: %*pbl\n", 256,
+			   pci_mmcfg_fast_buses);
+#endif
+
+	kfree(sum);
+	return 0;
+}
+
+static int pci_access_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pci_access_stats_show, NULL);
+}
+
+/* Any write clears the counters */
+static ssize_t pci_access_stats_write(struct file *file,
+				      const char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&pci_access_stats, cpu), 0,
+		       sizeof(struct pci_access_stats));
+	return count;
+}
+
+static const struct file_operations pci_access_stats_fops = {
+	.open		= pci_access_stats_open,
+	.read		= seq_read,
+	.write		= pci_access_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init pci_access_debugfs_init(void)
+{
+	debugfs_create_file("pci_config_access", S_IRUSR | S_IWUSR,
+			    arch_debugfs_dir, NULL, &pci_access_stats_fops);
+	debugfs_create_bool("pci_config_timing", S_IRUSR | S_IWUSR,
+			    arch_debugfs_dir, &pci_config_timing);
+	return 0;
+}
+late_initcall(pci_access_debugfs_init);
+#endif
+
 struct pci_ops pci_root_ops = {
 	.read = pci_read,
 	.write = pci_write,
@@ -600,6 +769,10 @@ char *__init pcibios_setup(char *str)
 		pci_probe &= ~PCI_PROBE_MMCONF;
 		return NULL;
 	}
+	else if (!strcmp(str, "mmconf_hybrid")) {
+		pci_mmcfg_hybrid = true;
+		return NULL;
+	}
 	else if (!strcmp(str, "check_enable_amd_mmconf")) {
 		pci_probe |= PCI_CHECK_ENABLE_AMD_MMCONF;
 		return NULL;
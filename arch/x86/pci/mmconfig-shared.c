@@ -21,6 +21,7 @@
 #include <asm/e820.h>
 #include <asm/pci_x86.h>
 #include <asm/acpi.h>
+#include <asm/processor.h>
 
 #define PREFIX "PCI: "
 
@@ -31,6 +32,10 @@ static DEFINE_MUTEX(pci_mmcfg_lock);
 
 LIST_HEAD(pci_mmcfg_list);
 
+bool pci_mmcfg_hybrid;
+DECLARE_BITMAP(pci_mmcfg_fast_buses, 256);
+static DECLARE_BITMAP(pci_mmcfg_slow_buses, 256);
+
 static void __init pci_mmconfig_remove(struct pci_mmcfg_region *cfg)
 {
 	if (cfg->res.parent)
@@ -532,10 +537,18 @@ static int __ref pci_mmcfg_check_reserved(struct device *dev,
 
 static void __init pci_mmcfg_reject_broken(int early)
 {
-	struct pci_mmcfg_region *cfg;
+	struct pci_mmcfg_region *cfg, *tmp;
 
-	list_for_each_entry(cfg, &pci_mmcfg_list, list) {
+	list_for_each_entry_safe(cfg, tmp, &pci_mmcfg_list, list) {
 		if (pci_mmcfg_check_reserved(NULL, cfg, early) == 0) {
+			/* In hybrid mode only the bad window falls back */
+			if (pci_mmcfg_hybrid) {
+				pr_info(PREFIX "not using MMCONFIG for %04x [bus %02x-%02x]\n",
+					cfg->segment, cfg->start_bus,
+					cfg->end_bus);
+				pci_mmconfig_remove(cfg);
+				continue;
+			}
 			pr_info(PREFIX "not using MMCONFIG\n");
 			free_all_mmcfg();
 			return;
@@ -803,6 +816,9 @@ int pci_mmconfig_delete(u16 seg, u8 start, u8 end)
 	list_for_each_entry_rcu(cfg, &pci_mmcfg_list, list)
 		if (cfg->segment == seg && cfg->start_bus == start &&
 		    cfg->end_bus == end) {
+			if (seg == 0)
+				bitmap_clear(pci_mmcfg_fast_buses, start,
+					     end - start + 1);
 			list_del_rcu(&cfg->list);
 			synchronize_rcu();
 			pci_mmcfg_arch_unmap(cfg);
@@ -816,3 +832,92 @@ int pci_mmconfig_delete(u16 seg, u8 start, u8 end)
 
 	return -ENOENT;
 }
+
+int pcibios_config_ecam_phys(struct pci_dev *dev, phys_addr_t *phys)
+{
+	struct pci_mmcfg_region *cfg;
+	int bus = dev->bus->number;
+	int ret = -ENODEV;
+
+	if (raw_pci_ext_ops != &pci_mmcfg)
+		return -ENODEV;
+
+	/*
+	 * Fam10h northbridges only decode MMCONFIG accesses made through
+	 * %eax (see mmio_config_read*()), which userspace can't promise.
+	 */
+	if (boot_cpu_data.x86_vendor == X86_VENDOR_AMD &&
+	    boot_cpu_data.x86 == 0x10)
+		return -ENODEV;
+
+	/*
+	 * Only offer buses the kernel itself accesses through MMCONFIG
+	 * below offset 256.  In domain 0 that is none of them while type 1
+	 * is in use, except those pci=mmconf_hybrid has verified; buses
+	 * that failed the check or are marked slow stay on type 1.
+	 */
+	if (pci_domain_nr(dev->bus) == 0 && raw_pci_ops &&
+	    !pci_mmcfg_bus_ops(bus))
+		return -ENODEV;
+
+	rcu_read_lock();
+	cfg = pci_mmconfig_lookup(pci_domain_nr(dev->bus), bus);
+	if (cfg) {
+		*phys = cfg->address + (PCI_MMCFG_BUS_OFFSET(bus) |
+					(dev->devfn << 12));
+		ret = 0;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Called with the vendor/device ID type 1 returned for a domain 0
+ * function.  The first present function on an unverified bus triggers a
+ * comparison of the IDs of every slot and function on it, since a single
+ * function that MMCONFIG doesn't decode (northbridge functions on bus 0
+ * are the classic case) must keep the whole bus on type 1.
+ */
+void pci_mmcfg_check_bus(unsigned int bus, unsigned int devfn, u32 id)
+{
+	bool mapped;
+	u32 type1_id, mmcfg_id;
+	unsigned int fn;
+
+	if (!pci_mmcfg_hybrid || raw_pci_ext_ops != &pci_mmcfg)
+		return;
+	/* Absent, or a CRS retry (vendor 0x0001): nothing to compare */
+	if (bus > 255 || id == 0xffffffff || id == 0 ||
+	    (id & 0xffff) == 0x0001)
+		return;
+	if (test_bit(bus, pci_mmcfg_fast_buses) ||
+	    test_bit(bus, pci_mmcfg_slow_buses))
+		return;
+
+	/* Buses outside every MCFG region have nothing to compare against */
+	rcu_read_lock();
+	mapped = pci_mmconfig_lookup(0, bus) != NULL;
+	rcu_read_unlock();
+	if (!mapped)
+		return;
+
+	for (fn = 0; fn < 256; fn++) {
+		if (raw_pci_ops->read(0, bus, fn, PCI_VENDOR_ID, 4, &type1_id))
+			continue;
+		/* Still retrying its config reads: decide on a later scan */
+		if ((type1_id & 0xffff) == 0x0001)
+			return;
+
+		if (pci_mmcfg.read(0, bus, fn, PCI_VENDOR_ID, 4, &mmcfg_id) ||
+		    mmcfg_id != type1_id) {
+			if (!test_and_set_bit(bus, pci_mmcfg_slow_buses))
+				pr_info(PREFIX "MMCONFIG mismatch on 0000:%02x:%02x.%d (%08x vs %08x), using type 1 for bus %02x\n",
+					bus, PCI_SLOT(fn), PCI_FUNC(fn),
+					mmcfg_id, type1_id, bus);
+			return;
+		}
+	}
+
+	set_bit(bus, pci_mmcfg_fast_buses);
+}
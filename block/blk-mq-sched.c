@@ -0,0 +1,240 @@
+/*
+ * I/O scheduler support for blk-mq
+ *
+ * A scheduler sits between the software queues and the driver: requests
+ * flushed from the software queues of a hardware queue are inserted into
+ * the scheduler, and the hardware queue run pulls them back out in the
+ * order the scheduler picks.  Schedulers are attached per request queue
+ * through the "scheduler" sysfs attribute, "none" being the default.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/string.h>
+
+#include <linux/blk-mq.h>
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-sched.h"
+
+static LIST_HEAD(blk_mq_sched_list);
+static DEFINE_SPINLOCK(blk_mq_sched_lock);
+
+static struct blk_mq_sched_type *blk_mq_sched_find(const char *name)
+{
+	struct blk_mq_sched_type *e;
+
+	list_for_each_entry(e, &blk_mq_sched_list, list) {
+		if (!strcmp(e->name, name))
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct blk_mq_sched_type *blk_mq_sched_get(const char *name)
+{
+	struct blk_mq_sched_type *e;
+
+	spin_lock(&blk_mq_sched_lock);
+
+	e = blk_mq_sched_find(name);
+	if (!e) {
+		spin_unlock(&blk_mq_sched_lock);
+		request_module("%s", name);
+		spin_lock(&blk_mq_sched_lock);
+		e = blk_mq_sched_find(name);
+	}
+
+	if (e && !try_module_get(e->owner))
+		e = NULL;
+
+	spin_unlock(&blk_mq_sched_lock);
+
+	return e;
+}
+
+int blk_mq_sched_register(struct blk_mq_sched_type *e)
+{
+	spin_lock(&blk_mq_sched_lock);
+	if (blk_mq_sched_find(e->name)) {
+		spin_unlock(&blk_mq_sched_lock);
+		return -EBUSY;
+	}
+	list_add_tail(&e->list, &blk_mq_sched_list);
+	spin_unlock(&blk_mq_sched_lock);
+
+	printk(KERN_INFO "blk-mq: io scheduler %s registered\n", e->name);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(blk_mq_sched_register);
+
+/*
+ * Queues hold a module reference on their scheduler, so by the time this
+ * can be called from module exit nobody is using @e.
+ */
+void blk_mq_sched_unregister(struct blk_mq_sched_type *e)
+{
+	spin_lock(&blk_mq_sched_lock);
+	list_del_init(&e->list);
+	spin_unlock(&blk_mq_sched_lock);
+}
+EXPORT_SYMBOL_GPL(blk_mq_sched_unregister);
+
+/*
+ * Hand requests flushed from the software queues to the scheduler.  Flush
+ * sequences and anything that isn't a file system request don't get
+ * sorted; they are left on @list to be issued right away.
+ */
+void blk_mq_sched_insert_requests(struct blk_mq_sched_type *e,
+				  struct blk_mq_hw_ctx *hctx,
+				  struct list_head *list)
+{
+	struct request *rq, *next;
+	LIST_HEAD(sched_list);
+
+	list_for_each_entry_safe(rq, next, list, queuelist) {
+		if (rq->cmd_type != REQ_TYPE_FS ||
+		    (rq->cmd_flags & REQ_FLUSH_SEQ))
+			continue;
+
+		list_move_tail(&rq->queuelist, &sched_list);
+	}
+
+	if (!list_empty(&sched_list))
+		e->insert_requests(hctx, &sched_list);
+}
+
+static void blk_mq_sched_exit_hctxs(struct request_queue *q,
+				    struct blk_mq_sched_type *e,
+				    unsigned int nr_hctx)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (i == nr_hctx)
+			break;
+
+		e->exit_hctx(hctx);
+		hctx->sched_data = NULL;
+	}
+}
+
+/*
+ * Swap the scheduler of @q for @new, which may be NULL for none.  The queue
+ * is frozen first, which also drains the old scheduler, and runs that are
+ * already past the frozen check are waited for with RCU.  On failure the
+ * queue is left without a scheduler.
+ */
+static int blk_mq_sched_switch(struct request_queue *q,
+			       struct blk_mq_sched_type *new)
+{
+	struct blk_mq_sched_type *old;
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+	int ret = 0;
+
+	blk_mq_freeze_queue(q);
+
+	old = rcu_dereference_protected(q->mq_sched,
+					lockdep_is_held(&q->sysfs_lock));
+	if (old) {
+		rcu_assign_pointer(q->mq_sched, NULL);
+		synchronize_rcu();
+		blk_mq_sched_exit_hctxs(q, old, q->nr_hw_queues);
+		module_put(old->owner);
+	}
+
+	if (new) {
+		queue_for_each_hw_ctx(q, hctx, i) {
+			ret = new->init_hctx(hctx);
+			if (ret) {
+				blk_mq_sched_exit_hctxs(q, new, i);
+				module_put(new->owner);
+				goto out;
+			}
+		}
+		rcu_assign_pointer(q->mq_sched, new);
+	}
+
+ out:
+	blk_mq_unfreeze_queue(q);
+	return ret;
+}
+
+/*
+ * Called when the queue is torn down, nothing can be running on it.
+ */
+void blk_mq_sched_exit(struct request_queue *q)
+{
+	struct blk_mq_sched_type *e = rcu_dereference_protected(q->mq_sched, 1);
+
+	if (!e)
+		return;
+
+	RCU_INIT_POINTER(q->mq_sched, NULL);
+	blk_mq_sched_exit_hctxs(q, e, q->nr_hw_queues);
+	module_put(e->owner);
+}
+
+ssize_t blk_mq_sched_show(struct request_queue *q, char *name)
+{
+	struct blk_mq_sched_type *cur, *e;
+	int len = 0;
+
+	cur = rcu_dereference_protected(q->mq_sched,
+					lockdep_is_held(&q->sysfs_lock));
+
+	len += sprintf(name+len, cur ? "none " : "[none] ");
+
+	spin_lock(&blk_mq_sched_lock);
+	list_for_each_entry(e, &blk_mq_sched_list, list) {
+		if (e == cur)
+			len += sprintf(name+len, "[%s] ", e->name);
+		else
+			len += sprintf(name+len, "%s ", e->name);
+	}
+	spin_unlock(&blk_mq_sched_lock);
+
+	len += sprintf(len+name, "\n");
+	return len;
+}
+
+ssize_t blk_mq_sched_store(struct request_queue *q, const char *name,
+			   size_t count)
+{
+	char sched_name[ELV_NAME_MAX];
+	struct blk_mq_sched_type *cur, *e = NULL;
+	int ret;
+
+	strlcpy(sched_name, name, sizeof(sched_name));
+	strstrip(sched_name);
+
+	if (strcmp(sched_name, "none")) {
+		e = blk_mq_sched_get(sched_name);
+		if (!e) {
+			printk(KERN_ERR "blk-mq: io scheduler %s not found\n",
+				sched_name);
+			return -EINVAL;
+		}
+	}
+
+	cur = rcu_dereference_protected(q->mq_sched,
+					lockdep_is_held(&q->sysfs_lock));
+	if (e == cur) {
+		if (e)
+			module_put(e->owner);
+		return count;
+	}
+
+	ret = blk_mq_sched_switch(q, e);
+	if (!ret)
+		return count;
+
+	printk(KERN_ERR "blk-mq: switch to %s failed\n", sched_name);
+	return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef INT_BLK_MQ_SCHED_H
+#define INT_BLK_MQ_SCHED_H
+
+#include <linux/blk-mq.h>
+#include <linux/rcupdate.h>
+
+/*
+ * An I/O scheduler for blk-mq.  Requests that the hardware queue pulls out
+ * of its software queues are handed to ->insert_requests(), and the queue
+ * run then issues whatever ->dispatch_request() returns, one request at a
+ * time, until it returns NULL or the driver is busy.
+ *
+ * All hooks are per hardware queue and may be called concurrently from
+ * several CPUs, so the scheduler does its own locking of hctx->sched_data.
+ */
+struct blk_mq_sched_type {
+	int (*init_hctx)(struct blk_mq_hw_ctx *);
+	void (*exit_hctx)(struct blk_mq_hw_ctx *);
+	void (*insert_requests)(struct blk_mq_hw_ctx *, struct list_head *);
+	struct request *(*dispatch_request)(struct blk_mq_hw_ctx *);
+	bool (*has_work)(struct blk_mq_hw_ctx *);
+
+	const char *name;
+	struct module *owner;
+	struct list_head list;
+};
+
+extern int blk_mq_sched_register(struct blk_mq_sched_type *);
+extern void blk_mq_sched_unregister(struct blk_mq_sched_type *);
+
+extern void blk_mq_sched_insert_requests(struct blk_mq_sched_type *,
+		struct blk_mq_hw_ctx *, struct list_head *);
+extern void blk_mq_sched_exit(struct request_queue *);
+extern ssize_t blk_mq_sched_show(struct request_queue *, char *);
+extern ssize_t blk_mq_sched_store(struct request_queue *, const char *,
+		size_t);
+
+static inline bool blk_mq_sched_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct blk_mq_sched_type *e;
+	bool ret = false;
+
+	rcu_read_lock();
+	e = rcu_dereference(hctx->queue->mq_sched);
+	if (e)
+		ret = e->has_work(hctx);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+#endif
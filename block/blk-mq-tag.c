@@ -8,6 +8,10 @@
  * Uses active queue tracking to support fairer distribution of tags
  * between multiple submitters when a shared tag map is used.
  *
+ * Recently freed tags are kept in small per-cpu caches, so that a CPU
+ * that both submits and completes mostly reuses its own tags without
+ * touching the shared bitmap.
+ *
  * Copyright (C) 2013-2014 Jens Axboe
  */
 #include <linux/kernel.h>
@@ -35,12 +39,31 @@ static bool bt_has_free_tags(struct blk_mq_bitmap_tags *bt)
 	return false;
 }
 
+static unsigned int bt_cached_tags(struct blk_mq_tags *tags)
+{
+	unsigned int cached = 0;
+	int cpu, i;
+
+	if (!tags->cache)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_tag_cache *cache = per_cpu_ptr(tags->cache, cpu);
+
+		for (i = 0; i < BT_CACHE_TAGS; i++)
+			if (ACCESS_ONCE(cache->tags[i]) != -1)
+				cached++;
+	}
+
+	return cached;
+}
+
 bool blk_mq_has_free_tags(struct blk_mq_tags *tags)
 {
 	if (!tags)
 		return true;
 
-	return bt_has_free_tags(&tags->bitmap_tags);
+	return bt_has_free_tags(&tags->bitmap_tags) || bt_cached_tags(tags);
 }
 
 static inline int bt_index_inc(int index)
@@ -55,14 +78,21 @@ static inline void bt_index_atomic_inc(atomic_t *index)
 	atomic_cmpxchg(index, old, new);
 }
 
+static void bt_clear_tag(struct blk_mq_bitmap_tags *bt, unsigned int tag);
+static void bt_cache_drain(struct blk_mq_tags *tags);
+
 /*
  * If a previously inactive queue goes active, bump the active user count.
+ * Once the tags are shared, give back whatever the per-cpu caches hold so
+ * that it can be divided between the users.
  */
 bool __blk_mq_tag_busy(struct blk_mq_hw_ctx *hctx)
 {
 	if (!test_bit(BLK_MQ_S_TAG_ACTIVE, &hctx->state) &&
-	    !test_and_set_bit(BLK_MQ_S_TAG_ACTIVE, &hctx->state))
-		atomic_inc(&hctx->tags->active_queues);
+	    !test_and_set_bit(BLK_MQ_S_TAG_ACTIVE, &hctx->state)) {
+		if (atomic_inc_return(&hctx->tags->active_queues) > 1)
+			bt_cache_drain(hctx->tags);
+	}
 
 	return true;
 }
@@ -140,6 +170,107 @@ static inline bool hctx_may_queue(struct blk_mq_hw_ctx *hctx,
 	return atomic_read(&hctx->nr_active) < depth;
 }
 
+/*
+ * The per-cpu caches are only used while at most one queue is active on
+ * the tags.  With more, freed tags go straight back to the bitmap, where
+ * hctx_may_queue() can share them out fairly.
+ */
+static inline bool bt_cache_enabled(struct blk_mq_tags *tags)
+{
+	return tags->cache && atomic_read(&tags->active_queues) <= 1;
+}
+
+static int bt_cache_get(struct blk_mq_tag_cache *cache)
+{
+	int i, tag;
+
+	for (i = 0; i < BT_CACHE_TAGS; i++) {
+		if (ACCESS_ONCE(cache->tags[i]) == -1)
+			continue;
+		tag = xchg(&cache->tags[i], -1);
+		if (tag != -1)
+			return tag;
+	}
+
+	return -1;
+}
+
+/*
+ * Take a tag from any CPU's cache.  This is the last resort before failing
+ * or sleeping, so tags can't get stranded on CPUs that stopped submitting.
+ */
+static int bt_cache_steal(struct blk_mq_hw_ctx *hctx)
+{
+	struct blk_mq_tags *tags = hctx->tags;
+	int cpu, tag;
+
+	if (!tags->cache || !hctx_may_queue(hctx, &tags->bitmap_tags))
+		return -1;
+
+	for_each_possible_cpu(cpu) {
+		tag = bt_cache_get(per_cpu_ptr(tags->cache, cpu));
+		if (tag != -1)
+			return tag;
+	}
+
+	return -1;
+}
+
+/*
+ * Stash a freed tag in this CPU's cache.  Returns false if the caller
+ * should clear it in the bitmap instead.  Only CPUs that map to @hctx
+ * cache its tags; anywhere else they would sit until stolen back.
+ */
+static bool bt_cache_put(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	struct blk_mq_tags *tags = hctx->tags;
+	struct blk_mq_tag_cache *cache;
+	int i;
+
+	cache = get_cpu_ptr(tags->cache);
+	if (!cpumask_test_cpu(smp_processor_id(), hctx->cpumask)) {
+		put_cpu_ptr(tags->cache);
+		return false;
+	}
+	for (i = 0; i < BT_CACHE_TAGS; i++)
+		if (cmpxchg(&cache->tags[i], -1, tag) == -1)
+			break;
+	put_cpu_ptr(tags->cache);
+
+	if (i == BT_CACHE_TAGS)
+		return false;
+
+	/*
+	 * Pairs with the barrier in bt_get(): either a sleeper finds this
+	 * tag when it tries to steal, or we see the sleeper here and give
+	 * the tag back to the bitmap so that it gets woken.
+	 */
+	smp_mb();
+	if (atomic_read(&tags->bitmap_tags.ws_active) &&
+	    cmpxchg(&cache->tags[i], tag, -1) == tag)
+		return false;
+
+	return true;
+}
+
+static void bt_cache_drain(struct blk_mq_tags *tags)
+{
+	int cpu, i, tag;
+
+	if (!tags->cache)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_tag_cache *cache = per_cpu_ptr(tags->cache, cpu);
+
+		for (i = 0; i < BT_CACHE_TAGS; i++) {
+			tag = xchg(&cache->tags[i], -1);
+			if (tag != -1)
+				bt_clear_tag(&tags->bitmap_tags, tag);
+		}
+	}
+}
+
 static int __bt_get_word(struct blk_align_bitmap *bm, unsigned int last_tag,
 			 bool nowrap)
 {
@@ -265,10 +396,17 @@ static int bt_get(struct blk_mq_alloc_data *data,
 		return tag;
 
 	if (!(data->gfp & __GFP_WAIT))
-		return -1;
+		return hctx ? bt_cache_steal(hctx) : -1;
 
 	bs = bt_wait_ptr(bt, hctx);
 	do {
+		/*
+		 * Announce ourselves before the final attempts, so that
+		 * tag frees after them don't skip the wakeup or hide the
+		 * tag in a per-cpu cache.
+		 */
+		atomic_inc(&bt->ws_active);
+		smp_mb__after_atomic();
 		prepare_to_wait(&bs->wait, &wait, TASK_UNINTERRUPTIBLE);
 
 		tag = __bt_get(hctx, bt, last_tag, tags);
@@ -287,12 +425,15 @@ static int bt_get(struct blk_mq_alloc_data *data,
 		 * as running the queue may also have found completions.
 		 */
 		tag = __bt_get(hctx, bt, last_tag, tags);
+		if (tag == -1 && hctx)
+			tag = bt_cache_steal(hctx);
 		if (tag != -1)
 			break;
 
 		blk_mq_put_ctx(data->ctx);
 
 		io_schedule();
+		atomic_dec(&bt->ws_active);
 
 		data->ctx = blk_mq_get_ctx(data->q);
 		data->hctx = data->q->mq_ops->map_queue(data->q,
@@ -308,16 +449,25 @@ static int bt_get(struct blk_mq_alloc_data *data,
 		bs = bt_wait_ptr(bt, hctx);
 	} while (1);
 
+	atomic_dec(&bt->ws_active);
 	finish_wait(&bs->wait, &wait);
 	return tag;
 }
 
 static unsigned int __blk_mq_get_tag(struct blk_mq_alloc_data *data)
 {
-	int tag;
+	struct blk_mq_tags *tags = data->hctx->tags;
+	int tag = -1;
 
-	tag = bt_get(data, &data->hctx->tags->bitmap_tags, data->hctx,
-			&data->ctx->last_tag, data->hctx->tags);
+	/*
+	 * The ctx is held, so we are pinned to its CPU here.
+	 */
+	if (bt_cache_enabled(tags) &&
+	    hctx_may_queue(data->hctx, &tags->bitmap_tags))
+		tag = bt_cache_get(this_cpu_ptr(tags->cache));
+	if (tag == -1)
+		tag = bt_get(data, &tags->bitmap_tags, data->hctx,
+				&data->ctx->last_tag, tags);
 	if (tag >= 0)
 		return tag + data->hctx->tags->nr_reserved_tags;
 
@@ -353,6 +503,14 @@ static struct bt_wait_state *bt_wake_ptr(struct blk_mq_bitmap_tags *bt)
 {
 	int i, wake_index;
 
+	/*
+	 * Nobody is sleeping in bt_get(), so don't bother scanning the
+	 * wait queues.  This keeps the common free path from touching
+	 * BT_WAIT_QUEUES cachelines that are otherwise idle.
+	 */
+	if (!atomic_read(&bt->ws_active))
+		return NULL;
+
 	wake_index = atomic_read(&bt->wake_index);
 	for (i = 0; i < BT_WAIT_QUEUES; i++) {
 		struct bt_wait_state *bs = &bt->bs[wake_index];
@@ -405,6 +563,16 @@ void blk_mq_put_tag(struct blk_mq_hw_ctx *hctx, unsigned int tag,
 		const int real_tag = tag - tags->nr_reserved_tags;
 
 		BUG_ON(real_tag >= tags->nr_tags);
+		if (bt_cache_enabled(tags) &&
+		    real_tag < tags->bitmap_tags.depth) {
+			/*
+			 * A cached tag is still set in the bitmap, mark
+			 * its request free for bt_for_each().
+			 */
+			tags->rqs[tag]->tag = -1;
+			if (bt_cache_put(hctx, real_tag))
+				return;
+		}
 		bt_clear_tag(&tags->bitmap_tags, real_tag);
 		if (likely(tags->alloc_policy == BLK_TAG_ALLOC_FIFO))
 			*last_tag = real_tag;
@@ -428,7 +596,7 @@ static void bt_for_each(struct blk_mq_hw_ctx *hctx,
 		     bit < bm->depth;
 		     bit = find_next_bit(&bm->word, bm->depth, bit + 1)) {
 		     	rq = blk_mq_tag_to_rq(hctx->tags, off + bit);
-			if (rq->q == hctx->queue)
+			if (rq->q == hctx->queue && rq->tag != -1)
 				fn(hctx, rq, data, reserved);
 		}
 
@@ -544,6 +712,31 @@ static void bt_free(struct blk_mq_bitmap_tags *bt)
 	kfree(bt->bs);
 }
 
+/*
+ * Round-robin allocation wants the tags handed out in order, and tiny tag
+ * spaces would mostly end up in the caches, so neither gets one.  Failing
+ * to allocate the caches isn't fatal either.
+ */
+static void bt_alloc_cache(struct blk_mq_tags *tags)
+{
+	int cpu, i;
+
+	if (tags->alloc_policy == BLK_TAG_ALLOC_RR ||
+	    tags->bitmap_tags.depth < 4 * BT_CACHE_TAGS)
+		return;
+
+	tags->cache = alloc_percpu(struct blk_mq_tag_cache);
+	if (!tags->cache)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_mq_tag_cache *cache = per_cpu_ptr(tags->cache, cpu);
+
+		for (i = 0; i < BT_CACHE_TAGS; i++)
+			cache->tags[i] = -1;
+	}
+}
+
 static struct blk_mq_tags *blk_mq_init_bitmap_tags(struct blk_mq_tags *tags,
 						   int node, int alloc_policy)
 {
@@ -556,6 +749,7 @@ static struct blk_mq_tags *blk_mq_init_bitmap_tags(struct blk_mq_tags *tags,
 	if (bt_alloc(&tags->breserved_tags, tags->nr_reserved_tags, node, true))
 		goto enomem;
 
+	bt_alloc_cache(tags);
 	return tags;
 enomem:
 	bt_free(&tags->bitmap_tags);
@@ -586,6 +780,7 @@ struct blk_mq_tags *blk_mq_init_tags(unsigned int total_tags,
 
 void blk_mq_free_tags(struct blk_mq_tags *tags)
 {
+	free_percpu(tags->cache);
 	bt_free(&tags->bitmap_tags);
 	bt_free(&tags->breserved_tags);
 	kfree(tags);
@@ -609,6 +804,7 @@ int blk_mq_tag_update_depth(struct blk_mq_tags *tags, unsigned int tdepth)
 	 * static and should never need resizing.
 	 */
 	bt_update_count(&tags->bitmap_tags, tdepth);
+	bt_cache_drain(tags);
 	blk_mq_tag_wakeup_all(tags, false);
 	return 0;
 }
@@ -657,7 +853,8 @@ ssize_t blk_mq_tag_sysfs_show(struct blk_mq_tags *tags, char *page)
 	free = bt_unused_tags(&tags->bitmap_tags);
 	res = bt_unused_tags(&tags->breserved_tags);
 
-	page += sprintf(page, "nr_free=%u, nr_reserved=%u\n", free, res);
+	page += sprintf(page, "nr_free=%u, nr_reserved=%u, nr_cached=%u\n",
+			free, res, bt_cached_tags(tags));
 	page += sprintf(page, "active_queues=%u\n", atomic_read(&tags->active_queues));
 
 	return page - orig_page;
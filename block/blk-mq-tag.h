@@ -6,6 +6,7 @@
 enum {
 	BT_WAIT_QUEUES	= 8,
 	BT_WAIT_BATCH	= 8,
+	BT_CACHE_TAGS	= 4,
 };
 
 struct bt_wait_state {
@@ -25,9 +26,19 @@ struct blk_mq_bitmap_tags {
 	struct blk_align_bitmap *map;
 
 	atomic_t wake_index;
+	atomic_t ws_active;	/* Number of sleeping allocators */
 	struct bt_wait_state *bs;
 };
 
+/*
+ * Tags recently freed on a CPU, kept for the next allocation there.  A
+ * cached tag stays set in the bitmap.  Slots are taken with xchg(), since
+ * an allocator that is about to sleep may steal from other CPUs.
+ */
+struct blk_mq_tag_cache {
+	int tags[BT_CACHE_TAGS];	/* -1 if empty */
+};
+
 /*
  * Tag address space map.
  */
@@ -39,6 +50,7 @@ struct blk_mq_tags {
 
 	struct blk_mq_bitmap_tags bitmap_tags;
 	struct blk_mq_bitmap_tags breserved_tags;
+	struct blk_mq_tag_cache __percpu *cache;
 
 	struct request **rqs;
 	struct list_head page_list;
@@ -28,6 +28,7 @@
 #include "blk.h"
 #include "blk-mq.h"
 #include "blk-mq-tag.h"
+#include "blk-mq-sched.h"
 
 static DEFINE_MUTEX(all_q_mutex);
 static LIST_HEAD(all_q_list);
@@ -36,7 +37,8 @@ static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx);
 static void blk_mq_run_queues(struct request_queue *q);
 
 /*
- * Check if any of the ctx's have pending work in this hardware queue
+ * Check if any of the ctx's, or the I/O scheduler, have pending work in
+ * this hardware queue
  */
 static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
 {
@@ -46,7 +48,7 @@ static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
 		if (hctx->ctx_map.map[i].word)
 			return true;
 
-	return false;
+	return blk_mq_sched_has_work(hctx);
 }
 
 static inline struct blk_align_bitmap *get_bm(struct blk_mq_hw_ctx *hctx,
@@ -351,26 +353,39 @@ static void __blk_mq_complete_request_remote(void *data)
 	rq->q->softirq_done_fn(rq);
 }
 
-static void blk_mq_ipi_complete_request(struct request *rq)
+/*
+ * Return the CPU that should run the completion of @rq, when it completes
+ * on @cpu: the submitting CPU if the queue asks for that and it doesn't
+ * share a cache with @cpu, otherwise @cpu itself.
+ */
+static int blk_mq_complete_cpu(struct request *rq, int cpu)
 {
 	struct blk_mq_ctx *ctx = rq->mq_ctx;
 	bool shared = false;
-	int cpu;
 
-	if (!test_bit(QUEUE_FLAG_SAME_COMP, &rq->q->queue_flags)) {
-		rq->q->softirq_done_fn(rq);
-		return;
-	}
+	if (!test_bit(QUEUE_FLAG_SAME_COMP, &rq->q->queue_flags))
+		return cpu;
 
-	cpu = get_cpu();
 	if (!test_bit(QUEUE_FLAG_SAME_FORCE, &rq->q->queue_flags))
 		shared = cpus_share_cache(cpu, ctx->cpu);
 
-	if (cpu != ctx->cpu && !shared && cpu_online(ctx->cpu)) {
+	if (cpu != ctx->cpu && !shared && cpu_online(ctx->cpu))
+		return ctx->cpu;
+
+	return cpu;
+}
+
+static void blk_mq_ipi_complete_request(struct request *rq)
+{
+	int cpu, target;
+
+	cpu = get_cpu();
+	target = blk_mq_complete_cpu(rq, cpu);
+	if (target != cpu) {
 		rq->csd.func = __blk_mq_complete_request_remote;
 		rq->csd.info = rq;
 		rq->csd.flags = 0;
-		smp_call_function_single_async(ctx->cpu, &rq->csd);
+		smp_call_function_single_async(target, &rq->csd);
 	} else {
 		rq->q->softirq_done_fn(rq);
 	}
@@ -406,6 +421,93 @@ void blk_mq_complete_request(struct request *rq)
 }
 EXPORT_SYMBOL(blk_mq_complete_request);
 
+/*
+ * Runs on the submitting CPU for a batch of requests; the first request
+ * carries the rest on its queuelist.
+ */
+static void __blk_mq_complete_request_list_remote(void *data)
+{
+	struct request *rq = data, *next;
+	LIST_HEAD(list);
+
+	list_splice_init(&rq->queuelist, &list);
+	rq->q->softirq_done_fn(rq);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		list_del_init(&rq->queuelist);
+		rq->q->softirq_done_fn(rq);
+	}
+}
+
+static int complete_cpu_cmp(void *priv, struct list_head *a,
+			    struct list_head *b)
+{
+	struct request *rqa = container_of(a, struct request, queuelist);
+	struct request *rqb = container_of(b, struct request, queuelist);
+
+	return rqa->mq_ctx->cpu > rqb->mq_ctx->cpu;
+}
+
+/**
+ * blk_mq_complete_requests - end I/O on a batch of requests
+ * @list:	requests linked through their queuelist
+ *
+ * Description:
+ *	Like calling blk_mq_complete_request() on each request in @list,
+ *	which is left empty.  Completions that have to run on another CPU
+ *	are grouped, so that each such CPU gets a single IPI for the whole
+ *	batch rather than one per request.
+ **/
+void blk_mq_complete_requests(struct list_head *list)
+{
+	struct request *rq, *next, *first;
+	LIST_HEAD(remote);
+	int cpu;
+
+	cpu = get_cpu();
+	list_for_each_entry_safe(rq, next, list, queuelist) {
+		struct request_queue *q = rq->q;
+
+		list_del_init(&rq->queuelist);
+
+		if (unlikely(blk_should_fake_timeout(q)))
+			continue;
+		if (blk_mark_rq_complete(rq))
+			continue;
+
+		if (!q->softirq_done_fn)
+			blk_mq_end_request(rq, rq->errors);
+		else if (blk_mq_complete_cpu(rq, cpu) == cpu)
+			q->softirq_done_fn(rq);
+		else
+			list_add_tail(&rq->queuelist, &remote);
+	}
+
+	/*
+	 * Sort what's left by target CPU, then send each run of requests
+	 * off with the first one's csd.
+	 */
+	list_sort(NULL, &remote, complete_cpu_cmp);
+	while (!list_empty(&remote)) {
+		first = list_first_entry(&remote, struct request, queuelist);
+		list_del_init(&first->queuelist);
+
+		list_for_each_entry_safe(rq, next, &remote, queuelist) {
+			if (rq->mq_ctx->cpu != first->mq_ctx->cpu)
+				break;
+			list_move_tail(&rq->queuelist, &first->queuelist);
+		}
+
+		first->csd.func = __blk_mq_complete_request_list_remote;
+		first->csd.info = first;
+		first->csd.flags = 0;
+		smp_call_function_single_async(first->mq_ctx->cpu,
+						&first->csd);
+	}
+	put_cpu();
+}
+EXPORT_SYMBOL(blk_mq_complete_requests);
+
 int blk_mq_request_started(struct request *rq)
 {
 	return test_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
@@ -759,14 +861,35 @@ static void flush_busy_ctxs(struct blk_mq_hw_ctx *hctx, struct list_head *list)
  * of IO. In particular, we'd like FIFO behaviour on handling existing
  * items on the hctx->dispatch list. Ignore that for now.
  */
+/*
+ * Pull the next request to issue from the I/O scheduler, if there is one.
+ */
+static bool blk_mq_sched_next(struct blk_mq_sched_type *e,
+			      struct blk_mq_hw_ctx *hctx,
+			      struct list_head *list)
+{
+	struct request *rq;
+
+	if (!e)
+		return false;
+
+	rq = e->dispatch_request(hctx);
+	if (!rq)
+		return false;
+
+	list_add_tail(&rq->queuelist, list);
+	return true;
+}
+
 static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
 {
 	struct request_queue *q = hctx->queue;
+	struct blk_mq_sched_type *e;
 	struct request *rq;
 	LIST_HEAD(rq_list);
 	LIST_HEAD(driver_list);
 	struct list_head *dptr;
-	int queued;
+	int queued, ret = BLK_MQ_RQ_QUEUE_OK;
 
 	WARN_ON(!cpumask_test_cpu(raw_smp_processor_id(), hctx->cpumask));
 
@@ -776,9 +899,19 @@ static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
 	hctx->run++;
 
 	/*
-	 * Touch any software queue that has pending entries.
+	 * The scheduler can't go away until we drop the RCU read lock, see
+	 * blk_mq_sched_switch().
+	 */
+	rcu_read_lock();
+	e = rcu_dereference(q->mq_sched);
+
+	/*
+	 * Touch any software queue that has pending entries.  With an I/O
+	 * scheduler attached, it gets what it is allowed to sort.
 	 */
 	flush_busy_ctxs(hctx, &rq_list);
+	if (e && !list_empty(&rq_list))
+		blk_mq_sched_insert_requests(e, hctx, &rq_list);
 
 	/*
 	 * If we have previous entries on our dispatch list, grab them
@@ -798,19 +931,19 @@ static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
 	dptr = NULL;
 
 	/*
-	 * Now process all the entries, sending them to the driver.
+	 * Now process all the entries, sending them to the driver.  Once
+	 * the list is empty, keep going with what the scheduler picks.
 	 */
 	queued = 0;
-	while (!list_empty(&rq_list)) {
+	while (!list_empty(&rq_list) || blk_mq_sched_next(e, hctx, &rq_list)) {
 		struct blk_mq_queue_data bd;
-		int ret;
 
 		rq = list_first_entry(&rq_list, struct request, queuelist);
 		list_del_init(&rq->queuelist);
 
 		bd.rq = rq;
 		bd.list = dptr;
-		bd.last = list_empty(&rq_list);
+		bd.last = list_empty(&rq_list) && !(e && e->has_work(hctx));
 
 		ret = q->mq_ops->queue_rq(hctx, &bd);
 		switch (ret) {
@@ -840,6 +973,13 @@ static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
 			dptr = &driver_list;
 	}
 
+	/*
+	 * The driver never saw bd.last on a request it accepted, so tell it
+	 * to kick off what it has queued so far.
+	 */
+	if (queued && ret != BLK_MQ_RQ_QUEUE_OK && q->mq_ops->commit_rqs)
+		q->mq_ops->commit_rqs(hctx);
+
 	if (!queued)
 		hctx->dispatched[0]++;
 	else if (queued < (1 << (BLK_MQ_MAX_DISPATCH_ORDER - 1)))
@@ -854,6 +994,8 @@ static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
 		list_splice(&rq_list, &hctx->dispatch);
 		spin_unlock(&hctx->lock);
 	}
+
+	rcu_read_unlock();
 }
 
 /*
@@ -1255,7 +1397,8 @@ static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
 	 * queue it up like normal since we can potentially save some
 	 * CPU this way.
 	 */
-	if (is_sync && !(data.hctx->flags & BLK_MQ_F_DEFER_ISSUE)) {
+	if (is_sync && !(data.hctx->flags & BLK_MQ_F_DEFER_ISSUE) &&
+	    !rcu_access_pointer(q->mq_sched)) {
 		struct blk_mq_queue_data bd = {
 			.rq = rq,
 			.list = NULL,
@@ -1382,6 +1525,59 @@ struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
 }
 EXPORT_SYMBOL(blk_mq_map_queue);
 
+/**
+ * blk_poll - spin on the hardware queue instead of sleeping
+ * @q: the queue the caller is waiting on
+ *
+ * Called by a synchronous submitter that has set its task state and is
+ * about to schedule.  Polls the hardware queue mapped to this CPU until
+ * a completion wakes the task, a signal arrives or we need to resched.
+ * Returns true if the caller should re-check its wait condition rather
+ * than sleep.
+ */
+bool blk_poll(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	bool woken = false;
+	long state;
+	u64 start;
+
+	if (!q->mq_ops || !q->mq_ops->poll ||
+	    !test_bit(QUEUE_FLAG_POLL, &q->queue_flags))
+		return false;
+
+	hctx = q->mq_ops->map_queue(q, raw_smp_processor_id());
+	hctx->poll_invoked++;
+
+	state = current->state;
+	start = local_clock();
+	while (!need_resched()) {
+		int ret = q->mq_ops->poll(hctx);
+
+		if (ret > 0) {
+			hctx->poll_success++;
+			__set_current_state(TASK_RUNNING);
+			woken = true;
+			break;
+		}
+
+		if (signal_pending_state(state, current))
+			__set_current_state(TASK_RUNNING);
+
+		if (current->state == TASK_RUNNING) {
+			woken = true;
+			break;
+		}
+		if (ret < 0)
+			break;
+		cpu_relax();
+	}
+	hctx->poll_spin_ns += local_clock() - start;
+
+	return woken;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
+
 static void blk_mq_free_rq_map(struct blk_mq_tag_set *set,
 		struct blk_mq_tags *tags, unsigned int hctx_idx)
 {
@@ -2017,6 +2213,7 @@ void blk_mq_free_queue(struct request_queue *q)
 
 	blk_mq_del_queue_tag_set(q);
 
+	blk_mq_sched_exit(q);
 	blk_mq_exit_hw_queues(q, set, set->nr_hw_queues);
 	blk_mq_free_hw_queues(q, set);
 
@@ -40,6 +40,7 @@
 
 #include "blk.h"
 #include "blk-cgroup.h"
+#include "blk-mq-sched.h"
 
 static DEFINE_SPINLOCK(elv_list_lock);
 static LIST_HEAD(elv_list);
@@ -990,6 +991,9 @@ ssize_t elv_iosched_store(struct request_queue *q, const char *name,
 {
 	int ret;
 
+	if (q->mq_ops)
+		return blk_mq_sched_store(q, name, count);
+
 	if (!q->elevator)
 		return count;
 
@@ -1008,6 +1012,9 @@ ssize_t elv_iosched_show(struct request_queue *q, char *name)
 	struct elevator_type *__e;
 	int len = 0;
 
+	if (q->mq_ops)
+		return blk_mq_sched_show(q, name);
+
 	if (!q->elevator || !blk_queue_stackable(q))
 		return sprintf(name, "none\n");
 
@@ -0,0 +1,301 @@
+/*
+ *  MQ Deadline i/o scheduler - adaptation of the legacy deadline scheduler,
+ *  for the blk-mq scheduling framework.
+ *
+ *  Each hardware queue gets its own sort and fifo lists.  Requests are
+ *  sorted by sector per data direction and handed out in ascending order
+ *  in batches of fifo_batch, unless a request on a fifo has expired or
+ *  writes have been starved for writes_starved batches of reads.
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/elevator.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/rbtree.h>
+
+#include "blk-mq-sched.h"
+
+/*
+ * Same tunables as the legacy deadline scheduler, but module wide rather
+ * than per queue, and with the expiry times in msecs.
+ */
+static unsigned int read_expire = 500;
+module_param(read_expire, uint, 0644);
+MODULE_PARM_DESC(read_expire, "max time in msecs before a read is submitted");
+
+static unsigned int write_expire = 5000;
+module_param(write_expire, uint, 0644);
+MODULE_PARM_DESC(write_expire, "max time in msecs before a write is submitted");
+
+static unsigned int writes_starved = 2;
+module_param(writes_starved, uint, 0644);
+MODULE_PARM_DESC(writes_starved, "max times reads can starve a write");
+
+static unsigned int fifo_batch = 16;
+module_param(fifo_batch, uint, 0644);
+MODULE_PARM_DESC(fifo_batch, "# of sequential requests treated as one");
+
+struct mq_deadline_data {
+	spinlock_t lock;
+
+	/*
+	 * requests are present on both sort_list and fifo_list
+	 */
+	struct rb_root sort_list[2];
+	struct list_head fifo_list[2];
+
+	/*
+	 * next in sort order. read, write or both are NULL
+	 */
+	struct request *next_rq[2];
+	unsigned int batching;		/* number of sequential requests made */
+	unsigned int starved;		/* times reads have starved writes */
+};
+
+/*
+ * get the request after `rq' in sector-sorted order
+ */
+static inline struct request *dd_latter_request(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+/*
+ * add rq to rbtree and fifo
+ */
+static void dd_add_request(struct mq_deadline_data *dd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+	unsigned int expire = data_dir ? write_expire : read_expire;
+
+	elv_rb_add(&dd->sort_list[data_dir], rq);
+
+	/*
+	 * set expire time and add to fifo list
+	 */
+	rq->fifo_time = jiffies + msecs_to_jiffies(expire);
+	list_add_tail(&rq->queuelist, &dd->fifo_list[data_dir]);
+}
+
+/*
+ * remove rq from rbtree and fifo, and remember where the next one in its
+ * direction is.
+ */
+static void dd_remove_request(struct mq_deadline_data *dd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	dd->next_rq[READ] = NULL;
+	dd->next_rq[WRITE] = NULL;
+	dd->next_rq[data_dir] = dd_latter_request(rq);
+
+	rq_fifo_clear(rq);
+	elv_rb_del(&dd->sort_list[data_dir], rq);
+}
+
+/*
+ * dd_check_fifo returns 0 if there are no expired requests on the fifo,
+ * 1 otherwise. Requires !list_empty(&dd->fifo_list[data_dir])
+ */
+static inline int dd_check_fifo(struct mq_deadline_data *dd, int ddir)
+{
+	struct request *rq = rq_entry_fifo(dd->fifo_list[ddir].next);
+
+	/*
+	 * rq is expired!
+	 */
+	if (time_after_eq(jiffies, rq->fifo_time))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * select the best request according to read/write expire, fifo_batch, etc
+ */
+static struct request *__dd_dispatch_request(struct mq_deadline_data *dd)
+{
+	const int reads = !list_empty(&dd->fifo_list[READ]);
+	const int writes = !list_empty(&dd->fifo_list[WRITE]);
+	struct request *rq;
+	int data_dir;
+
+	/*
+	 * batches are currently reads XOR writes
+	 */
+	if (dd->next_rq[WRITE])
+		rq = dd->next_rq[WRITE];
+	else
+		rq = dd->next_rq[READ];
+
+	if (rq && dd->batching < fifo_batch)
+		/* we have a next request are still entitled to batch */
+		goto dispatch_request;
+
+	/*
+	 * at this point we are not running a batch. select the appropriate
+	 * data direction (read / write)
+	 */
+
+	if (reads) {
+		BUG_ON(RB_EMPTY_ROOT(&dd->sort_list[READ]));
+
+		if (writes && (dd->starved++ >= writes_starved))
+			goto dispatch_writes;
+
+		data_dir = READ;
+
+		goto dispatch_find_request;
+	}
+
+	/*
+	 * there are either no reads or writes have been starved
+	 */
+
+	if (writes) {
+dispatch_writes:
+		BUG_ON(RB_EMPTY_ROOT(&dd->sort_list[WRITE]));
+
+		dd->starved = 0;
+
+		data_dir = WRITE;
+
+		goto dispatch_find_request;
+	}
+
+	return NULL;
+
+dispatch_find_request:
+	/*
+	 * we are not running a batch, find best request for selected data_dir
+	 */
+	if (dd_check_fifo(dd, data_dir) || !dd->next_rq[data_dir]) {
+		/*
+		 * A deadline has expired, the last request was in the other
+		 * direction, or we have run out of higher-sectored requests.
+		 * Start again from the request with the earliest expiry time.
+		 */
+		rq = rq_entry_fifo(dd->fifo_list[data_dir].next);
+	} else {
+		/*
+		 * The last req was the same dir and we have a next request in
+		 * sort order. No expired requests so continue on from here.
+		 */
+		rq = dd->next_rq[data_dir];
+	}
+
+	dd->batching = 0;
+
+dispatch_request:
+	/*
+	 * rq is the selected appropriate request.
+	 */
+	dd->batching++;
+	dd_remove_request(dd, rq);
+
+	return rq;
+}
+
+static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
+{
+	struct mq_deadline_data *dd = hctx->sched_data;
+	struct request *rq;
+
+	spin_lock(&dd->lock);
+	rq = __dd_dispatch_request(dd);
+	spin_unlock(&dd->lock);
+
+	return rq;
+}
+
+static void dd_insert_requests(struct blk_mq_hw_ctx *hctx,
+			       struct list_head *list)
+{
+	struct mq_deadline_data *dd = hctx->sched_data;
+
+	spin_lock(&dd->lock);
+	while (!list_empty(list)) {
+		struct request *rq;
+
+		rq = list_first_entry(list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		dd_add_request(dd, rq);
+	}
+	spin_unlock(&dd->lock);
+}
+
+static bool dd_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct mq_deadline_data *dd = hctx->sched_data;
+
+	return !list_empty_careful(&dd->fifo_list[READ]) ||
+		!list_empty_careful(&dd->fifo_list[WRITE]);
+}
+
+/*
+ * initialize scheduler data for a hardware queue
+ */
+static int dd_init_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	struct mq_deadline_data *dd;
+
+	dd = kzalloc_node(sizeof(*dd), GFP_KERNEL, hctx->numa_node);
+	if (!dd)
+		return -ENOMEM;
+
+	spin_lock_init(&dd->lock);
+	INIT_LIST_HEAD(&dd->fifo_list[READ]);
+	INIT_LIST_HEAD(&dd->fifo_list[WRITE]);
+	dd->sort_list[READ] = RB_ROOT;
+	dd->sort_list[WRITE] = RB_ROOT;
+
+	hctx->sched_data = dd;
+	return 0;
+}
+
+static void dd_exit_hctx(struct blk_mq_hw_ctx *hctx)
+{
+	struct mq_deadline_data *dd = hctx->sched_data;
+
+	WARN_ON_ONCE(!list_empty(&dd->fifo_list[READ]));
+	WARN_ON_ONCE(!list_empty(&dd->fifo_list[WRITE]));
+
+	kfree(dd);
+}
+
+static struct blk_mq_sched_type mq_deadline = {
+	.init_hctx		= dd_init_hctx,
+	.exit_hctx		= dd_exit_hctx,
+	.insert_requests	= dd_insert_requests,
+	.dispatch_request	= dd_dispatch_request,
+	.has_work		= dd_has_work,
+	.name			= "mq-deadline",
+	.owner			= THIS_MODULE,
+};
+
+static int __init deadline_init(void)
+{
+	return blk_mq_sched_register(&mq_deadline);
+}
+
+static void __exit deadline_exit(void)
+{
+	blk_mq_sched_unregister(&mq_deadline);
+}
+
+module_init(deadline_init);
+module_exit(deadline_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("MQ deadline IO scheduler");
@@ -13,10 +13,12 @@
  */
 
 #include <linux/nvme.h>
+#include <linux/async.h>
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
 #include <linux/cpu.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
@@ -36,6 +38,7 @@
 #include <linux/poison.h>
 #include <linux/ptrace.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/t10-pi.h>
 #include <linux/types.h>
@@ -71,6 +74,14 @@ module_param(nvme_char_major, int, 0);
 static int use_threaded_interrupts;
 module_param(use_threaded_interrupts, int, 0);
 
+static bool use_cmb_sqes = true;
+module_param(use_cmb_sqes, bool, 0444);
+MODULE_PARM_DESC(use_cmb_sqes, "use controller's memory buffer for I/O SQes");
+
+static bool latency_stats = true;
+module_param(latency_stats, bool, 0644);
+MODULE_PARM_DESC(latency_stats, "keep I/O completion latency histograms");
+
 static DEFINE_SPINLOCK(dev_list_lock);
 static LIST_HEAD(dev_list);
 static struct task_struct *nvme_thread;
@@ -78,9 +89,11 @@ static struct workqueue_struct *nvme_workq;
 static wait_queue_head_t nvme_kthread_wait;
 
 static struct class *nvme_class;
+static struct dentry *nvme_debugfs_root;
 
 static void nvme_reset_failed_dev(struct work_struct *ws);
 static int nvme_process_cq(struct nvme_queue *nvmeq);
+static void nvme_create_io_queues(struct nvme_dev *dev);
 
 struct async_cmd_info {
 	struct kthread_work work;
@@ -91,9 +104,34 @@ struct async_cmd_info {
 	void *ctx;
 };
 
+/*
+ * Per-tag resources kept by an I/O queue so that the submission path does
+ * not have to allocate.  A tag is owned by exactly one request at a time,
+ * so the entries need no locking.
+ */
+struct nvme_tag_cache {
+	struct nvme_iod *iod;		/* For requests too big to embed */
+	__le64 *prp_page;		/* First page of a long PRP list */
+	dma_addr_t prp_page_dma;
+};
+
+/*
+ * Short PRP lists for a page worth of consecutive tags.  The page is only
+ * allocated once one of those tags first needs a short list.
+ */
+struct nvme_prp_small {
+	void *virt;
+	dma_addr_t dma;
+};
+
 /*
  * An NVM Express queue.  Each device has at least two (one for admin
  * commands and one for I/O commands).
+ *
+ * The q_lock covers the completion queue.  The submission side has its own
+ * sq_lock on a separate cache line, so that submitters and the interrupt
+ * handler don't bounce the same line.  Where both are needed, the q_lock is
+ * taken first.
  */
 struct nvme_queue {
 	struct device *q_dmadev;
@@ -101,20 +139,33 @@ struct nvme_queue {
 	char irqname[24];	/* nvme4294967295-65535\0 */
 	spinlock_t q_lock;
 	struct nvme_command *sq_cmds;
+	struct nvme_command __iomem *sq_cmds_io;
 	volatile struct nvme_completion *cqes;
 	dma_addr_t sq_dma_addr;
 	dma_addr_t cq_dma_addr;
 	u32 __iomem *q_db;
+	u32 *dbbuf_sq_db;
+	u32 *dbbuf_cq_db;
+	u32 *dbbuf_sq_ei;
+	u32 *dbbuf_cq_ei;
 	u16 q_depth;
 	s16 cq_vector;
 	u16 sq_head;
-	u16 sq_tail;
 	u16 cq_head;
 	u16 qid;
 	u8 cq_phase;
 	u8 cqe_seen;
+	struct nvme_lat_hist *lat;	/* Updated under the q_lock */
+	struct dentry *lat_file;
+	struct list_head done_list;	/* Completions of this CQ pass */
 	struct async_cmd_info cmdinfo;
 	struct blk_mq_hw_ctx *hctx;
+	struct nvme_tag_cache *tag_cache;
+	struct nvme_prp_small *prp_small;
+
+	spinlock_t sq_lock ____cacheline_aligned_in_smp;
+	u16 sq_tail;
+	u16 last_sq_tail;	/* Last tail written to the doorbell */
 };
 
 /*
@@ -144,6 +195,7 @@ struct nvme_cmd_info {
 	void *ctx;
 	int aborted;
 	struct nvme_queue *nvmeq;
+	u64 start_ns;		/* Submission time for latency_stats, or 0 */
 	struct nvme_iod iod[0];
 };
 
@@ -164,6 +216,17 @@ static int nvme_npages(unsigned size, struct nvme_dev *dev)
 	return DIV_ROUND_UP(8 * nprps, PAGE_SIZE - 8);
 }
 
+/*
+ * Larger iods are cached per tag once allocated.  Requests beyond these
+ * limits are rare and fall back to kmalloc.
+ */
+#define NVME_CACHED_SEGS	64
+#define NVME_CACHED_BYTES	(8 << 20)
+
+/* Each tag owns one small PRP list, the size of a prp_small_pool entry */
+#define NVME_PRP_SMALL_SIZE	256
+#define NVME_PRP_SMALL_PER_PAGE	(PAGE_SIZE / NVME_PRP_SMALL_SIZE)
+
 static unsigned int nvme_cmd_size(struct nvme_dev *dev)
 {
 	unsigned int ret = sizeof(struct nvme_cmd_info);
@@ -249,17 +312,27 @@ static void nvme_set_info(struct nvme_cmd_info *cmd, void *ctx,
 
 static void *iod_get_private(struct nvme_iod *iod)
 {
-	return (void *) (iod->private & ~0x1UL);
+	return (void *) (iod->private & ~0x3UL);
 }
 
 /*
- * If bit 0 is set, the iod is embedded in the request payload.
+ * If bit 0 is set, the iod is embedded in the request payload or owned by
+ * the queue's tag cache.
  */
 static bool iod_should_kfree(struct nvme_iod *iod)
 {
 	return (iod->private & 0x01) == 0;
 }
 
+/*
+ * If bit 1 is set, the first PRP list (or DSM range) belongs to the queue's
+ * tag cache and must not be returned to the dma pools.
+ */
+static bool iod_prp_cached(struct nvme_iod *iod)
+{
+	return (iod->private & 0x02) != 0;
+}
+
 /* Special values must be less than 0x1000 */
 #define CMD_CTX_BASE		((void *)POISON_POINTER_DELTA)
 #define CMD_CTX_CANCELLED	(0x30C + CMD_CTX_BASE)
@@ -368,22 +441,92 @@ static void *nvme_finish_cmd(struct nvme_queue *nvmeq, int tag,
 	return ctx;
 }
 
+/*
+ * Shadow doorbells: the driver publishes the new SQ tail / CQ head in host
+ * memory and only writes the MMIO doorbell when the controller's event index
+ * says it has stopped watching the shadow copy.  Same test as
+ * vring_need_event().
+ */
+static inline int nvme_dbbuf_need_event(u16 event_idx, u16 new_idx, u16 old)
+{
+	return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old);
+}
+
+/* Update dbbuf and return true if an MMIO doorbell write is required */
+static bool nvme_dbbuf_update_and_check_event(u16 value, u32 *dbbuf_db,
+					      volatile u32 *dbbuf_ei)
+{
+	if (dbbuf_db) {
+		u16 old_value;
+
+		/*
+		 * Ensure that the queue is written before updating
+		 * the doorbell in memory
+		 */
+		wmb();
+
+		old_value = *dbbuf_db;
+		*dbbuf_db = value;
+
+		/*
+		 * Ensure the shadow doorbell is visible before reading the
+		 * event index, otherwise we can race with the controller
+		 * updating it and miss a required MMIO write.
+		 */
+		mb();
+
+		if (!nvme_dbbuf_need_event(*dbbuf_ei, value, old_value))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Tell the controller about any commands copied into the queue since the
+ * last doorbell write.  Called with the sq_lock held.
+ */
+static void nvme_write_sq_db(struct nvme_queue *nvmeq)
+{
+	u16 tail = nvmeq->sq_tail;
+
+	if (tail == nvmeq->last_sq_tail)
+		return;
+	if (nvme_dbbuf_update_and_check_event(tail, nvmeq->dbbuf_sq_db,
+					      nvmeq->dbbuf_sq_ei))
+		writel(tail, nvmeq->q_db);
+	nvmeq->last_sq_tail = tail;
+}
+
+/*
+ * Copy a command into the queue without ringing the doorbell.  Called with
+ * the sq_lock held.
+ */
+static void nvme_copy_cmd(struct nvme_queue *nvmeq, struct nvme_command *cmd)
+{
+	u16 tail = nvmeq->sq_tail;
+
+	if (nvmeq->sq_cmds_io)
+		memcpy_toio(&nvmeq->sq_cmds_io[tail], cmd, sizeof(*cmd));
+	else
+		memcpy(&nvmeq->sq_cmds[tail], cmd, sizeof(*cmd));
+	if (++tail == nvmeq->q_depth)
+		tail = 0;
+	nvmeq->sq_tail = tail;
+}
+
 /**
  * nvme_submit_cmd() - Copy a command into a queue and ring the doorbell
  * @nvmeq: The queue to use
  * @cmd: The command to send
  *
- * Safe to use from interrupt context
+ * Safe to use from interrupt context.  __nvme_submit_cmd() must be called
+ * with the sq_lock held.
  */
 static int __nvme_submit_cmd(struct nvme_queue *nvmeq, struct nvme_command *cmd)
 {
-	u16 tail = nvmeq->sq_tail;
-
-	memcpy(&nvmeq->sq_cmds[tail], cmd, sizeof(*cmd));
-	if (++tail == nvmeq->q_depth)
-		tail = 0;
-	writel(tail, nvmeq->q_db);
-	nvmeq->sq_tail = tail;
+	nvme_copy_cmd(nvmeq, cmd);
+	nvme_write_sq_db(nvmeq);
 
 	return 0;
 }
@@ -392,9 +535,9 @@ static int nvme_submit_cmd(struct nvme_queue *nvmeq, struct nvme_command *cmd)
 {
 	unsigned long flags;
 	int ret;
-	spin_lock_irqsave(&nvmeq->q_lock, flags);
+	spin_lock_irqsave(&nvmeq->sq_lock, flags);
 	ret = __nvme_submit_cmd(nvmeq, cmd);
-	spin_unlock_irqrestore(&nvmeq->q_lock, flags);
+	spin_unlock_irqrestore(&nvmeq->sq_lock, flags);
 	return ret;
 }
 
@@ -427,12 +570,28 @@ __nvme_alloc_iod(unsigned nseg, unsigned bytes, struct nvme_dev *dev,
 	return iod;
 }
 
-static struct nvme_iod *nvme_alloc_iod(struct request *rq, struct nvme_dev *dev,
-			               gfp_t gfp)
+static size_t nvme_cached_iod_size(struct nvme_dev *dev)
+{
+	return sizeof(struct nvme_iod) +
+		sizeof(__le64 *) * nvme_npages(NVME_CACHED_BYTES, dev) +
+		sizeof(struct scatterlist) * NVME_CACHED_SEGS;
+}
+
+static struct nvme_tag_cache *nvme_tag_cache(struct nvme_queue *nvmeq,
+						int tag)
 {
+	if (!nvmeq->tag_cache || tag < 0 || tag >= nvmeq->q_depth)
+		return NULL;
+	return &nvmeq->tag_cache[tag];
+}
+
+static struct nvme_iod *nvme_alloc_iod(struct request *rq,
+			struct nvme_queue *nvmeq, gfp_t gfp)
+{
+	struct nvme_dev *dev = nvmeq->dev;
 	unsigned size = !(rq->cmd_flags & REQ_DISCARD) ? blk_rq_bytes(rq) :
                                                 sizeof(struct nvme_dsm_range);
-	unsigned long mask = 0;
+	struct nvme_tag_cache *tc;
 	struct nvme_iod *iod;
 
 	if (rq->nr_phys_segments <= NVME_INT_PAGES &&
@@ -440,12 +599,25 @@ static struct nvme_iod *nvme_alloc_iod(struct request *rq, struct nvme_dev *dev,
 		struct nvme_cmd_info *cmd = blk_mq_rq_to_pdu(rq);
 
 		iod = cmd->iod;
-		mask = 0x01;
 		iod_init(iod, size, rq->nr_phys_segments,
 				(unsigned long) rq | 0x01);
 		return iod;
 	}
 
+	tc = nvme_tag_cache(nvmeq, rq->tag);
+	if (tc && rq->nr_phys_segments <= NVME_CACHED_SEGS &&
+	    size <= NVME_CACHED_BYTES) {
+		if (!tc->iod)
+			tc->iod = kmalloc_node(nvme_cached_iod_size(dev), gfp,
+						nvmeq->hctx->numa_node);
+		if (tc->iod) {
+			iod = tc->iod;
+			iod_init(iod, size, rq->nr_phys_segments,
+					(unsigned long) rq | 0x01);
+			return iod;
+		}
+	}
+
 	return __nvme_alloc_iod(rq->nr_phys_segments, size, dev,
 				(unsigned long) rq, gfp);
 }
@@ -456,13 +628,15 @@ void nvme_free_iod(struct nvme_dev *dev, struct nvme_iod *iod)
 	int i;
 	__le64 **list = iod_list(iod);
 	dma_addr_t prp_dma = iod->first_dma;
+	bool cached = iod_prp_cached(iod);
 
-	if (iod->npages == 0)
+	if (iod->npages == 0 && !cached)
 		dma_pool_free(dev->prp_small_pool, list[0], prp_dma);
 	for (i = 0; i < iod->npages; i++) {
 		__le64 *prp_list = list[i];
 		dma_addr_t next_prp_dma = le64_to_cpu(prp_list[last_prp]);
-		dma_pool_free(dev->prp_page_pool, prp_list, prp_dma);
+		if (i || !cached)
+			dma_pool_free(dev->prp_page_pool, prp_list, prp_dma);
 		prp_dma = next_prp_dma;
 	}
 
@@ -591,6 +765,40 @@ static void nvme_init_integrity(struct nvme_ns *ns)
 }
 #endif
 
+static int nvme_lat_class(struct request *req)
+{
+	if (req->cmd_flags & REQ_DISCARD)
+		return NVME_LAT_DISCARD;
+	if (req->cmd_flags & REQ_FLUSH)
+		return NVME_LAT_FLUSH;
+	return rq_data_dir(req) ? NVME_LAT_WRITE : NVME_LAT_READ;
+}
+
+/*
+ * Account a completed I/O in its queue's and its namespace's histograms.
+ * The queue's copy is serialised by the q_lock; the namespace's is per-cpu
+ * as all of its queues complete in parallel.  Submission and completion
+ * usually happen on different CPUs, so times are taken with ktime_get_ns(),
+ * which unlike local_clock() is comparable across CPUs, and shifted down to
+ * roughly microseconds.
+ */
+static void nvme_account_latency(struct nvme_queue *nvmeq,
+				struct request *req, u64 start_ns)
+{
+	struct nvme_ns *ns = req->q->queuedata;
+	s64 delta = ktime_get_ns() - start_ns;
+	int class = nvme_lat_class(req);
+	int bucket = 0;
+
+	if (delta >= 1024)
+		bucket = min(ilog2(delta >> 10) + 1, NVME_LAT_BUCKETS - 1);
+
+	if (nvmeq->lat)
+		nvmeq->lat->count[class][bucket]++;
+	if (ns && ns->lat)
+		this_cpu_inc(ns->lat->count[class][bucket]);
+}
+
 static void req_completion(struct nvme_queue *nvmeq, void *ctx,
 						struct nvme_completion *cqe)
 {
@@ -633,13 +841,89 @@ static void req_completion(struct nvme_queue *nvmeq, void *ctx,
 	}
 	nvme_free_iod(nvmeq->dev, iod);
 
-	blk_mq_complete_request(req);
+	if (cmd_rq->start_ns)
+		nvme_account_latency(nvmeq, req, cmd_rq->start_ns);
+
+	/*
+	 * Completed in a batch by whoever called us, once the CQ pass or
+	 * the cancellation is done.  Called with the q_lock held.
+	 */
+	list_add_tail(&req->queuelist, &nvmeq->done_list);
+}
+
+/*
+ * Runs on the submitting CPU, if blk-mq steered the completion there.
+ */
+static void nvme_complete_rq(struct request *req)
+{
+	blk_mq_end_request(req, req->errors);
+}
+
+/*
+ * Get the tag's slot in the short PRP list page of its group, allocating
+ * the page if no tag of the group has needed one yet.  Concurrent
+ * submitters of the same group race under the sq_lock to install it.
+ */
+static __le64 *nvme_get_small_prp_list(struct nvme_dev *dev,
+				struct nvme_queue *nvmeq, int tag,
+				dma_addr_t *dma, gfp_t gfp)
+{
+	struct nvme_prp_small *ps = &nvmeq->prp_small[tag /
+						NVME_PRP_SMALL_PER_PAGE];
+	unsigned int off = (tag % NVME_PRP_SMALL_PER_PAGE) *
+						NVME_PRP_SMALL_SIZE;
+	unsigned long flags;
+	dma_addr_t page_dma;
+	void *page;
+
+	page = ACCESS_ONCE(ps->virt);
+	if (!page) {
+		page = dma_pool_alloc(dev->prp_page_pool, gfp, &page_dma);
+		if (!page)
+			return NULL;
+
+		spin_lock_irqsave(&nvmeq->sq_lock, flags);
+		if (!ps->virt) {
+			ps->dma = page_dma;
+			smp_wmb();
+			ps->virt = page;
+		} else {
+			dma_pool_free(dev->prp_page_pool, page, page_dma);
+			page = ps->virt;
+		}
+		spin_unlock_irqrestore(&nvmeq->sq_lock, flags);
+	}
+	smp_rmb();
+
+	*dma = ps->dma + off;
+	return page + off;
+}
+
+/*
+ * Get the first PRP list for a request from its queue's tag cache instead of
+ * the device-wide dma pools.  Short lists use the tag's slot in its group's
+ * small PRP page; longer ones keep the page they were first given.  Returns
+ * NULL if the memory can't be had, and the caller uses the pools.
+ */
+static __le64 *nvme_get_cached_prp_list(struct nvme_dev *dev,
+				struct nvme_tag_cache *tc, struct nvme_queue *nvmeq,
+				int tag, bool small, dma_addr_t *dma, gfp_t gfp)
+{
+	if (small)
+		return nvme_get_small_prp_list(dev, nvmeq, tag, dma, gfp);
+
+	if (!tc->prp_page)
+		tc->prp_page = dma_pool_alloc(dev->prp_page_pool, gfp,
+							&tc->prp_page_dma);
+	*dma = tc->prp_page_dma;
+	return tc->prp_page;
 }
 
 /* length is in bytes.  gfp flags indicates whether we may sleep. */
-int nvme_setup_prps(struct nvme_dev *dev, struct nvme_iod *iod, int total_len,
-								gfp_t gfp)
+static int __nvme_setup_prps(struct nvme_dev *dev, struct nvme_queue *nvmeq,
+			int tag, struct nvme_iod *iod, int total_len, gfp_t gfp)
 {
+	struct nvme_tag_cache *tc = nvmeq ? nvme_tag_cache(nvmeq, tag) : NULL;
 	struct dma_pool *pool;
 	int length = total_len;
 	struct scatterlist *sg = iod->sg;
@@ -679,7 +963,15 @@ int nvme_setup_prps(struct nvme_dev *dev, struct nvme_iod *iod, int total_len,
 		iod->npages = 1;
 	}
 
-	prp_list = dma_pool_alloc(pool, gfp, &prp_dma);
+	prp_list = NULL;
+	if (tc) {
+		prp_list = nvme_get_cached_prp_list(dev, tc, nvmeq, tag,
+					iod->npages == 0, &prp_dma, gfp);
+		if (prp_list)
+			iod->private |= 0x02;
+	}
+	if (!prp_list)
+		prp_list = dma_pool_alloc(pool, gfp, &prp_dma);
 	if (!prp_list) {
 		iod->first_dma = dma_addr;
 		iod->npages = -1;
@@ -716,6 +1008,30 @@ int nvme_setup_prps(struct nvme_dev *dev, struct nvme_iod *iod, int total_len,
 	return total_len;
 }
 
+int nvme_setup_prps(struct nvme_dev *dev, struct nvme_iod *iod, int total_len,
+								gfp_t gfp)
+{
+	return __nvme_setup_prps(dev, NULL, 0, iod, total_len, gfp);
+}
+
+/*
+ * A request that is one DMA-contiguous range can be described by a single
+ * SGL data block in the command itself.  Only bother when the controller
+ * supports SGLs and PRPs would need a list.
+ */
+static bool nvme_rq_use_sgl(struct nvme_dev *dev, struct request *req,
+				struct nvme_iod *iod)
+{
+	unsigned len = blk_rq_bytes(req);
+
+	if (!(dev->sgls & NVME_CTRL_SGLS_SUPP) || !iod->nents)
+		return false;
+	if (sg_dma_len(iod->sg) != len)
+		return false;
+	return offset_in_page(sg_dma_address(iod->sg)) + len >
+							2 * dev->page_size;
+}
+
 /*
  * We reuse the small pool to allocate the 16-byte range here as it is not
  * worth having a special pool for these or additional cases to handle freeing
@@ -726,45 +1042,41 @@ static void nvme_submit_discard(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 {
 	struct nvme_dsm_range *range =
 				(struct nvme_dsm_range *)iod_list(iod)[0];
-	struct nvme_command *cmnd = &nvmeq->sq_cmds[nvmeq->sq_tail];
+	struct nvme_command cmnd;
 
 	range->cattr = cpu_to_le32(0);
 	range->nlb = cpu_to_le32(blk_rq_bytes(req) >> ns->lba_shift);
 	range->slba = cpu_to_le64(nvme_block_nr(ns, blk_rq_pos(req)));
 
-	memset(cmnd, 0, sizeof(*cmnd));
-	cmnd->dsm.opcode = nvme_cmd_dsm;
-	cmnd->dsm.command_id = req->tag;
-	cmnd->dsm.nsid = cpu_to_le32(ns->ns_id);
-	cmnd->dsm.prp1 = cpu_to_le64(iod->first_dma);
-	cmnd->dsm.nr = 0;
-	cmnd->dsm.attributes = cpu_to_le32(NVME_DSMGMT_AD);
+	memset(&cmnd, 0, sizeof(cmnd));
+	cmnd.dsm.opcode = nvme_cmd_dsm;
+	cmnd.dsm.command_id = req->tag;
+	cmnd.dsm.nsid = cpu_to_le32(ns->ns_id);
+	cmnd.dsm.prp1 = cpu_to_le64(iod->first_dma);
+	cmnd.dsm.nr = 0;
+	cmnd.dsm.attributes = cpu_to_le32(NVME_DSMGMT_AD);
 
-	if (++nvmeq->sq_tail == nvmeq->q_depth)
-		nvmeq->sq_tail = 0;
-	writel(nvmeq->sq_tail, nvmeq->q_db);
+	nvme_copy_cmd(nvmeq, &cmnd);
 }
 
 static void nvme_submit_flush(struct nvme_queue *nvmeq, struct nvme_ns *ns,
 								int cmdid)
 {
-	struct nvme_command *cmnd = &nvmeq->sq_cmds[nvmeq->sq_tail];
+	struct nvme_command cmnd;
 
-	memset(cmnd, 0, sizeof(*cmnd));
-	cmnd->common.opcode = nvme_cmd_flush;
-	cmnd->common.command_id = cmdid;
-	cmnd->common.nsid = cpu_to_le32(ns->ns_id);
+	memset(&cmnd, 0, sizeof(cmnd));
+	cmnd.common.opcode = nvme_cmd_flush;
+	cmnd.common.command_id = cmdid;
+	cmnd.common.nsid = cpu_to_le32(ns->ns_id);
 
-	if (++nvmeq->sq_tail == nvmeq->q_depth)
-		nvmeq->sq_tail = 0;
-	writel(nvmeq->sq_tail, nvmeq->q_db);
+	nvme_copy_cmd(nvmeq, &cmnd);
 }
 
 static int nvme_submit_iod(struct nvme_queue *nvmeq, struct nvme_iod *iod,
 							struct nvme_ns *ns)
 {
 	struct request *req = iod_get_private(iod);
-	struct nvme_command *cmnd;
+	struct nvme_command cmnd;
 	u16 control = 0;
 	u32 dsmgmt = 0;
 
@@ -776,19 +1088,25 @@ static int nvme_submit_iod(struct nvme_queue *nvmeq, struct nvme_iod *iod,
 	if (req->cmd_flags & REQ_RAHEAD)
 		dsmgmt |= NVME_RW_DSM_FREQ_PREFETCH;
 
-	cmnd = &nvmeq->sq_cmds[nvmeq->sq_tail];
-	memset(cmnd, 0, sizeof(*cmnd));
+	memset(&cmnd, 0, sizeof(cmnd));
 
-	cmnd->rw.opcode = (rq_data_dir(req) ? nvme_cmd_write : nvme_cmd_read);
-	cmnd->rw.command_id = req->tag;
-	cmnd->rw.nsid = cpu_to_le32(ns->ns_id);
-	cmnd->rw.prp1 = cpu_to_le64(sg_dma_address(iod->sg));
-	cmnd->rw.prp2 = cpu_to_le64(iod->first_dma);
-	cmnd->rw.slba = cpu_to_le64(nvme_block_nr(ns, blk_rq_pos(req)));
-	cmnd->rw.length = cpu_to_le16((blk_rq_bytes(req) >> ns->lba_shift) - 1);
+	cmnd.rw.opcode = (rq_data_dir(req) ? nvme_cmd_write : nvme_cmd_read);
+	cmnd.rw.command_id = req->tag;
+	cmnd.rw.nsid = cpu_to_le32(ns->ns_id);
+	if (nvme_rq_use_sgl(nvmeq->dev, req, iod)) {
+		cmnd.rw.flags = NVME_CMD_SGL_METABUF;
+		cmnd.rw.sgl.addr = cpu_to_le64(sg_dma_address(iod->sg));
+		cmnd.rw.sgl.length = cpu_to_le32(blk_rq_bytes(req));
+		cmnd.rw.sgl.type = NVME_SGL_FMT_DATA_DESC << 4;
+	} else {
+		cmnd.rw.prp1 = cpu_to_le64(sg_dma_address(iod->sg));
+		cmnd.rw.prp2 = cpu_to_le64(iod->first_dma);
+	}
+	cmnd.rw.slba = cpu_to_le64(nvme_block_nr(ns, blk_rq_pos(req)));
+	cmnd.rw.length = cpu_to_le16((blk_rq_bytes(req) >> ns->lba_shift) - 1);
 
 	if (blk_integrity_rq(req)) {
-		cmnd->rw.metadata = cpu_to_le64(sg_dma_address(iod->meta_sg));
+		cmnd.rw.metadata = cpu_to_le64(sg_dma_address(iod->meta_sg));
 		switch (ns->pi_type) {
 		case NVME_NS_DPS_PI_TYPE3:
 			control |= NVME_RW_PRINFO_PRCHK_GUARD;
@@ -797,23 +1115,30 @@ static int nvme_submit_iod(struct nvme_queue *nvmeq, struct nvme_iod *iod,
 		case NVME_NS_DPS_PI_TYPE2:
 			control |= NVME_RW_PRINFO_PRCHK_GUARD |
 					NVME_RW_PRINFO_PRCHK_REF;
-			cmnd->rw.reftag = cpu_to_le32(
+			cmnd.rw.reftag = cpu_to_le32(
 					nvme_block_nr(ns, blk_rq_pos(req)));
 			break;
 		}
 	} else if (ns->ms)
 		control |= NVME_RW_PRINFO_PRACT;
 
-	cmnd->rw.control = cpu_to_le16(control);
-	cmnd->rw.dsmgmt = cpu_to_le32(dsmgmt);
+	cmnd.rw.control = cpu_to_le16(control);
+	cmnd.rw.dsmgmt = cpu_to_le32(dsmgmt);
 
-	if (++nvmeq->sq_tail == nvmeq->q_depth)
-		nvmeq->sq_tail = 0;
-	writel(nvmeq->sq_tail, nvmeq->q_db);
+	nvme_copy_cmd(nvmeq, &cmnd);
 
 	return 0;
 }
 
+static void nvme_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+	struct nvme_queue *nvmeq = hctx->driver_data;
+
+	spin_lock_irq(&nvmeq->sq_lock);
+	nvme_write_sq_db(nvmeq);
+	spin_unlock_irq(&nvmeq->sq_lock);
+}
+
 static int nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 			 const struct blk_mq_queue_data *bd)
 {
@@ -833,22 +1158,35 @@ static int nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 		if (!(ns->pi_type && ns->ms == 8)) {
 			req->errors = -EFAULT;
 			blk_mq_complete_request(req);
+			if (bd->last)
+				nvme_commit_rqs(hctx);
 			return BLK_MQ_RQ_QUEUE_OK;
 		}
 	}
 
-	iod = nvme_alloc_iod(req, ns->dev, GFP_ATOMIC);
+	iod = nvme_alloc_iod(req, nvmeq, GFP_ATOMIC);
 	if (!iod)
 		return BLK_MQ_RQ_QUEUE_BUSY;
 
 	if (req->cmd_flags & REQ_DISCARD) {
+		struct nvme_tag_cache *tc = nvme_tag_cache(nvmeq, req->tag);
 		void *range;
 		/*
 		 * We reuse the small pool to allocate the 16-byte range here
 		 * as it is not worth having a special pool for these or
-		 * additional cases to handle freeing the iod.
+		 * additional cases to handle freeing the iod.  The tag's
+		 * small PRP slot serves the same purpose without the pool.
 		 */
-		range = dma_pool_alloc(nvmeq->dev->prp_small_pool,
+		range = NULL;
+		if (tc) {
+			range = nvme_get_cached_prp_list(nvmeq->dev, tc, nvmeq,
+					req->tag, true, &iod->first_dma,
+					GFP_ATOMIC);
+			if (range)
+				iod->private |= 0x02;
+		}
+		if (!range)
+			range = dma_pool_alloc(nvmeq->dev->prp_small_pool,
 						GFP_ATOMIC,
 						&iod->first_dma);
 		if (!range)
@@ -866,8 +1204,9 @@ static int nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 		if (!dma_map_sg(nvmeq->q_dmadev, iod->sg, iod->nents, dma_dir))
 			goto retry_cmd;
 
-		if (blk_rq_bytes(req) !=
-                    nvme_setup_prps(nvmeq->dev, iod, blk_rq_bytes(req), GFP_ATOMIC)) {
+		if (!nvme_rq_use_sgl(nvmeq->dev, req, iod) &&
+		    blk_rq_bytes(req) != __nvme_setup_prps(nvmeq->dev, nvmeq,
+				req->tag, iod, blk_rq_bytes(req), GFP_ATOMIC)) {
 			dma_unmap_sg(&nvmeq->dev->pci_dev->dev, iod->sg,
 					iod->nents, dma_dir);
 			goto retry_cmd;
@@ -890,7 +1229,8 @@ static int nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 	}
 
 	nvme_set_info(cmd, iod, req_completion);
-	spin_lock_irq(&nvmeq->q_lock);
+	cmd->start_ns = latency_stats ? ktime_get_ns() : 0;
+	spin_lock_irq(&nvmeq->sq_lock);
 	if (req->cmd_flags & REQ_DISCARD)
 		nvme_submit_discard(nvmeq, ns, req, iod);
 	else if (req->cmd_flags & REQ_FLUSH)
@@ -898,8 +1238,13 @@ static int nvme_queue_rq(struct blk_mq_hw_ctx *hctx,
 	else
 		nvme_submit_iod(nvmeq, iod, ns);
 
-	nvme_process_cq(nvmeq);
-	spin_unlock_irq(&nvmeq->q_lock);
+	/*
+	 * Only ring the doorbell for the last request of a dispatch batch;
+	 * if the batch is cut short, nvme_commit_rqs() rings it instead.
+	 */
+	if (bd->last)
+		nvme_write_sq_db(nvmeq);
+	spin_unlock_irq(&nvmeq->sq_lock);
 	return BLK_MQ_RQ_QUEUE_OK;
 
  error_cmd:
@@ -932,6 +1277,9 @@ static int nvme_process_cq(struct nvme_queue *nvmeq)
 		fn(nvmeq, ctx, &cqe);
 	}
 
+	if (!list_empty(&nvmeq->done_list))
+		blk_mq_complete_requests(&nvmeq->done_list);
+
 	/* If the controller ignores the cq head doorbell and continuously
 	 * writes to the queue, it is theoretically possible to wrap around
 	 * the queue twice and mistakenly return IRQ_NONE.  Linux only
@@ -941,7 +1289,9 @@ static int nvme_process_cq(struct nvme_queue *nvmeq)
 	if (head == nvmeq->cq_head && phase == nvmeq->cq_phase)
 		return 0;
 
-	writel(head, nvmeq->q_db + nvmeq->dev->db_stride);
+	if (nvme_dbbuf_update_and_check_event(head, nvmeq->dbbuf_cq_db,
+					      nvmeq->dbbuf_cq_ei))
+		writel(head, nvmeq->q_db + nvmeq->dev->db_stride);
 	nvmeq->cq_head = head;
 	nvmeq->cq_phase = phase;
 
@@ -979,6 +1329,29 @@ static irqreturn_t nvme_irq_check(int irq, void *data)
 	return IRQ_WAKE_THREAD;
 }
 
+/*
+ * blk_poll() callback.  The phase check is done without the q_lock so a
+ * spinning submitter only bounces the lock when there is work to reap.
+ */
+static int nvme_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct nvme_queue *nvmeq = hctx->driver_data;
+	struct nvme_completion cqe = nvmeq->cqes[nvmeq->cq_head];
+	int found = 0;
+
+	if ((le16_to_cpu(cqe.status) & 1) != nvmeq->cq_phase)
+		return 0;
+
+	spin_lock_irq(&nvmeq->q_lock);
+	if (nvmeq->cq_vector == -1)
+		found = -1;
+	else
+		found = nvme_process_cq(nvmeq);
+	spin_unlock_irq(&nvmeq->q_lock);
+
+	return found;
+}
+
 struct sync_cmd_info {
 	struct task_struct *task;
 	u32 result;
@@ -1040,7 +1413,7 @@ static int nvme_submit_async_admin_req(struct nvme_dev *dev)
 	c.common.opcode = nvme_admin_async_event;
 	c.common.command_id = req->tag;
 
-	return __nvme_submit_cmd(nvmeq, &c);
+	return nvme_submit_cmd(nvmeq, &c);
 }
 
 static int nvme_submit_admin_async_cmd(struct nvme_dev *dev,
@@ -1112,20 +1485,40 @@ static int adapter_delete_queue(struct nvme_dev *dev, u8 opcode, u16 id)
 	return nvme_submit_admin_cmd(dev, &c, NULL);
 }
 
-static int adapter_alloc_cq(struct nvme_dev *dev, u16 qid,
+static void nvme_init_create_cq(struct nvme_command *c, u16 qid,
 						struct nvme_queue *nvmeq)
 {
-	struct nvme_command c;
 	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED;
 
-	memset(&c, 0, sizeof(c));
-	c.create_cq.opcode = nvme_admin_create_cq;
-	c.create_cq.prp1 = cpu_to_le64(nvmeq->cq_dma_addr);
-	c.create_cq.cqid = cpu_to_le16(qid);
-	c.create_cq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
-	c.create_cq.cq_flags = cpu_to_le16(flags);
-	c.create_cq.irq_vector = cpu_to_le16(nvmeq->cq_vector);
+	memset(c, 0, sizeof(*c));
+	c->create_cq.opcode = nvme_admin_create_cq;
+	c->create_cq.prp1 = cpu_to_le64(nvmeq->cq_dma_addr);
+	c->create_cq.cqid = cpu_to_le16(qid);
+	c->create_cq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
+	c->create_cq.cq_flags = cpu_to_le16(flags);
+	c->create_cq.irq_vector = cpu_to_le16(nvmeq->cq_vector);
+}
+
+static void nvme_init_create_sq(struct nvme_command *c, u16 qid,
+						struct nvme_queue *nvmeq)
+{
+	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_SQ_PRIO_MEDIUM;
+
+	memset(c, 0, sizeof(*c));
+	c->create_sq.opcode = nvme_admin_create_sq;
+	c->create_sq.prp1 = cpu_to_le64(nvmeq->sq_dma_addr);
+	c->create_sq.sqid = cpu_to_le16(qid);
+	c->create_sq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
+	c->create_sq.sq_flags = cpu_to_le16(flags);
+	c->create_sq.cqid = cpu_to_le16(qid);
+}
+
+static int adapter_alloc_cq(struct nvme_dev *dev, u16 qid,
+						struct nvme_queue *nvmeq)
+{
+	struct nvme_command c;
 
+	nvme_init_create_cq(&c, qid, nvmeq);
 	return nvme_submit_admin_cmd(dev, &c, NULL);
 }
 
@@ -1133,16 +1526,8 @@ static int adapter_alloc_sq(struct nvme_dev *dev, u16 qid,
 						struct nvme_queue *nvmeq)
 {
 	struct nvme_command c;
-	int flags = NVME_QUEUE_PHYS_CONTIG | NVME_SQ_PRIO_MEDIUM;
-
-	memset(&c, 0, sizeof(c));
-	c.create_sq.opcode = nvme_admin_create_sq;
-	c.create_sq.prp1 = cpu_to_le64(nvmeq->sq_dma_addr);
-	c.create_sq.sqid = cpu_to_le16(qid);
-	c.create_sq.qsize = cpu_to_le16(nvmeq->q_depth - 1);
-	c.create_sq.sq_flags = cpu_to_le16(flags);
-	c.create_sq.cqid = cpu_to_le16(qid);
 
+	nvme_init_create_sq(&c, qid, nvmeq);
 	return nvme_submit_admin_cmd(dev, &c, NULL);
 }
 
@@ -1198,6 +1583,104 @@ int nvme_set_features(struct nvme_dev *dev, unsigned fid, unsigned dword11,
 	return nvme_submit_admin_cmd(dev, &c, result);
 }
 
+static size_t nvme_dbbuf_size(struct nvme_dev *dev)
+{
+	return (num_possible_cpus() + 1) * 8 * dev->db_stride;
+}
+
+static int nvme_dbbuf_dma_alloc(struct nvme_dev *dev)
+{
+	size_t mem_size = nvme_dbbuf_size(dev);
+
+	if (dev->dbbuf_dbs) {
+		memset(dev->dbbuf_dbs, 0, mem_size);
+		memset(dev->dbbuf_eis, 0, mem_size);
+		return 0;
+	}
+
+	dev->dbbuf_dbs = dma_zalloc_coherent(&dev->pci_dev->dev, mem_size,
+					&dev->dbbuf_dbs_dma_addr, GFP_KERNEL);
+	if (!dev->dbbuf_dbs)
+		return -ENOMEM;
+	dev->dbbuf_eis = dma_zalloc_coherent(&dev->pci_dev->dev, mem_size,
+					&dev->dbbuf_eis_dma_addr, GFP_KERNEL);
+	if (!dev->dbbuf_eis) {
+		dma_free_coherent(&dev->pci_dev->dev, mem_size,
+				dev->dbbuf_dbs, dev->dbbuf_dbs_dma_addr);
+		dev->dbbuf_dbs = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void nvme_dbbuf_dma_free(struct nvme_dev *dev)
+{
+	size_t mem_size = nvme_dbbuf_size(dev);
+
+	if (dev->dbbuf_dbs) {
+		dma_free_coherent(&dev->pci_dev->dev, mem_size,
+				dev->dbbuf_dbs, dev->dbbuf_dbs_dma_addr);
+		dev->dbbuf_dbs = NULL;
+	}
+	if (dev->dbbuf_eis) {
+		dma_free_coherent(&dev->pci_dev->dev, mem_size,
+				dev->dbbuf_eis, dev->dbbuf_eis_dma_addr);
+		dev->dbbuf_eis = NULL;
+	}
+}
+
+/*
+ * Point an I/O queue at its slots in the shadow doorbell buffers, or detach
+ * it if shadow doorbells are not in use.  The admin queue always rings the
+ * MMIO doorbell.  The queue must be idle or its q_lock held.
+ */
+static void nvme_dbbuf_init(struct nvme_dev *dev, struct nvme_queue *nvmeq,
+				int qid)
+{
+	if (!dev->dbbuf_dbs || !qid) {
+		nvmeq->dbbuf_sq_db = NULL;
+		nvmeq->dbbuf_cq_db = NULL;
+		nvmeq->dbbuf_sq_ei = NULL;
+		nvmeq->dbbuf_cq_ei = NULL;
+		return;
+	}
+
+	nvmeq->dbbuf_sq_db = &dev->dbbuf_dbs[qid * 2 * dev->db_stride];
+	nvmeq->dbbuf_cq_db = &dev->dbbuf_dbs[(qid * 2 + 1) * dev->db_stride];
+	nvmeq->dbbuf_sq_ei = &dev->dbbuf_eis[qid * 2 * dev->db_stride];
+	nvmeq->dbbuf_cq_ei = &dev->dbbuf_eis[(qid * 2 + 1) * dev->db_stride];
+}
+
+/*
+ * Hand the shadow doorbell and event index buffers to the controller.  This
+ * has to be redone after every controller reset, before the I/O queues are
+ * created.  Shadow doorbells are dropped if the controller refuses them.
+ */
+static void nvme_dbbuf_set(struct nvme_dev *dev)
+{
+	struct nvme_command c;
+
+	if (!(dev->oacs & NVME_CTRL_OACS_DBBUF_SUPP))
+		return;
+	if (nvme_dbbuf_dma_alloc(dev))
+		return;
+
+	memset(&c, 0, sizeof(c));
+	c.common.opcode = nvme_admin_dbbuf;
+	c.common.prp1 = cpu_to_le64(dev->dbbuf_dbs_dma_addr);
+	c.common.prp2 = cpu_to_le64(dev->dbbuf_eis_dma_addr);
+
+	if (nvme_submit_admin_cmd(dev, &c, NULL)) {
+		unsigned i;
+
+		dev_warn(&dev->pci_dev->dev, "unable to set dbbuf\n");
+		for (i = 1; i < dev->queue_count; i++)
+			nvme_dbbuf_init(dev, dev->queues[i], 0);
+		nvme_dbbuf_dma_free(dev);
+	}
+}
+
 /**
  * nvme_abort_req - Attempt aborting a request
  *
@@ -1308,11 +1791,221 @@ static enum blk_eh_timer_return nvme_timeout(struct request *req, bool reserved)
 	return BLK_EH_RESET_TIMER;
 }
 
+static void nvme_free_tag_cache(struct nvme_queue *nvmeq)
+{
+	int i;
+
+	if (!nvmeq->tag_cache)
+		return;
+
+	for (i = 0; i < nvmeq->q_depth; i++) {
+		struct nvme_tag_cache *tc = &nvmeq->tag_cache[i];
+
+		kfree(tc->iod);
+		if (tc->prp_page)
+			dma_pool_free(nvmeq->dev->prp_page_pool, tc->prp_page,
+							tc->prp_page_dma);
+	}
+	for (i = 0; i < DIV_ROUND_UP(nvmeq->q_depth,
+					NVME_PRP_SMALL_PER_PAGE); i++) {
+		struct nvme_prp_small *ps = &nvmeq->prp_small[i];
+
+		if (ps->virt)
+			dma_pool_free(nvmeq->dev->prp_page_pool, ps->virt,
+							ps->dma);
+	}
+	kfree(nvmeq->prp_small);
+	nvmeq->prp_small = NULL;
+	kfree(nvmeq->tag_cache);
+	nvmeq->tag_cache = NULL;
+}
+
+/*
+ * Give an I/O queue per-tag iod and PRP list storage, so that the
+ * submission path doesn't go through kmalloc or the device-wide dma pools.
+ * The queue still works without it.
+ */
+static void nvme_alloc_tag_cache(struct nvme_dev *dev,
+				struct nvme_queue *nvmeq, int depth)
+{
+	int node = dev_to_node(&dev->pci_dev->dev);
+
+	nvmeq->tag_cache = kzalloc_node(depth * sizeof(*nvmeq->tag_cache),
+							GFP_KERNEL, node);
+	if (!nvmeq->tag_cache)
+		return;
+
+	nvmeq->prp_small = kzalloc_node(DIV_ROUND_UP(depth,
+					NVME_PRP_SMALL_PER_PAGE) *
+					sizeof(*nvmeq->prp_small),
+					GFP_KERNEL, node);
+	if (!nvmeq->prp_small) {
+		kfree(nvmeq->tag_cache);
+		nvmeq->tag_cache = NULL;
+	}
+}
+
+static const char * const nvme_lat_names[NVME_LAT_CLASSES] = {
+	[NVME_LAT_READ]		= "read",
+	[NVME_LAT_WRITE]	= "write",
+	[NVME_LAT_FLUSH]	= "flush",
+	[NVME_LAT_DISCARD]	= "discard",
+};
+
+/*
+ * Print one row per command class, one column per bucket.  The header gives
+ * each bucket's lower bound in microseconds.
+ */
+static void nvme_lat_show(struct seq_file *m, struct nvme_lat_hist *hist,
+				struct nvme_lat_hist __percpu *pcpu_hist)
+{
+	int class, bucket, cpu;
+
+	seq_printf(m, "%-8s", "usecs");
+	for (bucket = 0; bucket < NVME_LAT_BUCKETS; bucket++)
+		seq_printf(m, " %lu", bucket ? 1UL << (bucket - 1) : 0);
+	seq_putc(m, '\n');
+
+	for (class = 0; class < NVME_LAT_CLASSES; class++) {
+		seq_printf(m, "%-8s", nvme_lat_names[class]);
+		for (bucket = 0; bucket < NVME_LAT_BUCKETS; bucket++) {
+			unsigned long count = 0;
+
+			if (hist)
+				count = hist->count[class][bucket];
+			if (pcpu_hist)
+				for_each_possible_cpu(cpu)
+					count += per_cpu_ptr(pcpu_hist,
+						cpu)->count[class][bucket];
+			seq_printf(m, " %lu", count);
+		}
+		seq_putc(m, '\n');
+	}
+}
+
+static int nvme_queue_lat_show(struct seq_file *m, void *v)
+{
+	struct nvme_queue *nvmeq = m->private;
+
+	nvme_lat_show(m, nvmeq->lat, NULL);
+	return 0;
+}
+
+static int nvme_ns_lat_show(struct seq_file *m, void *v)
+{
+	struct nvme_ns *ns = m->private;
+
+	nvme_lat_show(m, NULL, ns->lat);
+	return 0;
+}
+
+static int nvme_queue_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvme_queue_lat_show, inode->i_private);
+}
+
+static int nvme_ns_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvme_ns_lat_show, inode->i_private);
+}
+
+/*
+ * Any write clears the histogram.  Completions racing with the reset may
+ * survive it; that's fine for statistics.
+ */
+static ssize_t nvme_queue_lat_write(struct file *file, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct nvme_queue *nvmeq = m->private;
+
+	memset(nvmeq->lat, 0, sizeof(*nvmeq->lat));
+	return count;
+}
+
+static ssize_t nvme_ns_lat_write(struct file *file, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct nvme_ns *ns = m->private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(ns->lat, cpu), 0, sizeof(*ns->lat));
+	return count;
+}
+
+static const struct file_operations nvme_queue_lat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvme_queue_lat_open,
+	.read		= seq_read,
+	.write		= nvme_queue_lat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations nvme_ns_lat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvme_ns_lat_open,
+	.read		= seq_read,
+	.write		= nvme_ns_lat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Latency histograms are optional: without memory or debugfs the queue or
+ * namespace simply goes unaccounted.
+ */
+static void nvme_queue_lat_init(struct nvme_dev *dev, struct nvme_queue *nvmeq)
+{
+	char name[16];
+
+	if (IS_ERR_OR_NULL(dev->debugfs_dir))
+		return;
+	nvmeq->lat = kzalloc_node(sizeof(*nvmeq->lat), GFP_KERNEL,
+					dev_to_node(&dev->pci_dev->dev));
+	if (!nvmeq->lat)
+		return;
+	snprintf(name, sizeof(name), "q%d", nvmeq->qid);
+	nvmeq->lat_file = debugfs_create_file(name, S_IRUGO | S_IWUSR,
+				dev->debugfs_dir, nvmeq, &nvme_queue_lat_fops);
+}
+
+static void nvme_queue_lat_free(struct nvme_queue *nvmeq)
+{
+	debugfs_remove(nvmeq->lat_file);
+	kfree(nvmeq->lat);
+}
+
+static void nvme_ns_lat_init(struct nvme_dev *dev, struct nvme_ns *ns)
+{
+	char name[16];
+
+	if (IS_ERR_OR_NULL(dev->debugfs_dir))
+		return;
+	ns->lat = alloc_percpu(struct nvme_lat_hist);
+	if (!ns->lat)
+		return;
+	snprintf(name, sizeof(name), "n%d", ns->ns_id);
+	ns->lat_file = debugfs_create_file(name, S_IRUGO | S_IWUSR,
+				dev->debugfs_dir, ns, &nvme_ns_lat_fops);
+}
+
+static void nvme_ns_lat_free(struct nvme_ns *ns)
+{
+	debugfs_remove(ns->lat_file);
+	free_percpu(ns->lat);
+}
+
 static void nvme_free_queue(struct nvme_queue *nvmeq)
 {
+	nvme_queue_lat_free(nvmeq);
+	nvme_free_tag_cache(nvmeq);
 	dma_free_coherent(nvmeq->q_dmadev, CQ_SIZE(nvmeq->q_depth),
 				(void *)nvmeq->cqes, nvmeq->cq_dma_addr);
-	dma_free_coherent(nvmeq->q_dmadev, SQ_SIZE(nvmeq->q_depth),
+	if (nvmeq->sq_cmds)
+		dma_free_coherent(nvmeq->q_dmadev, SQ_SIZE(nvmeq->q_depth),
 					nvmeq->sq_cmds, nvmeq->sq_dma_addr);
 	kfree(nvmeq);
 }
@@ -1360,6 +2053,7 @@ static void nvme_clear_queue(struct nvme_queue *nvmeq)
 	spin_lock_irq(&nvmeq->q_lock);
 	if (hctx && hctx->tags)
 		blk_mq_tag_busy_iter(hctx, nvme_cancel_queue_ios, nvmeq);
+	blk_mq_complete_requests(&nvmeq->done_list);
 	spin_unlock_irq(&nvmeq->q_lock);
 }
 
@@ -1386,6 +2080,57 @@ static void nvme_disable_queue(struct nvme_dev *dev, int qid)
 	spin_unlock_irq(&nvmeq->q_lock);
 }
 
+static int nvme_cmb_qdepth(struct nvme_dev *dev, int nr_io_queues,
+				int entry_size)
+{
+	int q_depth = dev->q_depth;
+	unsigned q_size_aligned = roundup(q_depth * entry_size, dev->page_size);
+
+	if (q_size_aligned * nr_io_queues > dev->cmb_size) {
+		u64 mem_per_q = div_u64(dev->cmb_size, nr_io_queues);
+		mem_per_q = round_down(mem_per_q, dev->page_size);
+		q_depth = div_u64(mem_per_q, entry_size);
+
+		/*
+		 * Ensure the reduced q_depth is above some threshold where it
+		 * would be better to map queues in system memory with the
+		 * original depth
+		 */
+		if (q_depth < 64)
+			return -ENOMEM;
+	}
+
+	return q_depth;
+}
+
+/*
+ * I/O submission queues live in the controller memory buffer when one was
+ * mapped; the admin queue always stays in host memory.
+ */
+static int nvme_alloc_sq_cmds(struct nvme_dev *dev, struct nvme_queue *nvmeq,
+				int qid, int depth)
+{
+	if (qid && dev->cmb && use_cmb_sqes && NVME_CMB_SQS(dev->cmbsz)) {
+		u64 offset = (u64)(qid - 1) *
+					roundup(SQ_SIZE(depth), dev->page_size);
+
+		/* More queues than the layout was made for may not fit */
+		if (offset + SQ_SIZE(depth) <= dev->cmb_size) {
+			nvmeq->sq_dma_addr = dev->cmb_dma_addr + offset;
+			nvmeq->sq_cmds_io = dev->cmb + offset;
+			return 0;
+		}
+	}
+
+	nvmeq->sq_cmds = dma_alloc_coherent(&dev->pci_dev->dev,
+				SQ_SIZE(depth), &nvmeq->sq_dma_addr,
+				GFP_KERNEL);
+	if (!nvmeq->sq_cmds)
+		return -ENOMEM;
+
+	return 0;
+}
+
 static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 							int depth)
 {
@@ -1399,9 +2144,7 @@ static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 	if (!nvmeq->cqes)
 		goto free_nvmeq;
 
-	nvmeq->sq_cmds = dma_alloc_coherent(dmadev, SQ_SIZE(depth),
-					&nvmeq->sq_dma_addr, GFP_KERNEL);
-	if (!nvmeq->sq_cmds)
+	if (nvme_alloc_sq_cmds(dev, nvmeq, qid, depth))
 		goto free_cqdma;
 
 	nvmeq->q_dmadev = dmadev;
@@ -1409,11 +2152,17 @@ static struct nvme_queue *nvme_alloc_queue(struct nvme_dev *dev, int qid,
 	snprintf(nvmeq->irqname, sizeof(nvmeq->irqname), "nvme%dq%d",
 			dev->instance, qid);
 	spin_lock_init(&nvmeq->q_lock);
+	spin_lock_init(&nvmeq->sq_lock);
+	INIT_LIST_HEAD(&nvmeq->done_list);
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
 	nvmeq->q_depth = depth;
 	nvmeq->qid = qid;
+	if (qid) {
+		nvme_alloc_tag_cache(dev, nvmeq, depth);
+		nvme_queue_lat_init(dev, nvmeq);
+	}
 	dev->queue_count++;
 	dev->queues[qid] = nvmeq;
 
@@ -1443,10 +2192,14 @@ static void nvme_init_queue(struct nvme_queue *nvmeq, u16 qid)
 	struct nvme_dev *dev = nvmeq->dev;
 
 	spin_lock_irq(&nvmeq->q_lock);
+	spin_lock(&nvmeq->sq_lock);
 	nvmeq->sq_tail = 0;
+	nvmeq->last_sq_tail = 0;
+	spin_unlock(&nvmeq->sq_lock);
 	nvmeq->cq_head = 0;
 	nvmeq->cq_phase = 1;
 	nvmeq->q_db = &dev->dbs[qid * 2 * dev->db_stride];
+	nvme_dbbuf_init(dev, nvmeq, qid);
 	memset((void *)nvmeq->cqes, 0, CQ_SIZE(nvmeq->q_depth));
 	dev->online_queues++;
 	spin_unlock_irq(&nvmeq->q_lock);
@@ -1562,16 +2315,19 @@ static struct blk_mq_ops nvme_mq_admin_ops = {
 
 static struct blk_mq_ops nvme_mq_ops = {
 	.queue_rq	= nvme_queue_rq,
+	.commit_rqs	= nvme_commit_rqs,
+	.complete	= nvme_complete_rq,
 	.map_queue	= blk_mq_map_queue,
 	.init_hctx	= nvme_init_hctx,
 	.exit_hctx	= nvme_exit_hctx,
 	.init_request	= nvme_init_request,
 	.timeout	= nvme_timeout,
+	.poll		= nvme_poll,
 };
 
 static void nvme_dev_remove_admin(struct nvme_dev *dev)
 {
-	if (dev->admin_q && !blk_queue_dying(dev->admin_q)) {
+	if (dev->admin_q && !blk_queue_dead(dev->admin_q)) {
 		blk_cleanup_queue(dev->admin_q);
 		blk_mq_free_tag_set(&dev->admin_tagset);
 	}
@@ -2128,6 +2884,28 @@ static int nvme_kthread(void *data)
 	return 0;
 }
 
+/*
+ * Identify the namespace and register its disk.  Runs from the async domain
+ * so that namespaces, and the Identify commands they issue, are handled in
+ * parallel.
+ */
+static void nvme_add_ns_async(void *data, async_cookie_t cookie)
+{
+	struct nvme_ns *ns = data;
+
+	/*
+	 * Initialize capacity to 0 until we establish the namespace format and
+	 * setup integrity extentions if necessary. The revalidate_disk after
+	 * add_disk allows the driver to register with integrity if the format
+	 * requires it.
+	 */
+	set_capacity(ns->disk, 0);
+	nvme_revalidate_disk(ns->disk);
+	add_disk(ns->disk);
+	if (ns->ms)
+		revalidate_disk(ns->disk);
+}
+
 static void nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid)
 {
 	struct nvme_ns *ns;
@@ -2155,6 +2933,7 @@ static void nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid)
 	ns->disk = disk;
 	ns->lba_shift = 9; /* set to a default value for 512 until disk is validated */
 	list_add_tail(&ns->list, &dev->namespaces);
+	nvme_ns_lat_init(dev, ns);
 
 	blk_queue_logical_block_size(ns->queue, 1 << ns->lba_shift);
 	if (dev->max_hw_sectors)
@@ -2173,17 +2952,7 @@ static void nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid)
 	disk->flags = GENHD_FL_EXT_DEVT;
 	sprintf(disk->disk_name, "nvme%dn%d", dev->instance, nsid);
 
-	/*
-	 * Initialize capacity to 0 until we establish the namespace format and
-	 * setup integrity extentions if necessary. The revalidate_disk after
-	 * add_disk allows the driver to register with integrity if the format
-	 * requires it.
-	 */
-	set_capacity(disk, 0);
-	nvme_revalidate_disk(ns->disk);
-	add_disk(ns->disk);
-	if (ns->ms)
-		revalidate_disk(ns->disk);
+	async_schedule_domain(nvme_add_ns_async, ns, &dev->ns_domain);
 	return;
  out_free_queue:
 	blk_cleanup_queue(ns->queue);
@@ -2191,19 +2960,6 @@ static void nvme_alloc_ns(struct nvme_dev *dev, unsigned nsid)
 	kfree(ns);
 }
 
-static void nvme_create_io_queues(struct nvme_dev *dev)
-{
-	unsigned i;
-
-	for (i = dev->queue_count; i <= dev->max_qid; i++)
-		if (!nvme_alloc_queue(dev, i, dev->q_depth))
-			break;
-
-	for (i = dev->online_queues; i <= dev->queue_count - 1; i++)
-		if (nvme_create_queue(dev->queues[i], i))
-			break;
-}
-
 static int set_queue_count(struct nvme_dev *dev, int count)
 {
 	int status;
@@ -2222,6 +2978,60 @@ static int set_queue_count(struct nvme_dev *dev, int count)
 	return min(result & 0xffff, result >> 16) + 1;
 }
 
+static void __iomem *nvme_map_cmb(struct nvme_dev *dev)
+{
+	u64 szu, size, offset;
+	u32 cmbloc;
+	resource_size_t bar_size;
+	struct pci_dev *pdev = dev->pci_dev;
+	void __iomem *cmb;
+	resource_size_t start;
+
+	if (!use_cmb_sqes)
+		return NULL;
+
+	dev->cmbsz = readl(&dev->bar->cmbsz);
+	if (!(NVME_CMB_SZ(dev->cmbsz)))
+		return NULL;
+
+	cmbloc = readl(&dev->bar->cmbloc);
+
+	szu = (u64)1 << (12 + 4 * NVME_CMB_SZU(dev->cmbsz));
+	size = szu * NVME_CMB_SZ(dev->cmbsz);
+	offset = szu * NVME_CMB_OFST(cmbloc);
+	bar_size = pci_resource_len(pdev, NVME_CMB_BIR(cmbloc));
+
+	if (offset > bar_size)
+		return NULL;
+
+	/*
+	 * Controllers may support a CMB size larger than their BAR,
+	 * for example, due to being behind a bridge. Reduce the CMB to
+	 * the reported size of the BAR
+	 */
+	if (size > bar_size - offset)
+		size = bar_size - offset;
+
+	start = pci_resource_start(pdev, NVME_CMB_BIR(cmbloc)) + offset;
+	cmb = ioremap_wc(start, size);
+	if (!cmb)
+		return NULL;
+
+	dev->cmb_dma_addr = pci_bus_address(pdev, NVME_CMB_BIR(cmbloc)) +
+									offset;
+	dev->cmb_size = size;
+	return cmb;
+}
+
+static void nvme_release_cmb(struct nvme_dev *dev)
+{
+	if (dev->cmb) {
+		iounmap(dev->cmb);
+		dev->cmb = NULL;
+		dev->cmb_q_depth = 0;
+	}
+}
+
 static size_t db_bar_size(struct nvme_dev *dev, unsigned nr_io_queues)
 {
 	return 4096 + ((nr_io_queues + 1) * 8 * dev->db_stride);
@@ -2240,6 +3050,24 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	if (result < nr_io_queues)
 		nr_io_queues = result;
 
+	/*
+	 * I/O queues kept across a reset still have their SQs at the offsets
+	 * of the first bring-up, so the CMB layout is fixed then: later
+	 * bring-ups reuse its depth, and queues that no longer fit fall back
+	 * to host memory in nvme_alloc_sq_cmds().
+	 */
+	if (dev->cmb && NVME_CMB_SQS(dev->cmbsz)) {
+		if (dev->cmb_q_depth)
+			result = dev->cmb_q_depth;
+		else
+			result = nvme_cmb_qdepth(dev, nr_io_queues,
+					sizeof(struct nvme_command));
+		if (result > 0)
+			dev->q_depth = dev->cmb_q_depth = result;
+		else
+			nvme_release_cmb(dev);
+	}
+
 	size = db_bar_size(dev, nr_io_queues);
 	if (size > 8192) {
 		iounmap(dev->bar);
@@ -2293,6 +3121,7 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 
 	/* Free previously allocated queues that are no longer usable */
 	nvme_free_queues(dev, nr_io_queues + 1);
+	nvme_dbbuf_set(dev);
 	nvme_create_io_queues(dev);
 
 	return 0;
@@ -2302,6 +3131,21 @@ static int nvme_setup_io_queues(struct nvme_dev *dev)
 	return result;
 }
 
+/*
+ * Report how long the controller took from probe until all of its
+ * namespaces were registered, to make slow controllers visible at boot.
+ */
+static void nvme_dev_ready_async(void *data, async_cookie_t cookie)
+{
+	struct nvme_dev *dev = data;
+
+	async_synchronize_cookie_domain(cookie, &dev->ns_domain);
+	dev_info(&dev->pci_dev->dev,
+		"ready in %lld ms, %u I/O queues, %u namespaces\n",
+		ktime_ms_delta(ktime_get(), dev->probe_start),
+		dev->online_queues - 1, dev->nr_ns);
+}
+
 /*
  * Return: error value if an error occurred setting up the queues or calling
  * Identify Device.  0 if these succeeded, even if adding some of the
@@ -2332,6 +3176,8 @@ static int nvme_dev_add(struct nvme_dev *dev)
 	ctrl = mem;
 	nn = le32_to_cpup(&ctrl->nn);
 	dev->oncs = le16_to_cpup(&ctrl->oncs);
+	dev->oacs = le16_to_cpup(&ctrl->oacs);
+	dev->sgls = le32_to_cpup(&ctrl->sgls);
 	dev->abort_limit = ctrl->acl + 1;
 	dev->vwc = ctrl->vwc;
 	dev->event_limit = min(ctrl->aerl + 1, 8);
@@ -2354,6 +3200,22 @@ static int nvme_dev_add(struct nvme_dev *dev)
 	}
 	dma_free_coherent(&dev->pci_dev->dev, 4096, mem, dma_addr);
 
+	/*
+	 * The I/O queues were created before the controller was identified.
+	 * They are still idle, so shadow doorbells can be attached to them
+	 * now; resets set them up ahead of queue creation.
+	 */
+	if (!dev->dbbuf_dbs) {
+		nvme_dbbuf_set(dev);
+		for (i = 1; dev->dbbuf_dbs && i < dev->online_queues; i++) {
+			struct nvme_queue *nvmeq = dev->queues[i];
+
+			spin_lock_irq(&nvmeq->q_lock);
+			nvme_dbbuf_init(dev, nvmeq, i);
+			spin_unlock_irq(&nvmeq->q_lock);
+		}
+	}
+
 	dev->tagset.ops = &nvme_mq_ops;
 	dev->tagset.nr_hw_queues = dev->online_queues - 1;
 	dev->tagset.timeout = NVME_IO_TIMEOUT;
@@ -2369,6 +3231,8 @@ static int nvme_dev_add(struct nvme_dev *dev)
 
 	for (i = 1; i <= nn; i++)
 		nvme_alloc_ns(dev, i);
+	dev->nr_ns = nn;
+	async_schedule_domain(nvme_dev_ready_async, dev, &dev->ns_domain);
 
 	return 0;
 }
@@ -2419,6 +3283,13 @@ static int nvme_dev_map(struct nvme_dev *dev)
 	dev->db_stride = 1 << NVME_CAP_STRIDE(cap);
 	dev->dbs = ((void __iomem *)dev->bar) + 4096;
 
+	/*
+	 * The CMB mapping is kept across resets so that submission queues
+	 * placed in it remain valid; it is only torn down on remove.
+	 */
+	if (!dev->cmb && readl(&dev->bar->vs) >= NVME_VS(1, 2))
+		dev->cmb = nvme_map_cmb(dev);
+
 	return 0;
 
  unmap:
@@ -2588,6 +3459,113 @@ static void nvme_disable_io_queues(struct nvme_dev *dev)
 	kthread_stop(kworker_task);
 }
 
+/*
+ * I/O queues are created with the same async admin machinery as they are
+ * deleted with: every queue's Create CQ is issued up front, and each
+ * completion issues that queue's Create SQ, so the controller sees many
+ * outstanding admin commands instead of one at a time.
+ */
+static void nvme_create_sq_work_handler(struct kthread_work *work)
+{
+	struct nvme_queue *nvmeq = container_of(work, struct nvme_queue,
+							cmdinfo.work);
+
+	/* The CQ exists, so it has to go if the SQ could not be created */
+	if (nvmeq->cmdinfo.status)
+		adapter_delete_cq(nvmeq->dev, nvmeq->qid);
+	nvme_put_dq(nvmeq->cmdinfo.ctx);
+}
+
+static void nvme_create_cq_work_handler(struct kthread_work *work)
+{
+	struct nvme_queue *nvmeq = container_of(work, struct nvme_queue,
+							cmdinfo.work);
+	struct nvme_command c;
+
+	if (!nvmeq->cmdinfo.status) {
+		nvme_init_create_sq(&c, nvmeq->qid, nvmeq);
+		init_kthread_work(&nvmeq->cmdinfo.work,
+						nvme_create_sq_work_handler);
+		if (!nvme_submit_admin_async_cmd(nvmeq->dev, &c,
+					&nvmeq->cmdinfo, ADMIN_TIMEOUT))
+			return;
+		adapter_delete_cq(nvmeq->dev, nvmeq->qid);
+		nvmeq->cmdinfo.status = -EIO;
+	}
+	nvme_put_dq(nvmeq->cmdinfo.ctx);
+}
+
+static void nvme_create_io_queues(struct nvme_dev *dev)
+{
+	unsigned i, first;
+	DEFINE_KTHREAD_WORKER_ONSTACK(worker);
+	struct nvme_delq_ctx dq;
+	struct task_struct *kworker_task;
+
+	for (i = dev->queue_count; i <= dev->max_qid; i++)
+		if (!nvme_alloc_queue(dev, i, dev->q_depth))
+			break;
+
+	first = dev->online_queues;
+	kworker_task = kthread_run(kthread_worker_fn, &worker, "nvme%d",
+							dev->instance);
+	if (IS_ERR(kworker_task)) {
+		for (i = first; i <= dev->queue_count - 1; i++)
+			if (nvme_create_queue(dev->queues[i], i))
+				break;
+		return;
+	}
+
+	dq.waiter = NULL;
+	atomic_set(&dq.refcount, 0);
+	dq.worker = &worker;
+	for (i = first; i <= dev->queue_count - 1; i++) {
+		struct nvme_queue *nvmeq = dev->queues[i];
+		struct nvme_command c;
+
+		nvmeq->cq_vector = i - 1;
+		nvmeq->cmdinfo.ctx = nvme_get_dq(&dq);
+		nvmeq->cmdinfo.worker = dq.worker;
+		nvme_init_create_cq(&c, i, nvmeq);
+		init_kthread_work(&nvmeq->cmdinfo.work,
+						nvme_create_cq_work_handler);
+		if (nvme_submit_admin_async_cmd(dev, &c, &nvmeq->cmdinfo,
+							ADMIN_TIMEOUT)) {
+			nvmeq->cmdinfo.status = -EIO;
+			nvme_put_dq(&dq);
+		}
+	}
+	nvme_wait_dq(&dq, dev);
+	kthread_stop(kworker_task);
+
+	/* The admin queue is gone if the controller stopped responding */
+	if (dev->queues[0]->cq_vector == -1)
+		return;
+
+	/*
+	 * Bring the queues online in order; the first one that failed ends
+	 * the range, and any later ones the controller did create are
+	 * deleted again.
+	 */
+	for (i = first; i <= dev->queue_count - 1; i++) {
+		struct nvme_queue *nvmeq = dev->queues[i];
+
+		if (!nvmeq->cmdinfo.status &&
+		    !queue_request_irq(dev, nvmeq, nvmeq->irqname)) {
+			nvme_init_queue(nvmeq, i);
+			continue;
+		}
+		for (; i <= dev->queue_count - 1; i++) {
+			nvmeq = dev->queues[i];
+			if (!nvmeq->cmdinfo.status) {
+				adapter_delete_sq(dev, i);
+				adapter_delete_cq(dev, i);
+			}
+			nvmeq->cq_vector = -1;
+		}
+	}
+}
+
 /*
 * Remove the node from the device list and check
 * for whether or not we need to stop the nvme_thread.
@@ -2663,17 +3641,37 @@ static void nvme_dev_shutdown(struct nvme_dev *dev)
 		nvme_clear_queue(dev->queues[i]);
 }
 
+/*
+ * Wait for the namespace scan of a controller that has been shut down.  The
+ * shutdown cancelled whatever the scan had outstanding, and anything it
+ * submits now would wait on the frozen queues, so mark them dying to fail
+ * that I/O instead.  Never call this before the shutdown: only the reset
+ * can cancel a scan command that timed out.
+ */
+static void nvme_dev_stop_scan(struct nvme_dev *dev)
+{
+	struct nvme_ns *ns;
+
+	list_for_each_entry(ns, &dev->namespaces, list) {
+		if (!blk_queue_dead(ns->queue))
+			blk_set_queue_dying(ns->queue);
+	}
+	async_synchronize_full_domain(&dev->ns_domain);
+}
+
 static void nvme_dev_remove(struct nvme_dev *dev)
 {
 	struct nvme_ns *ns;
 
+	nvme_dev_stop_scan(dev);
+
 	list_for_each_entry(ns, &dev->namespaces, list) {
 		if (ns->disk->flags & GENHD_FL_UP) {
 			if (blk_get_integrity(ns->disk))
 				blk_integrity_unregister(ns->disk);
 			del_gendisk(ns->disk);
 		}
-		if (!blk_queue_dying(ns->queue)) {
+		if (!blk_queue_dead(ns->queue)) {
 			blk_mq_abort_requeue_list(ns->queue);
 			blk_cleanup_queue(ns->queue);
 		}
@@ -2745,6 +3743,7 @@ static void nvme_free_namespaces(struct nvme_dev *dev)
 		spin_unlock(&dev_list_lock);
 
 		put_disk(ns->disk);
+		nvme_ns_lat_free(ns);
 		kfree(ns);
 	}
 }
@@ -2756,6 +3755,7 @@ static void nvme_free_dev(struct kref *kref)
 	pci_dev_put(dev->pci_dev);
 	put_device(dev->device);
 	nvme_free_namespaces(dev);
+	debugfs_remove_recursive(dev->debugfs_dir);
 	nvme_release_instance(dev);
 	blk_mq_free_tag_set(&dev->tagset);
 	blk_put_queue(dev->admin_q);
@@ -2822,6 +3822,19 @@ static const struct file_operations nvme_dev_fops = {
 	.compat_ioctl	= nvme_dev_ioctl,
 };
 
+static ssize_t nvme_cmb_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct nvme_dev *ndev = dev_get_drvdata(dev);
+
+	if (!ndev->cmb)
+		return snprintf(buf, PAGE_SIZE, "none\n");
+	return snprintf(buf, PAGE_SIZE,
+			"cmbsz : x%08x\nbus   : %pad\nsize  : %llu\n",
+			ndev->cmbsz, &ndev->cmb_dma_addr, ndev->cmb_size);
+}
+static DEVICE_ATTR(cmb, S_IRUGO, nvme_cmb_show, NULL);
+
 static void nvme_set_irq_hints(struct nvme_dev *dev)
 {
 	struct nvme_queue *nvmeq;
@@ -2981,6 +3994,7 @@ static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 		goto free;
 
 	INIT_LIST_HEAD(&dev->namespaces);
+	async_domain_init(&dev->ns_domain, true);
 	dev->reset_workfn = nvme_reset_failed_dev;
 	INIT_WORK(&dev->reset_work, nvme_reset_workfn);
 	dev->pci_dev = pci_dev_get(pdev);
@@ -2989,6 +4003,13 @@ static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	if (result)
 		goto put_pci;
 
+	if (nvme_debugfs_root) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "nvme%d", dev->instance);
+		dev->debugfs_dir = debugfs_create_dir(name, nvme_debugfs_root);
+	}
+
 	result = nvme_setup_prp_pools(dev);
 	if (result)
 		goto release;
@@ -3003,13 +4024,26 @@ static int nvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 	}
 	get_device(dev->device);
 
+	result = device_create_file(dev->device, &dev_attr_cmb);
+	if (result)
+		goto put_dev;
+
+	/*
+	 * Controllers come up in parallel: the unbound workqueue doesn't
+	 * hold back one probe while another on the same CPU sleeps.
+	 */
+	dev->probe_start = ktime_get();
 	INIT_WORK(&dev->probe_work, nvme_async_probe);
-	schedule_work(&dev->probe_work);
+	queue_work(system_unbound_wq, &dev->probe_work);
 	return 0;
 
+ put_dev:
+	device_destroy(nvme_class, MKDEV(nvme_char_major, dev->instance));
+	put_device(dev->device);
  release_pools:
 	nvme_release_prp_pools(dev);
  release:
+	debugfs_remove_recursive(dev->debugfs_dir);
 	nvme_release_instance(dev);
  put_pci:
 	pci_dev_put(dev->pci_dev);
@@ -3071,10 +4105,16 @@ static void nvme_remove(struct pci_dev *pdev)
 	flush_work(&dev->probe_work);
 	flush_work(&dev->reset_work);
 	nvme_dev_shutdown(dev);
+	/* A scan stuck on the frozen admin queue must fail, not wait */
+	if (dev->admin_q && !blk_queue_dead(dev->admin_q))
+		blk_set_queue_dying(dev->admin_q);
 	nvme_dev_remove(dev);
 	nvme_dev_remove_admin(dev);
+	device_remove_file(dev->device, &dev_attr_cmb);
 	device_destroy(nvme_class, MKDEV(nvme_char_major, dev->instance));
 	nvme_free_queues(dev, 0);
+	nvme_dbbuf_dma_free(dev);
+	nvme_release_cmb(dev);
 	nvme_release_prp_pools(dev);
 	kref_put(&dev->kref, nvme_free_dev);
 }
@@ -3147,9 +4187,15 @@ static int __init nvme_init(void)
 
 	init_waitqueue_head(&nvme_kthread_wait);
 
+	nvme_debugfs_root = debugfs_create_dir("nvme", NULL);
+	if (IS_ERR(nvme_debugfs_root))
+		nvme_debugfs_root = NULL;
+
 	nvme_workq = create_singlethread_workqueue("nvme");
-	if (!nvme_workq)
-		return -ENOMEM;
+	if (!nvme_workq) {
+		result = -ENOMEM;
+		goto remove_debugfs;
+	}
 
 	result = register_blkdev(nvme_major, "nvme");
 	if (result < 0)
@@ -3181,6 +4227,8 @@ static int __init nvme_init(void)
 	unregister_blkdev(nvme_major, "nvme");
  kill_workq:
 	destroy_workqueue(nvme_workq);
+ remove_debugfs:
+	debugfs_remove(nvme_debugfs_root);
 	return result;
 }
 
@@ -3191,6 +4239,7 @@ static void __exit nvme_exit(void)
 	destroy_workqueue(nvme_workq);
 	class_destroy(nvme_class);
 	__unregister_chrdev(nvme_char_major, 0, NVME_MINORS, "nvme");
+	debugfs_remove(nvme_debugfs_root);
 	BUG_ON(nvme_thread && !IS_ERR(nvme_thread));
 	_nvme_check_size();
 }
@@ -22,6 +22,9 @@ static DEFINE_IDA(vd_index_ida);
 
 static struct workqueue_struct *virtblk_wq;
 
+/* Used buffers reaped per virtqueue_get_bufs() call in virtblk_done. */
+#define VIRTBLK_DONE_BATCH	16
+
 struct virtio_blk_vq {
 	struct virtqueue *vq;
 	spinlock_t lock;
@@ -136,15 +139,17 @@ static void virtblk_done(struct virtqueue *vq)
 	struct virtio_blk *vblk = vq->vdev->priv;
 	bool req_done = false;
 	int qid = vq->index;
-	struct virtblk_req *vbr;
+	struct virtblk_req *vbrs[VIRTBLK_DONE_BATCH];
 	unsigned long flags;
-	unsigned int len;
+	unsigned int i, n;
 
 	spin_lock_irqsave(&vblk->vqs[qid].lock, flags);
 	do {
 		virtqueue_disable_cb(vq);
-		while ((vbr = virtqueue_get_buf(vblk->vqs[qid].vq, &len)) != NULL) {
-			blk_mq_complete_request(vbr->req);
+		while ((n = virtqueue_get_bufs(vblk->vqs[qid].vq, (void **)vbrs,
+					       NULL, VIRTBLK_DONE_BATCH))) {
+			for (i = 0; i < n; i++)
+				blk_mq_complete_request(vbrs[i]->req);
 			req_done = true;
 		}
 		if (unlikely(virtqueue_is_broken(vq)))
@@ -157,6 +162,40 @@ static void virtblk_done(struct virtqueue *vq)
 	spin_unlock_irqrestore(&vblk->vqs[qid].lock, flags);
 }
 
+/*
+ * Reap completions for a synchronous submitter spinning in blk_poll().
+ * The virtqueue callback stays enabled, so a completion the poll misses
+ * still raises its interrupt.
+ */
+static int virtblk_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct virtio_blk *vblk = hctx->queue->queuedata;
+	struct virtio_blk_vq *bvq = &vblk->vqs[hctx->queue_num];
+	struct virtblk_req *vbrs[VIRTBLK_DONE_BATCH];
+	unsigned long flags;
+	unsigned int i, n;
+	int found = 0;
+
+	spin_lock_irqsave(&bvq->lock, flags);
+	if (unlikely(virtqueue_is_broken(bvq->vq))) {
+		spin_unlock_irqrestore(&bvq->lock, flags);
+		return -1;
+	}
+	while ((n = virtqueue_get_bufs(bvq->vq, (void **)vbrs, NULL,
+				       VIRTBLK_DONE_BATCH))) {
+		for (i = 0; i < n; i++)
+			blk_mq_complete_request(vbrs[i]->req);
+		found += n;
+	}
+
+	/* In case queue is stopped waiting for more buffers. */
+	if (found)
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue, true);
+	spin_unlock_irqrestore(&bvq->lock, flags);
+
+	return found;
+}
+
 static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx,
 			   const struct blk_mq_queue_data *bd)
 {
@@ -210,6 +249,9 @@ static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx,
 	}
 
 	spin_lock_irqsave(&vblk->vqs[qid].lock, flags);
+	/* More requests follow: publish them together at bd->last. */
+	if (!bd->last)
+		virtqueue_batch_start(vblk->vqs[qid].vq);
 	err = __virtblk_add_req(vblk->vqs[qid].vq, vbr, vbr->sg, num);
 	if (err) {
 		virtqueue_kick(vblk->vqs[qid].vq);
@@ -556,6 +598,7 @@ static struct blk_mq_ops virtio_mq_ops = {
 	.queue_rq	= virtio_queue_rq,
 	.map_queue	= blk_mq_map_queue,
 	.complete	= virtblk_request_done,
+	.poll		= virtblk_poll,
 	.init_request	= virtblk_init_request,
 };
 
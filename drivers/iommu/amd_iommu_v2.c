@@ -25,6 +25,7 @@
 #include <linux/iommu.h>
 #include <linux/wait.h>
 #include <linux/pci.h>
+#include <linux/pci-ats.h>
 #include <linux/gfp.h>
 
 #include "amd_iommu_types.h"
@@ -40,6 +41,7 @@ struct pri_queue {
 	atomic_t inflight;
 	bool finish;
 	int status;
+	int reqs;		/* Page Requests the response will retire */
 };
 
 struct pasid_state {
@@ -451,8 +453,11 @@ static void finish_pri_tag(struct device_state *dev_state,
 	    pasid_state->pri[tag].finish) {
 		amd_iommu_complete_ppr(dev_state->pdev, pasid_state->pasid,
 				       pasid_state->pri[tag].status, tag);
+		pci_pri_request_put(dev_state->pdev,
+				    pasid_state->pri[tag].reqs);
 		pasid_state->pri[tag].finish = false;
 		pasid_state->pri[tag].status = PPR_SUCCESS;
+		pasid_state->pri[tag].reqs = 0;
 	}
 	spin_unlock_irqrestore(&pasid_state->lock, flags);
 }
@@ -553,8 +558,13 @@ static int ppr_notifier(struct notifier_block *nb, unsigned long e, void *data)
 		goto out_drop_state;
 	}
 
+	if (!pci_pri_request_get(dev_state->pdev))
+		dev_warn_ratelimited(&dev_state->pdev->dev,
+				     "Page Request beyond PRI allocation\n");
+
 	spin_lock_irqsave(&pasid_state->lock, flags);
 	atomic_inc(&pasid_state->pri[tag].inflight);
+	pasid_state->pri[tag].reqs++;
 	if (finish)
 		pasid_state->pri[tag].finish = true;
 	spin_unlock_irqrestore(&pasid_state->lock, flags);
@@ -1324,6 +1324,9 @@ static void iommu_flush_dev_iotlb(struct dmar_domain *domain,
 	u16 sid, qdep;
 	unsigned long flags;
 	struct device_domain_info *info;
+	unsigned int order;
+	u64 inv_addr;
+	bool issued;
 
 	spin_lock_irqsave(&device_domain_lock, flags);
 	list_for_each_entry(info, &domain->devices, link) {
@@ -1337,7 +1340,29 @@ static void iommu_flush_dev_iotlb(struct dmar_domain *domain,
 
 		sid = info->bus << 8 | info->devfn;
 		qdep = pci_ats_queue_depth(pdev);
-		qi_flush_dev_iotlb(info->iommu, sid, qdep, addr, mask);
+
+		/*
+		 * Go through the ATS core so the invalidation is accounted
+		 * against the device's Invalidate Queue.  qi_submit_sync()
+		 * waits for the device, so it completes right away.
+		 */
+		if (pci_ats_inv_add(pdev, addr, (u64)VTD_PAGE_SIZE << mask)) {
+			qi_flush_dev_iotlb(info->iommu, sid, qdep, addr, mask);
+			continue;
+		}
+		issued = false;
+		while (pci_ats_inv_get(pdev, &inv_addr, &order)) {
+			qi_flush_dev_iotlb(info->iommu, sid, qdep, inv_addr,
+					   order - VTD_PAGE_SHIFT);
+			pci_ats_inv_complete(pdev);
+			issued = true;
+		}
+		/*
+		 * The queue was full, or someone else took the range: it
+		 * must still be gone from the device before we return.
+		 */
+		if (!issued)
+			qi_flush_dev_iotlb(info->iommu, sid, qdep, addr, mask);
 	}
 	spin_unlock_irqrestore(&device_domain_lock, flags);
 }
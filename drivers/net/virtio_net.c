@@ -52,6 +52,13 @@ module_param(gso, bool, 0444);
 
 #define VIRTNET_DRIVER_VERSION "1.0.0"
 
+/* Used buffers reaped per virtqueue_get_bufs() call. */
+#define VIRTNET_GET_BATCH 16
+
+/* Default and maximum busy poll budget of a receive queue. */
+#define VIRTNET_BUSY_POLL_BUDGET 4
+#define VIRTNET_BUSY_POLL_BUDGET_MAX NAPI_POLL_WEIGHT
+
 struct virtnet_stats {
 	struct u64_stats_sync tx_syncp;
 	struct u64_stats_sync rx_syncp;
@@ -95,6 +102,9 @@ struct receive_queue {
 
 	/* Name of this receive queue: input.$index */
 	char name[40];
+
+	/* Packets reaped per busy poll call, 0 disables busy polling. */
+	unsigned int busy_poll_budget;
 };
 
 struct virtnet_info {
@@ -659,6 +669,8 @@ static bool try_fill_recv(struct virtnet_info *vi, struct receive_queue *rq,
 	bool oom;
 
 	gfp |= __GFP_COLD;
+	/* Publish the whole refill with one index update at the kick. */
+	virtqueue_batch_start(rq->vq);
 	do {
 		if (vi->mergeable_rx_bufs)
 			err = add_recvbuf_mergeable(rq, gfp);
@@ -728,13 +740,17 @@ static void refill_work(struct work_struct *work)
 static int virtnet_receive(struct receive_queue *rq, int budget)
 {
 	struct virtnet_info *vi = rq->vq->vdev->priv;
-	unsigned int len, received = 0;
-	void *buf;
+	unsigned int lens[VIRTNET_GET_BATCH];
+	void *bufs[VIRTNET_GET_BATCH];
+	unsigned int i, n, received = 0;
 
 	while (received < budget &&
-	       (buf = virtqueue_get_buf(rq->vq, &len)) != NULL) {
-		receive_buf(vi, rq, buf, len);
-		received++;
+	       (n = virtqueue_get_bufs(rq->vq, bufs, lens,
+				       min_t(unsigned int, budget - received,
+					     VIRTNET_GET_BATCH)))) {
+		for (i = 0; i < n; i++)
+			receive_buf(vi, rq, bufs[i], lens[i]);
+		received += n;
 	}
 
 	if (rq->vq->num_free > virtqueue_get_vring_size(rq->vq) / 2) {
@@ -774,9 +790,9 @@ static int virtnet_busy_poll(struct napi_struct *napi)
 	struct receive_queue *rq =
 		container_of(napi, struct receive_queue, napi);
 	struct virtnet_info *vi = rq->vq->vdev->priv;
-	int r, received = 0, budget = 4;
+	int r, received = 0, budget = ACCESS_ONCE(rq->busy_poll_budget);
 
-	if (!(vi->status & VIRTIO_NET_S_LINK_UP))
+	if (!budget || !(vi->status & VIRTIO_NET_S_LINK_UP))
 		return LL_FLUSH_FAILED;
 
 	if (!napi_schedule_prep(napi))
@@ -822,20 +838,24 @@ static int virtnet_open(struct net_device *dev)
 
 static void free_old_xmit_skbs(struct send_queue *sq)
 {
-	struct sk_buff *skb;
-	unsigned int len;
+	struct sk_buff *skbs[VIRTNET_GET_BATCH];
+	unsigned int i, n, bytes;
 	struct virtnet_info *vi = sq->vq->vdev->priv;
 	struct virtnet_stats *stats = this_cpu_ptr(vi->stats);
 
-	while ((skb = virtqueue_get_buf(sq->vq, &len)) != NULL) {
-		pr_debug("Sent skb %p\n", skb);
+	while ((n = virtqueue_get_bufs(sq->vq, (void **)skbs, NULL,
+				       VIRTNET_GET_BATCH))) {
+		bytes = 0;
+		for (i = 0; i < n; i++) {
+			pr_debug("Sent skb %p\n", skbs[i]);
+			bytes += skbs[i]->len;
+			dev_kfree_skb_any(skbs[i]);
+		}
 
 		u64_stats_update_begin(&stats->tx_syncp);
-		stats->tx_bytes += skb->len;
-		stats->tx_packets++;
+		stats->tx_bytes += bytes;
+		stats->tx_packets += n;
 		u64_stats_update_end(&stats->tx_syncp);
-
-		dev_kfree_skb_any(skb);
 	}
 }
 
@@ -1606,6 +1626,7 @@ static int virtnet_alloc_queues(struct virtnet_info *vi)
 
 		sg_init_table(vi->rq[i].sg, ARRAY_SIZE(vi->rq[i].sg));
 		ewma_init(&vi->rq[i].mrg_avg_pkt_len, 1, RECEIVE_AVG_WEIGHT);
+		vi->rq[i].busy_poll_budget = VIRTNET_BUSY_POLL_BUDGET;
 		sg_init_table(vi->sq[i].sg, ARRAY_SIZE(vi->sq[i].sg));
 	}
 
@@ -1658,8 +1679,53 @@ static ssize_t mergeable_rx_buffer_size_show(struct netdev_rx_queue *queue,
 static struct rx_queue_attribute mergeable_rx_buffer_size_attribute =
 	__ATTR_RO(mergeable_rx_buffer_size);
 
+static ssize_t busy_poll_budget_show(struct netdev_rx_queue *queue,
+		struct rx_queue_attribute *attribute, char *buf)
+{
+	struct virtnet_info *vi = netdev_priv(queue->dev);
+	unsigned int queue_index = get_netdev_rx_queue_index(queue);
+
+	BUG_ON(queue_index >= vi->max_queue_pairs);
+	return sprintf(buf, "%u\n", vi->rq[queue_index].busy_poll_budget);
+}
+
+static ssize_t busy_poll_budget_store(struct netdev_rx_queue *queue,
+		struct rx_queue_attribute *attribute, const char *buf,
+		size_t len)
+{
+	struct virtnet_info *vi = netdev_priv(queue->dev);
+	unsigned int queue_index = get_netdev_rx_queue_index(queue);
+	unsigned int budget;
+	int err;
+
+	BUG_ON(queue_index >= vi->max_queue_pairs);
+	err = kstrtouint(buf, 0, &budget);
+	if (err)
+		return err;
+	if (budget > VIRTNET_BUSY_POLL_BUDGET_MAX)
+		return -EINVAL;
+
+	vi->rq[queue_index].busy_poll_budget = budget;
+	return len;
+}
+
+static struct rx_queue_attribute busy_poll_budget_attribute =
+	__ATTR(busy_poll_budget, S_IRUGO | S_IWUSR,
+	       busy_poll_budget_show, busy_poll_budget_store);
+
+static struct attribute *virtio_net_rx_attrs[] = {
+	&busy_poll_budget_attribute.attr,
+	NULL
+};
+
+static const struct attribute_group virtio_net_rx_group = {
+	.name = "virtio_net",
+	.attrs = virtio_net_rx_attrs
+};
+
 static struct attribute *virtio_net_mrg_rx_attrs[] = {
 	&mergeable_rx_buffer_size_attribute.attr,
+	&busy_poll_budget_attribute.attr,
 	NULL
 };
 
@@ -1839,6 +1905,8 @@ static int virtnet_probe(struct virtio_device *vdev)
 #ifdef CONFIG_SYSFS
 	if (vi->mergeable_rx_bufs)
 		dev->sysfs_rx_queue_group = &virtio_net_mrg_rx_group;
+	else
+		dev->sysfs_rx_queue_group = &virtio_net_rx_group;
 #endif
 	netif_set_real_num_tx_queues(dev, vi->curr_queue_pairs);
 	netif_set_real_num_rx_queues(dev, vi->curr_queue_pairs);
@@ -5,6 +5,7 @@
 #include <linux/slab.h>
 #include <linux/ioport.h>
 #include <linux/wait.h>
+#include <linux/ktime.h>
 
 #include "pci.h"
 
@@ -285,6 +286,9 @@ struct pci_vpd_pci22 {
 	u16	flag;
 	bool	busy;
 	u8	cap;
+	u8	*cache;			/* image read by pci_vpd_pci22_fill() */
+	unsigned int cache_len;
+	bool	cache_tried;
 };
 
 /*
@@ -328,24 +332,20 @@ static int pci_vpd_pci22_wait(struct pci_dev *dev)
 	}
 }
 
-static ssize_t pci_vpd_pci22_read(struct pci_dev *dev, loff_t pos, size_t count,
-				  void *arg)
+/*
+ * Read [pos, end) from the device a dword at a time.  Must be called
+ * with vpd->lock held.
+ */
+static int pci_vpd_pci22_hw_read(struct pci_dev *dev, loff_t pos, loff_t end,
+				 u8 *buf)
 {
 	struct pci_vpd_pci22 *vpd =
 		container_of(dev->vpd, struct pci_vpd_pci22, base);
 	int ret;
-	loff_t end = pos + count;
-	u8 *buf = arg;
-
-	if (pos < 0 || pos > vpd->base.len || end > vpd->base.len)
-		return -EINVAL;
-
-	if (mutex_lock_killable(&vpd->lock))
-		return -EINTR;
 
 	ret = pci_vpd_pci22_wait(dev);
 	if (ret < 0)
-		goto out;
+		return ret;
 
 	while (pos < end) {
 		u32 val;
@@ -375,7 +375,141 @@ static ssize_t pci_vpd_pci22_read(struct pci_dev *dev, loff_t pos, size_t count,
 			val >>= 8;
 		}
 	}
-out:
+	return ret;
+}
+
+static void pci_vpd_pci22_drop_cache(struct pci_vpd_pci22 *vpd)
+{
+	kfree(vpd->cache);
+	vpd->cache = NULL;
+	vpd->cache_len = 0;
+}
+
+/*
+ * Extend the image in @buf so it covers at least @want bytes, reading
+ * whole dwords so that no VPD address is fetched from the device twice.
+ */
+static int pci_vpd_pci22_fill_to(struct pci_dev *dev, u8 *buf,
+				 unsigned int *have, unsigned int want)
+{
+	unsigned int len = dev->vpd->len;
+	unsigned int end;
+	int ret;
+
+	want = min(want, len);
+	if (*have >= want)
+		return 0;
+
+	end = min(ALIGN(want, sizeof(u32)), len);
+	ret = pci_vpd_pci22_hw_read(dev, *have, end, buf + *have);
+	if (ret < 0)
+		return ret;
+
+	*have = end;
+	return 0;
+}
+
+/*
+ * Read the VPD image up to and including the end tag and keep it for
+ * later reads.  Only the resource tags the spec defines are followed, and
+ * a tag header is read before anything behind it, so nothing past the end
+ * of the VPD is ever fetched: some devices hang on such reads.  An image
+ * with an unknown tag or without an end tag is not cached at all.  Called
+ * with vpd->lock held, on the first read.
+ */
+static void pci_vpd_pci22_fill(struct pci_dev *dev)
+{
+	struct pci_vpd_pci22 *vpd =
+		container_of(dev->vpd, struct pci_vpd_pci22, base);
+	unsigned int len = vpd->base.len;
+	unsigned int have = 0, off = 0;
+	ktime_t start;
+	u8 *buf, tag;
+	int ret;
+
+	vpd->cache_tried = true;
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	start = ktime_get();
+	for (;;) {
+		ret = -ENOENT;
+		if (off >= len)
+			break;
+
+		ret = pci_vpd_pci22_fill_to(dev, buf, &have, off + 1);
+		if (ret < 0)
+			break;
+
+		tag = buf[off];
+		ret = -EINVAL;
+		if (!(tag & PCI_VPD_LRDT)) {
+			if ((tag & PCI_VPD_SRDT_TIN_MASK) != PCI_VPD_SRDT_END)
+				break;
+			off += PCI_VPD_SRDT_TAG_SIZE +
+			       pci_vpd_srdt_size(&buf[off]);
+			ret = off <= len ? 0 : -ENOENT;
+			break;
+		}
+
+		if (tag != PCI_VPD_LRDT_ID_STRING &&
+		    tag != PCI_VPD_LRDT_RO_DATA &&
+		    tag != PCI_VPD_LRDT_RW_DATA)
+			break;
+
+		ret = -ENOENT;
+		if (off + PCI_VPD_LRDT_TAG_SIZE > len)
+			break;
+
+		ret = pci_vpd_pci22_fill_to(dev, buf, &have,
+					    off + PCI_VPD_LRDT_TAG_SIZE);
+		if (ret < 0)
+			break;
+		off += PCI_VPD_LRDT_TAG_SIZE + pci_vpd_lrdt_size(&buf[off]);
+	}
+
+	if (!ret)
+		ret = pci_vpd_pci22_fill_to(dev, buf, &have, off);
+
+	if (ret) {
+		dev_dbg(&dev->dev, "VPD not cached (%d)\n", ret);
+		kfree(buf);
+		return;
+	}
+
+	vpd->cache = buf;
+	vpd->cache_len = off;
+	vpd->base.fill_usecs = ktime_us_delta(ktime_get(), start);
+	dev_dbg(&dev->dev, "VPD cached (%u bytes in %u usecs)\n",
+		vpd->cache_len, vpd->base.fill_usecs);
+}
+
+static ssize_t pci_vpd_pci22_read(struct pci_dev *dev, loff_t pos, size_t count,
+				  void *arg)
+{
+	struct pci_vpd_pci22 *vpd =
+		container_of(dev->vpd, struct pci_vpd_pci22, base);
+	int ret = 0;
+	loff_t end = pos + count;
+	u8 *buf = arg;
+
+	if (pos < 0 || pos > vpd->base.len || end > vpd->base.len)
+		return -EINVAL;
+
+	if (mutex_lock_killable(&vpd->lock))
+		return -EINTR;
+
+	if (!vpd->cache_tried && !pci_vpd_no_cache)
+		pci_vpd_pci22_fill(dev);
+
+	if (vpd->cache && end <= vpd->cache_len) {
+		memcpy(buf, vpd->cache + pos, count);
+		vpd->base.cache_hits++;
+	} else
+		ret = pci_vpd_pci22_hw_read(dev, pos, end, buf);
+
 	mutex_unlock(&vpd->lock);
 	return ret ? ret : count;
 }
@@ -395,6 +529,10 @@ static ssize_t pci_vpd_pci22_write(struct pci_dev *dev, loff_t pos, size_t count
 	if (mutex_lock_killable(&vpd->lock))
 		return -EINTR;
 
+	/* Even a partial write leaves the cached image stale */
+	pci_vpd_pci22_drop_cache(vpd);
+	vpd->cache_tried = false;
+
 	ret = pci_vpd_pci22_wait(dev);
 	if (ret < 0)
 		goto out;
@@ -430,7 +568,11 @@ out:
 
 static void pci_vpd_pci22_release(struct pci_dev *dev)
 {
-	kfree(container_of(dev->vpd, struct pci_vpd_pci22, base));
+	struct pci_vpd_pci22 *vpd =
+		container_of(dev->vpd, struct pci_vpd_pci22, base);
+
+	kfree(vpd->cache);
+	kfree(vpd);
 }
 
 static const struct pci_vpd_ops pci_vpd_pci22_ops = {
@@ -36,6 +36,7 @@ static int ats_alloc_one(struct pci_dev *dev, int ps)
 	pci_read_config_word(dev, pos + PCI_ATS_CAP, &cap);
 	ats->qdep = PCI_ATS_CAP_QDEP(cap) ? PCI_ATS_CAP_QDEP(cap) :
 					    PCI_ATS_MAX_QDEP;
+	spin_lock_init(&ats->inv_lock);
 	dev->ats = ats;
 
 	return 0;
@@ -179,6 +180,179 @@ int pci_ats_queue_depth(struct pci_dev *dev)
 }
 EXPORT_SYMBOL_GPL(pci_ats_queue_depth);
 
+/*
+ * VFs don't own an Invalidate Queue (their Queue Depth is 0), they share
+ * the one of their PF, so account their invalidations there.
+ */
+static struct pci_ats *ats_inv_queue(struct pci_dev *dev)
+{
+	if (dev->is_virtfn)
+		dev = dev->physfn;
+
+	return dev->ats;
+}
+
+/**
+ * pci_ats_inv_add - queue an ATS invalidation for a range
+ * @dev: the PCI device
+ * @addr: start of the untranslated address range
+ * @size: size of the range in bytes
+ *
+ * Merges the range into the device's pending invalidation, which is
+ * handed out again by pci_ats_inv_get().  Merging may grow the pending
+ * range beyond the union of what was added; invalidating more than
+ * needed is always correct.
+ *
+ * Returns 0 on success, or negative on failure.
+ */
+int pci_ats_inv_add(struct pci_dev *dev, u64 addr, u64 size)
+{
+	struct pci_ats *ats = dev->ats;
+	unsigned long flags;
+	u64 last;
+
+	if (!ats || !ats->is_enabled || !size)
+		return -EINVAL;
+
+	/* Kept inclusive, a range may end at the top of the address space */
+	last = addr + size - 1;
+	if (last < addr)
+		return -EINVAL;
+
+	spin_lock_irqsave(&ats->inv_lock, flags);
+	if (!ats->inv_pending) {
+		ats->inv_start = addr;
+		ats->inv_last = last;
+		ats->inv_pending = true;
+	} else {
+		ats->inv_start = min(ats->inv_start, addr);
+		ats->inv_last = max(ats->inv_last, last);
+	}
+	ats->inv_stats.queued++;
+	spin_unlock_irqrestore(&ats->inv_lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(pci_ats_inv_add);
+
+/**
+ * pci_ats_inv_get - take the pending invalidation if the device can accept it
+ * @dev: the PCI device
+ * @addr: returns the start of the range to invalidate
+ * @order: returns log2 of the range size in bytes
+ *
+ * Invalidate Requests can only describe naturally aligned power-of-two
+ * ranges, so the pending range is rounded out accordingly.  On success
+ * the request is accounted against the Invalidate Queue Depth until the
+ * caller reports it finished with pci_ats_inv_complete().
+ *
+ * Returns true if an invalidation should be issued, or false if nothing
+ * is pending or the device's invalidate queue is full.
+ */
+bool pci_ats_inv_get(struct pci_dev *dev, u64 *addr, unsigned int *order)
+{
+	struct pci_ats *ats = dev->ats;
+	struct pci_ats *queue = ats_inv_queue(dev);
+	unsigned long flags;
+	unsigned int shift;
+	u64 start, last;
+	bool ret = false;
+
+	if (!ats || !queue)
+		return false;
+
+	/*
+	 * The pending range is per function but the queue may be shared
+	 * with the PF; take the PF's lock first when they differ.
+	 */
+	spin_lock_irqsave(&queue->inv_lock, flags);
+	if (queue != ats)
+		spin_lock_nested(&ats->inv_lock, SINGLE_DEPTH_NESTING);
+
+	if (!ats->inv_pending)
+		goto out;
+
+	if (queue->inv_busy >= queue->qdep) {
+		queue->inv_stats.throttled++;
+		goto out;
+	}
+
+	start = ats->inv_start;
+	last = ats->inv_last;
+	shift = max_t(unsigned int, fls64(start ^ last), PCI_ATS_MIN_STU);
+
+	*order = shift;
+	*addr = shift < 64 ? start & ~((1ULL << shift) - 1) : 0;
+
+	ats->inv_pending = false;
+	ats->inv_stats.issued++;
+	queue->inv_busy++;
+	queue->inv_stats.max_busy = max(queue->inv_stats.max_busy,
+					queue->inv_busy);
+	ret = true;
+out:
+	if (queue != ats)
+		spin_unlock(&ats->inv_lock);
+	spin_unlock_irqrestore(&queue->inv_lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(pci_ats_inv_get);
+
+/**
+ * pci_ats_inv_complete - an invalidation from pci_ats_inv_get() finished
+ * @dev: the PCI device
+ */
+void pci_ats_inv_complete(struct pci_dev *dev)
+{
+	struct pci_ats *queue = ats_inv_queue(dev);
+	unsigned long flags;
+
+	if (!queue)
+		return;
+
+	spin_lock_irqsave(&queue->inv_lock, flags);
+	WARN_ON_ONCE(queue->inv_busy <= 0);
+	if (queue->inv_busy > 0)
+		queue->inv_busy--;
+	spin_unlock_irqrestore(&queue->inv_lock, flags);
+}
+EXPORT_SYMBOL_GPL(pci_ats_inv_complete);
+
+/**
+ * pci_ats_inv_get_stats - report ATS invalidation statistics
+ * @dev: the PCI device
+ * @stats: filled in with the device's statistics
+ *
+ * queued and issued count requests of @dev itself; throttled and
+ * max_busy describe the Invalidate Queue, which VFs share with their PF.
+ *
+ * Returns 0 on success, or negative on failure.
+ */
+int pci_ats_inv_get_stats(struct pci_dev *dev,
+			  struct pci_ats_inv_stats *stats)
+{
+	struct pci_ats *ats = dev->ats;
+	struct pci_ats *queue = ats_inv_queue(dev);
+	unsigned long flags;
+
+	if (!ats || !queue)
+		return -ENODEV;
+
+	spin_lock_irqsave(&ats->inv_lock, flags);
+	stats->queued = ats->inv_stats.queued;
+	stats->issued = ats->inv_stats.issued;
+	spin_unlock_irqrestore(&ats->inv_lock, flags);
+
+	spin_lock_irqsave(&queue->inv_lock, flags);
+	stats->throttled = queue->inv_stats.throttled;
+	stats->max_busy = queue->inv_stats.max_busy;
+	spin_unlock_irqrestore(&queue->inv_lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(pci_ats_inv_get_stats);
+
 #ifdef CONFIG_PCI_PRI
 /**
  * pci_enable_pri - Enable PRI capability
@@ -205,6 +379,8 @@ int pci_enable_pri(struct pci_dev *pdev, u32 reqs)
 	pci_read_config_dword(pdev, pos + PCI_PRI_MAX_REQ, &max_requests);
 	reqs = min(max_requests, reqs);
 	pci_write_config_dword(pdev, pos + PCI_PRI_ALLOC_REQ, reqs);
+	pdev->pri_reqs_alloc = reqs;
+	atomic_set(&pdev->pri_reqs_pending, 0);
 
 	control |= PCI_PRI_CTRL_ENABLE;
 	pci_write_config_word(pdev, pos + PCI_PRI_CTRL, control);
@@ -231,6 +407,9 @@ void pci_disable_pri(struct pci_dev *pdev)
 	pci_read_config_word(pdev, pos + PCI_PRI_CTRL, &control);
 	control &= ~PCI_PRI_CTRL_ENABLE;
 	pci_write_config_word(pdev, pos + PCI_PRI_CTRL, control);
+
+	pdev->pri_reqs_alloc = 0;
+	atomic_set(&pdev->pri_reqs_pending, 0);
 }
 EXPORT_SYMBOL_GPL(pci_disable_pri);
 
@@ -261,6 +440,62 @@ int pci_reset_pri(struct pci_dev *pdev)
 	return 0;
 }
 EXPORT_SYMBOL_GPL(pci_reset_pri);
+
+/**
+ * pci_pri_credits - number of Page Requests the device may still issue
+ * @pdev: PCI device structure
+ *
+ * The device may have at most the number of requests allocated by
+ * pci_enable_pri() outstanding.  IOMMU drivers can use this to decide
+ * how urgently page requests must be responded to: at 0 the device
+ * stalls until a response arrives.
+ *
+ * Returns the remaining credits, or negative value on error.
+ */
+int pci_pri_credits(struct pci_dev *pdev)
+{
+	if (!pdev->pri_reqs_alloc)
+		return -EINVAL;
+
+	return max_t(int, (int)pdev->pri_reqs_alloc -
+			  atomic_read(&pdev->pri_reqs_pending), 0);
+}
+EXPORT_SYMBOL_GPL(pci_pri_credits);
+
+/**
+ * pci_pri_request_get - account a Page Request received from the device
+ * @pdev: PCI device structure
+ *
+ * Returns false if the device exceeded its allocation, in which case the
+ * request is still accounted and pdev->pri_overflows is incremented.
+ */
+bool pci_pri_request_get(struct pci_dev *pdev)
+{
+	if (atomic_inc_return(&pdev->pri_reqs_pending) <=
+	    (int)pdev->pri_reqs_alloc)
+		return true;
+
+	atomic_long_inc(&pdev->pri_overflows);
+	return false;
+}
+EXPORT_SYMBOL_GPL(pci_pri_request_get);
+
+/**
+ * pci_pri_request_put - return credits for responded Page Requests
+ * @pdev: PCI device structure
+ * @n: number of Page Requests covered by the response
+ */
+void pci_pri_request_put(struct pci_dev *pdev, int n)
+{
+	int old, new;
+
+	/* Responses may race with the count being reset by enable/disable */
+	do {
+		old = atomic_read(&pdev->pri_reqs_pending);
+		new = max(old - n, 0);
+	} while (atomic_cmpxchg(&pdev->pri_reqs_pending, old, new) != old);
+}
+EXPORT_SYMBOL_GPL(pci_pri_request_put);
 #endif /* CONFIG_PCI_PRI */
 
 #ifdef CONFIG_PCI_PASID
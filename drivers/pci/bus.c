@@ -14,9 +14,13 @@
 #include <linux/ioport.h>
 #include <linux/proc_fs.h>
 #include <linux/slab.h>
+#include <linux/async.h>
 
 #include "pci.h"
 
+/* Driver attaches running concurrently, see pci_bus_add_device() */
+static ASYNC_DOMAIN(pci_probe_domain);
+
 void pci_add_resource_offset(struct list_head *resources, struct resource *res,
 			     resource_size_t offset)
 {
@@ -267,6 +271,38 @@ bool pci_bus_clip_resource(struct pci_dev *dev, int idx)
 
 void __weak pcibios_resource_survey_bus(struct pci_bus *bus) { }
 
+static void pci_bus_attach_async(void *data, async_cookie_t cookie)
+{
+	struct pci_dev *dev = data;
+	int retval;
+
+	retval = device_attach(&dev->dev);
+	WARN_ON(retval < 0);
+	pci_dev_put(dev);
+}
+
+/**
+ * pci_dev_attach_async - attach a driver to @dev from the PCI async domain
+ * @dev: PCI device to attach
+ */
+void pci_dev_attach_async(struct pci_dev *dev)
+{
+	pci_dev_get(dev);
+	dev->probe_cookie = async_schedule_domain(pci_bus_attach_async, dev,
+						  &pci_probe_domain);
+}
+
+/**
+ * pci_dev_wait_async_probe - wait for an asynchronous attach of @dev
+ * @dev: PCI device about to lose its driver
+ */
+void pci_dev_wait_async_probe(struct pci_dev *dev)
+{
+	if (dev->probe_cookie)
+		async_synchronize_cookie_domain(dev->probe_cookie + 1,
+						&pci_probe_domain);
+}
+
 /**
  * pci_bus_add_device - start driver for a single device
  * @dev: device to add
@@ -286,8 +322,18 @@ void pci_bus_add_device(struct pci_dev *dev)
 	pci_proc_attach_device(dev);
 
 	dev->match_driver = true;
-	retval = device_attach(&dev->dev);
-	WARN_ON(retval < 0);
+	/*
+	 * Drivers that declared async_probe are attached from the async
+	 * domain so that slow probes overlap; pci_call_probe() still moves
+	 * each one to the device's node.  The boot waits for the domain
+	 * before mounting root, and removal waits for the device's entry.
+	 */
+	if (pci_dev_async_probe(dev)) {
+		pci_dev_attach_async(dev);
+	} else {
+		retval = device_attach(&dev->dev);
+		WARN_ON(retval < 0);
+	}
 
 	dev->is_added = 1;
 }
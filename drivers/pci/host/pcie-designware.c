@@ -48,6 +48,8 @@
 #define PCIE_ATU_VIEWPORT		0x900
 #define PCIE_ATU_REGION_INBOUND		(0x1 << 31)
 #define PCIE_ATU_REGION_OUTBOUND	(0x0 << 31)
+#define PCIE_ATU_REGION_INDEX3		(0x3 << 0)
+#define PCIE_ATU_REGION_INDEX2		(0x2 << 0)
 #define PCIE_ATU_REGION_INDEX1		(0x1 << 0)
 #define PCIE_ATU_REGION_INDEX0		(0x0 << 0)
 #define PCIE_ATU_CR1			0x904
@@ -67,6 +69,9 @@
 #define PCIE_ATU_FUNC(x)		(((x) & 0x7) << 16)
 #define PCIE_ATU_UPPER_TARGET		0x91C
 
+/* Never a valid PCIE_ATU_LOWER_TARGET value for a config viewport */
+#define PCIE_ATU_CFG_INVALID		0xffffffff
+
 static struct hw_pci dw_pci;
 
 static unsigned long global_io_offset;
@@ -166,20 +171,25 @@ irqreturn_t dw_handle_msi_irq(struct pcie_port *pp)
 	irqreturn_t ret = IRQ_NONE;
 
 	for (i = 0; i < MAX_MSI_CTRLS; i++) {
+		/* Skip controllers with no enabled vectors */
+		if (!pp->msi_enable[i])
+			continue;
+
 		dw_pcie_rd_own_conf(pp, PCIE_MSI_INTR0_STATUS + i * 12, 4,
 				(u32 *)&val);
-		if (val) {
-			ret = IRQ_HANDLED;
-			pos = 0;
-			while ((pos = find_next_bit(&val, 32, pos)) != 32) {
-				irq = irq_find_mapping(pp->irq_domain,
-						i * 32 + pos);
-				dw_pcie_wr_own_conf(pp,
-						PCIE_MSI_INTR0_STATUS + i * 12,
-						4, 1 << pos);
-				generic_handle_irq(irq);
-				pos++;
-			}
+		if (!val)
+			continue;
+
+		ret = IRQ_HANDLED;
+
+		/* Ack everything we are about to handle with a single write */
+		dw_pcie_wr_own_conf(pp, PCIE_MSI_INTR0_STATUS + i * 12, 4, val);
+
+		pos = 0;
+		while ((pos = find_next_bit(&val, 32, pos)) != 32) {
+			irq = irq_find_mapping(pp->irq_domain, i * 32 + pos);
+			generic_handle_irq(irq);
+			pos++;
 		}
 	}
 
@@ -188,23 +198,51 @@ irqreturn_t dw_handle_msi_irq(struct pcie_port *pp)
 
 void dw_pcie_msi_init(struct pcie_port *pp)
 {
-	pp->msi_data = __get_free_pages(GFP_KERNEL, 0);
+	int i;
+
+	if (!pp->msi_data)
+		pp->msi_data = __get_free_pages(GFP_KERNEL, 0);
 
 	/* program the msi_data */
 	dw_pcie_wr_own_conf(pp, PCIE_MSI_ADDR_LO, 4,
 			virt_to_phys((void *)pp->msi_data));
 	dw_pcie_wr_own_conf(pp, PCIE_MSI_ADDR_HI, 4, 0);
+
+	/* restore the enables in case the controller lost them (resume) */
+	if (!pp->ops->msi_set_irq)
+		for (i = 0; i < MAX_MSI_CTRLS; i++)
+			dw_pcie_wr_own_conf(pp, PCIE_MSI_INTR0_ENABLE + i * 12,
+					    4, pp->msi_enable[i]);
 }
 
-static void dw_pcie_msi_clear_irq(struct pcie_port *pp, int irq)
+/*
+ * Update the cached enable mask for vectors [pos, pos + nvec) and write
+ * each affected MSI controller's enable register once, rather than doing
+ * a read-modify-write per vector.
+ */
+static void dw_pcie_msi_update_enable(struct pcie_port *pp, unsigned int pos,
+				      unsigned int nvec, bool enable)
 {
-	unsigned int res, bit, val;
+	unsigned int i, ctrl;
+
+	for (i = pos; i < pos + nvec; i++) {
+		if (enable)
+			pp->msi_enable[i / 32] |= 1 << (i % 32);
+		else
+			pp->msi_enable[i / 32] &= ~(1 << (i % 32));
+
+		if (enable && pp->ops->msi_set_irq)
+			pp->ops->msi_set_irq(pp, i);
+		else if (!enable && pp->ops->msi_clear_irq)
+			pp->ops->msi_clear_irq(pp, i);
+	}
+
+	if (enable ? pp->ops->msi_set_irq : pp->ops->msi_clear_irq)
+		return;
 
-	res = (irq / 32) * 12;
-	bit = irq % 32;
-	dw_pcie_rd_own_conf(pp, PCIE_MSI_INTR0_ENABLE + res, 4, &val);
-	val &= ~(1 << bit);
-	dw_pcie_wr_own_conf(pp, PCIE_MSI_INTR0_ENABLE + res, 4, val);
+	for (ctrl = pos / 32; ctrl <= (pos + nvec - 1) / 32; ctrl++)
+		dw_pcie_wr_own_conf(pp, PCIE_MSI_INTR0_ENABLE + ctrl * 12, 4,
+				    pp->msi_enable[ctrl]);
 }
 
 static void clear_irq_range(struct pcie_port *pp, unsigned int irq_base,
@@ -212,27 +250,14 @@ static void clear_irq_range(struct pcie_port *pp, unsigned int irq_base,
 {
 	unsigned int i;
 
-	for (i = 0; i < nvec; i++) {
+	for (i = 0; i < nvec; i++)
 		irq_set_msi_desc_off(irq_base, i, NULL);
-		/* Disable corresponding interrupt on MSI controller */
-		if (pp->ops->msi_clear_irq)
-			pp->ops->msi_clear_irq(pp, pos + i);
-		else
-			dw_pcie_msi_clear_irq(pp, pos + i);
-	}
-
-	bitmap_release_region(pp->msi_irq_in_use, pos, order_base_2(nvec));
-}
 
-static void dw_pcie_msi_set_irq(struct pcie_port *pp, int irq)
-{
-	unsigned int res, bit, val;
+	/* Disable corresponding interrupts on MSI controller */
+	if (nvec)
+		dw_pcie_msi_update_enable(pp, pos, nvec, false);
 
-	res = (irq / 32) * 12;
-	bit = irq % 32;
-	dw_pcie_rd_own_conf(pp, PCIE_MSI_INTR0_ENABLE + res, 4, &val);
-	val |= 1 << bit;
-	dw_pcie_wr_own_conf(pp, PCIE_MSI_INTR0_ENABLE + res, 4, val);
+	bitmap_release_region(pp->msi_irq_in_use, pos, order_base_2(nvec));
 }
 
 static int assign_irq(int no_irqs, struct msi_desc *desc, int *pos)
@@ -261,13 +286,11 @@ static int assign_irq(int no_irqs, struct msi_desc *desc, int *pos)
 			clear_irq_range(pp, irq, i, pos0);
 			goto no_valid_irq;
 		}
-		/*Enable corresponding interrupt in MSI interrupt controller */
-		if (pp->ops->msi_set_irq)
-			pp->ops->msi_set_irq(pp, pos0 + i);
-		else
-			dw_pcie_msi_set_irq(pp, pos0 + i);
 	}
 
+	/* Enable corresponding interrupts in MSI interrupt controller */
+	dw_pcie_msi_update_enable(pp, pos0, no_irqs, true);
+
 	*pos = pos0;
 	return irq;
 
@@ -471,6 +494,11 @@ int __init dw_pcie_host_init(struct pcie_port *pp)
 		return -EINVAL;
 	}
 
+	if (of_property_read_u32(np, "num-viewport", &pp->num_viewport))
+		pp->num_viewport = 2;
+	pp->cfg_busdev[0] = PCIE_ATU_CFG_INVALID;
+	pp->cfg_busdev[1] = PCIE_ATU_CFG_INVALID;
+
 	if (IS_ENABLED(CONFIG_PCI_MSI)) {
 		if (!pp->ops->msi_host_init) {
 			pp->irq_domain = irq_domain_add_linear(pp->dev->of_node,
@@ -515,66 +543,94 @@ int __init dw_pcie_host_init(struct pcie_port *pp)
 	return 0;
 }
 
-static void dw_pcie_prog_viewport_cfg0(struct pcie_port *pp, u32 busdev)
+static void dw_pcie_prog_outbound_atu(struct pcie_port *pp, int index,
+		int type, u64 cpu_addr, u64 pci_addr, u32 size)
 {
-	/* Program viewport 0 : OUTBOUND : CFG0 */
-	dw_pcie_writel_rc(pp, PCIE_ATU_REGION_OUTBOUND | PCIE_ATU_REGION_INDEX0,
+	dw_pcie_writel_rc(pp, PCIE_ATU_REGION_OUTBOUND | index,
 			  PCIE_ATU_VIEWPORT);
-	dw_pcie_writel_rc(pp, pp->cfg0_mod_base, PCIE_ATU_LOWER_BASE);
-	dw_pcie_writel_rc(pp, (pp->cfg0_mod_base >> 32), PCIE_ATU_UPPER_BASE);
-	dw_pcie_writel_rc(pp, pp->cfg0_mod_base + pp->cfg0_size - 1,
+	dw_pcie_writel_rc(pp, lower_32_bits(cpu_addr), PCIE_ATU_LOWER_BASE);
+	dw_pcie_writel_rc(pp, upper_32_bits(cpu_addr), PCIE_ATU_UPPER_BASE);
+	dw_pcie_writel_rc(pp, lower_32_bits(cpu_addr + size - 1),
 			  PCIE_ATU_LIMIT);
-	dw_pcie_writel_rc(pp, busdev, PCIE_ATU_LOWER_TARGET);
-	dw_pcie_writel_rc(pp, 0, PCIE_ATU_UPPER_TARGET);
-	dw_pcie_writel_rc(pp, PCIE_ATU_TYPE_CFG0, PCIE_ATU_CR1);
+	dw_pcie_writel_rc(pp, lower_32_bits(pci_addr), PCIE_ATU_LOWER_TARGET);
+	dw_pcie_writel_rc(pp, upper_32_bits(pci_addr), PCIE_ATU_UPPER_TARGET);
+	dw_pcie_writel_rc(pp, type, PCIE_ATU_CR1);
 	dw_pcie_writel_rc(pp, PCIE_ATU_ENABLE, PCIE_ATU_CR2);
 }
 
-static void dw_pcie_prog_viewport_cfg1(struct pcie_port *pp, u32 busdev)
+/*
+ * With at least four viewports, CFG0 and CFG1 each get their own viewport
+ * and MEM/IO are programmed once in dw_pcie_setup_rc().  Otherwise CFG0
+ * shares viewport 0 with MEM and CFG1 shares viewport 1 with IO, and the
+ * outbound window has to be restored after every config access.
+ */
+static inline bool dw_pcie_cfg_viewports_dedicated(struct pcie_port *pp)
 {
-	/* Program viewport 1 : OUTBOUND : CFG1 */
-	dw_pcie_writel_rc(pp, PCIE_ATU_REGION_OUTBOUND | PCIE_ATU_REGION_INDEX1,
-			  PCIE_ATU_VIEWPORT);
-	dw_pcie_writel_rc(pp, PCIE_ATU_TYPE_CFG1, PCIE_ATU_CR1);
-	dw_pcie_writel_rc(pp, pp->cfg1_mod_base, PCIE_ATU_LOWER_BASE);
-	dw_pcie_writel_rc(pp, (pp->cfg1_mod_base >> 32), PCIE_ATU_UPPER_BASE);
-	dw_pcie_writel_rc(pp, pp->cfg1_mod_base + pp->cfg1_size - 1,
-			  PCIE_ATU_LIMIT);
-	dw_pcie_writel_rc(pp, busdev, PCIE_ATU_LOWER_TARGET);
-	dw_pcie_writel_rc(pp, 0, PCIE_ATU_UPPER_TARGET);
-	dw_pcie_writel_rc(pp, PCIE_ATU_ENABLE, PCIE_ATU_CR2);
+	return pp->num_viewport >= 4;
+}
+
+static void dw_pcie_prog_viewport_cfg(struct pcie_port *pp, int cfg,
+				      u32 busdev)
+{
+	bool dedicated = dw_pcie_cfg_viewports_dedicated(pp);
+	int index;
+
+	if (pp->cfg_busdev[cfg] == busdev)
+		return;
+
+	if (dedicated)
+		index = cfg ? PCIE_ATU_REGION_INDEX3 : PCIE_ATU_REGION_INDEX2;
+	else
+		index = cfg ? PCIE_ATU_REGION_INDEX1 : PCIE_ATU_REGION_INDEX0;
+
+	if (dedicated && pp->cfg_busdev[cfg] != PCIE_ATU_CFG_INVALID) {
+		/* Window already set up, only the target bus/devfn moves */
+		dw_pcie_writel_rc(pp, PCIE_ATU_REGION_OUTBOUND | index,
+				  PCIE_ATU_VIEWPORT);
+		dw_pcie_writel_rc(pp, busdev, PCIE_ATU_LOWER_TARGET);
+	} else if (cfg) {
+		dw_pcie_prog_outbound_atu(pp, index, PCIE_ATU_TYPE_CFG1,
+					  pp->cfg1_mod_base, busdev,
+					  pp->cfg1_size);
+	} else {
+		dw_pcie_prog_outbound_atu(pp, index, PCIE_ATU_TYPE_CFG0,
+					  pp->cfg0_mod_base, busdev,
+					  pp->cfg0_size);
+	}
+
+	pp->cfg_busdev[cfg] = busdev;
 }
 
 static void dw_pcie_prog_viewport_mem_outbound(struct pcie_port *pp)
 {
 	/* Program viewport 0 : OUTBOUND : MEM */
-	dw_pcie_writel_rc(pp, PCIE_ATU_REGION_OUTBOUND | PCIE_ATU_REGION_INDEX0,
-			  PCIE_ATU_VIEWPORT);
-	dw_pcie_writel_rc(pp, PCIE_ATU_TYPE_MEM, PCIE_ATU_CR1);
-	dw_pcie_writel_rc(pp, pp->mem_mod_base, PCIE_ATU_LOWER_BASE);
-	dw_pcie_writel_rc(pp, (pp->mem_mod_base >> 32), PCIE_ATU_UPPER_BASE);
-	dw_pcie_writel_rc(pp, pp->mem_mod_base + pp->mem_size - 1,
-			  PCIE_ATU_LIMIT);
-	dw_pcie_writel_rc(pp, pp->mem_bus_addr, PCIE_ATU_LOWER_TARGET);
-	dw_pcie_writel_rc(pp, upper_32_bits(pp->mem_bus_addr),
-			  PCIE_ATU_UPPER_TARGET);
-	dw_pcie_writel_rc(pp, PCIE_ATU_ENABLE, PCIE_ATU_CR2);
+	dw_pcie_prog_outbound_atu(pp, PCIE_ATU_REGION_INDEX0,
+				  PCIE_ATU_TYPE_MEM, pp->mem_mod_base,
+				  pp->mem_bus_addr, pp->mem_size);
+	if (!dw_pcie_cfg_viewports_dedicated(pp))
+		pp->cfg_busdev[0] = PCIE_ATU_CFG_INVALID;
 }
 
 static void dw_pcie_prog_viewport_io_outbound(struct pcie_port *pp)
 {
 	/* Program viewport 1 : OUTBOUND : IO */
-	dw_pcie_writel_rc(pp, PCIE_ATU_REGION_OUTBOUND | PCIE_ATU_REGION_INDEX1,
-			  PCIE_ATU_VIEWPORT);
-	dw_pcie_writel_rc(pp, PCIE_ATU_TYPE_IO, PCIE_ATU_CR1);
-	dw_pcie_writel_rc(pp, pp->io_mod_base, PCIE_ATU_LOWER_BASE);
-	dw_pcie_writel_rc(pp, (pp->io_mod_base >> 32), PCIE_ATU_UPPER_BASE);
-	dw_pcie_writel_rc(pp, pp->io_mod_base + pp->io_size - 1,
-			  PCIE_ATU_LIMIT);
-	dw_pcie_writel_rc(pp, pp->io_bus_addr, PCIE_ATU_LOWER_TARGET);
-	dw_pcie_writel_rc(pp, upper_32_bits(pp->io_bus_addr),
-			  PCIE_ATU_UPPER_TARGET);
-	dw_pcie_writel_rc(pp, PCIE_ATU_ENABLE, PCIE_ATU_CR2);
+	dw_pcie_prog_outbound_atu(pp, PCIE_ATU_REGION_INDEX1,
+				  PCIE_ATU_TYPE_IO, pp->io_mod_base,
+				  pp->io_bus_addr, pp->io_size);
+	if (!dw_pcie_cfg_viewports_dedicated(pp))
+		pp->cfg_busdev[1] = PCIE_ATU_CFG_INVALID;
+}
+
+/* Give a shared viewport back to its MEM or IO window */
+static void dw_pcie_release_viewport_cfg(struct pcie_port *pp, int cfg)
+{
+	if (dw_pcie_cfg_viewports_dedicated(pp))
+		return;
+
+	if (cfg)
+		dw_pcie_prog_viewport_io_outbound(pp);
+	else
+		dw_pcie_prog_viewport_mem_outbound(pp);
 }
 
 static int dw_pcie_rd_other_conf(struct pcie_port *pp, struct pci_bus *bus,
@@ -588,15 +644,15 @@ static int dw_pcie_rd_other_conf(struct pcie_port *pp, struct pci_bus *bus,
 	address = where & ~0x3;
 
 	if (bus->parent->number == pp->root_bus_nr) {
-		dw_pcie_prog_viewport_cfg0(pp, busdev);
+		dw_pcie_prog_viewport_cfg(pp, 0, busdev);
 		ret = dw_pcie_cfg_read(pp->va_cfg0_base + address, where, size,
 				val);
-		dw_pcie_prog_viewport_mem_outbound(pp);
+		dw_pcie_release_viewport_cfg(pp, 0);
 	} else {
-		dw_pcie_prog_viewport_cfg1(pp, busdev);
+		dw_pcie_prog_viewport_cfg(pp, 1, busdev);
 		ret = dw_pcie_cfg_read(pp->va_cfg1_base + address, where, size,
 				val);
-		dw_pcie_prog_viewport_io_outbound(pp);
+		dw_pcie_release_viewport_cfg(pp, 1);
 	}
 
 	return ret;
@@ -613,15 +669,15 @@ static int dw_pcie_wr_other_conf(struct pcie_port *pp, struct pci_bus *bus,
 	address = where & ~0x3;
 
 	if (bus->parent->number == pp->root_bus_nr) {
-		dw_pcie_prog_viewport_cfg0(pp, busdev);
+		dw_pcie_prog_viewport_cfg(pp, 0, busdev);
 		ret = dw_pcie_cfg_write(pp->va_cfg0_base + address, where, size,
 				val);
-		dw_pcie_prog_viewport_mem_outbound(pp);
+		dw_pcie_release_viewport_cfg(pp, 0);
 	} else {
-		dw_pcie_prog_viewport_cfg1(pp, busdev);
+		dw_pcie_prog_viewport_cfg(pp, 1, busdev);
 		ret = dw_pcie_cfg_write(pp->va_cfg1_base + address, where, size,
 				val);
-		dw_pcie_prog_viewport_io_outbound(pp);
+		dw_pcie_release_viewport_cfg(pp, 1);
 	}
 
 	return ret;
@@ -823,6 +879,16 @@ void dw_pcie_setup_rc(struct pcie_port *pp)
 	val |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY |
 		PCI_COMMAND_MASTER | PCI_COMMAND_SERR;
 	dw_pcie_writel_rc(pp, val, PCI_COMMAND);
+
+	/* The iATU may have been reset along with the core */
+	pp->cfg_busdev[0] = PCIE_ATU_CFG_INVALID;
+	pp->cfg_busdev[1] = PCIE_ATU_CFG_INVALID;
+
+	if (dw_pcie_cfg_viewports_dedicated(pp)) {
+		dw_pcie_prog_viewport_mem_outbound(pp);
+		if (pp->io_size)
+			dw_pcie_prog_viewport_io_outbound(pp);
+	}
 }
 
 MODULE_AUTHOR("Jingoo Han <jg1.han@samsung.com>");
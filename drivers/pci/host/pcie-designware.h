@@ -48,11 +48,14 @@ struct pcie_port {
 	struct resource		busn;
 	int			irq;
 	u32			lanes;
+	u32			num_viewport;
+	u32			cfg_busdev[2];	/* cached CFG0/CFG1 targets */
 	struct pcie_host_ops	*ops;
 	int			msi_irq;
 	struct irq_domain	*irq_domain;
 	unsigned long		msi_data;
 	DECLARE_BITMAP(msi_irq_in_use, MAX_MSI_IRQS);
+	u32			msi_enable[MAX_MSI_CTRLS];
 };
 
 struct pcie_host_ops {
@@ -315,8 +315,7 @@ static void pci_acpi_wake_dev(struct work_struct *work)
 	context = container_of(work, struct acpi_device_wakeup_context, work);
 	pci_dev = to_pci_dev(context->dev);
 
-	if (pci_dev->pme_poll)
-		pci_dev->pme_poll = false;
+	pci_pme_irq_seen(pci_dev);
 
 	if (pci_dev->current_state == PCI_D3cold) {
 		pci_wakeup_event(pci_dev);
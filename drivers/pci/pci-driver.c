@@ -27,6 +27,8 @@ struct pci_dynid {
 	struct pci_device_id id;
 };
 
+static int pci_driver_attach_async(struct pci_driver *drv);
+
 /**
  * pci_add_dynid - add a new PCI device ID to this driver and re-probe devices
  * @drv: target pci driver
@@ -72,6 +74,8 @@ int pci_add_dynid(struct pci_driver *drv,
 	list_add_tail(&dynid->node, &drv->dynids.list);
 	spin_unlock(&drv->dynids.lock);
 
+	if (drv->async_probe && !pci_no_async_probe)
+		return pci_driver_attach_async(drv);
 	return driver_attach(&drv->driver);
 }
 EXPORT_SYMBOL_GPL(pci_add_dynid);
@@ -281,6 +285,71 @@ static const struct pci_device_id *pci_match_device(struct pci_driver *drv,
 	return found_id;
 }
 
+struct pci_async_match {
+	struct pci_dev *dev;
+	bool matched;
+};
+
+static int pci_match_async_driver(struct device_driver *driver, void *data)
+{
+	struct pci_driver *drv = to_pci_driver(driver);
+	struct pci_async_match *m = data;
+
+	if (!pci_match_device(drv, m->dev))
+		return 0;
+
+	m->matched = true;
+	/* Any synchronous candidate keeps the whole attach synchronous. */
+	return drv->async_probe ? 0 : 1;
+}
+
+/**
+ * pci_dev_async_probe - decide whether @dev can be attached asynchronously
+ * @dev: PCI device about to be added
+ *
+ * Only endpoints whose every matching driver has set async_probe qualify.
+ * Bridges bind synchronously so their children see the bridge driver in
+ * place, and VFs do so so that pci_enable_sriov() returns with them bound,
+ * as it always has.
+ */
+bool pci_dev_async_probe(struct pci_dev *dev)
+{
+	struct pci_async_match m = { dev, false };
+
+	if (pci_no_async_probe || dev->subordinate || dev->is_virtfn)
+		return false;
+
+	if (bus_for_each_drv(&pci_bus_type, NULL, &m, pci_match_async_driver))
+		return false;
+	return m.matched;
+}
+
+static int pci_attach_async(struct device *dev, void *data)
+{
+	struct pci_dev *pci_dev = to_pci_dev(dev);
+	struct pci_driver *drv = data;
+
+	if (dev->driver || !pci_dev->match_driver ||
+	    !pci_match_device(drv, pci_dev))
+		return 0;
+
+	/* Same exceptions as pci_dev_async_probe() */
+	if (pci_dev->subordinate || pci_dev->is_virtfn)
+		WARN_ON(device_attach(dev) < 0);
+	else
+		pci_dev_attach_async(pci_dev);
+	return 0;
+}
+
+/*
+ * Attach @drv to the unbound devices it matches that are already on the
+ * bus, each one from the PCI async domain.
+ */
+static int pci_driver_attach_async(struct pci_driver *drv)
+{
+	return bus_for_each_dev(&pci_bus_type, NULL, drv, pci_attach_async);
+}
+
 struct drv_dev_and_id {
 	struct pci_driver *drv;
 	struct pci_dev *dev;
@@ -293,6 +362,7 @@ static long local_pci_probe(void *_ddi)
 	struct pci_dev *pci_dev = ddi->dev;
 	struct pci_driver *pci_drv = ddi->drv;
 	struct device *dev = &pci_dev->dev;
+	ktime_t calltime = ktime_set(0, 0);
 	int rc;
 
 	/*
@@ -305,7 +375,13 @@ static long local_pci_probe(void *_ddi)
 	 */
 	pm_runtime_get_sync(dev);
 	pci_dev->driver = pci_drv;
+	if (initcall_debug)
+		calltime = ktime_get();
 	rc = pci_drv->probe(pci_dev, ddi->id);
+	if (initcall_debug)
+		dev_info(dev, "probe of driver %s returned %d after %lld usecs\n",
+			 pci_drv->name, rc,
+			 (long long)ktime_us_delta(ktime_get(), calltime));
 	if (!rc)
 		return rc;
 	if (rc < 0) {
@@ -1246,6 +1322,8 @@ static const struct dev_pm_ops pci_dev_pm_ops = {
 int __pci_register_driver(struct pci_driver *drv, struct module *owner,
 			  const char *mod_name)
 {
+	int error;
+
 	/* initialize common driver fields */
 	drv->driver.name = drv->name;
 	drv->driver.bus = &pci_bus_type;
@@ -1255,8 +1333,25 @@ int __pci_register_driver(struct pci_driver *drv, struct module *owner,
 	spin_lock_init(&drv->dynids.lock);
 	INIT_LIST_HEAD(&drv->dynids.list);
 
-	/* register with core */
-	return driver_register(&drv->driver);
+	if (!drv->async_probe || pci_no_async_probe) {
+		/* register with core */
+		return driver_register(&drv->driver);
+	}
+
+	/*
+	 * At boot the devices are on the bus long before their drivers
+	 * register, so the attach that counts is the one driver_register()
+	 * does.  Keep the core from matching the driver while it registers
+	 * and attach its devices from the async domain afterwards.
+	 */
+	drv->async_registering = true;
+	error = driver_register(&drv->driver);
+	drv->async_registering = false;
+	if (error)
+		return error;
+
+	pci_driver_attach_async(drv);
+	return 0;
 }
 EXPORT_SYMBOL(__pci_register_driver);
 
@@ -1321,6 +1416,9 @@ static int pci_bus_match(struct device *dev, struct device_driver *drv)
 		return 0;
 
 	pci_drv = to_pci_driver(drv);
+	if (pci_drv->async_registering)
+		return 0;
+
 	found_id = pci_match_device(pci_drv, pci_dev);
 	if (found_id)
 		return 1;
@@ -554,6 +554,34 @@ static ssize_t driver_override_show(struct device *dev,
 }
 static DEVICE_ATTR_RW(driver_override);
 
+static ssize_t pme_irq_count_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_pci_dev(dev)->pme_irq_count);
+}
+static DEVICE_ATTR_RO(pme_irq_count);
+
+static ssize_t pme_poll_count_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_pci_dev(dev)->pme_poll_count);
+}
+static DEVICE_ATTR_RO(pme_poll_count);
+
+static ssize_t vpd_fill_usecs_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_pci_dev(dev)->vpd->fill_usecs);
+}
+static DEVICE_ATTR_RO(vpd_fill_usecs);
+
+static ssize_t vpd_cache_hits_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", to_pci_dev(dev)->vpd->cache_hits);
+}
+static DEVICE_ATTR_RO(vpd_cache_hits);
+
 static struct attribute *pci_dev_attrs[] = {
 	&dev_attr_resource.attr,
 	&dev_attr_vendor.attr,
@@ -1249,27 +1277,11 @@ static ssize_t pci_read_rom(struct file *filp, struct kobject *kobj,
 			    loff_t off, size_t count)
 {
 	struct pci_dev *pdev = to_pci_dev(container_of(kobj, struct device, kobj));
-	void __iomem *rom;
-	size_t size;
 
 	if (!pdev->rom_attr_enabled)
 		return -EINVAL;
 
-	rom = pci_map_rom(pdev, &size);	/* size starts out as PCI window size */
-	if (!rom || !size)
-		return -EIO;
-
-	if (off >= size)
-		count = 0;
-	else {
-		if (off + count > size)
-			count = size - off;
-
-		memcpy_fromio(buf, rom + off, count);
-	}
-	pci_unmap_rom(pdev, rom);
-
-	return count;
+	return pci_read_rom_image(pdev, buf, off, count);
 }
 
 static struct bin_attribute pci_config_attr = {
@@ -1360,6 +1372,90 @@ error:
 	return retval;
 }
 
+/**
+ * pcibios_config_ecam_phys - find the ECAM window of a device
+ * @dev: PCI device
+ * @phys: physical address of the device's 4K config page
+ *
+ * Architectures that access config space through a memory-mapped
+ * (ECAM/MMCONFIG) window override this.  Returns 0 when @dev's config
+ * space is reachable through such a window, -ENODEV otherwise.
+ */
+int __weak pcibios_config_ecam_phys(struct pci_dev *dev, phys_addr_t *phys)
+{
+	return -ENODEV;
+}
+
+static bool pci_config_ecam_mappable(struct pci_dev *pdev, phys_addr_t *phys)
+{
+	if (pcibios_config_ecam_phys(pdev, phys))
+		return false;
+
+	/* The page has to hold this function's config space and nothing else */
+	return PAGE_SIZE == PCI_CFG_SPACE_EXP_SIZE && PAGE_ALIGNED(*phys);
+}
+
+/*
+ * Read-only mapping of the device's ECAM page, for monitoring tools
+ * that poll status registers on many devices.  Loads bypass pci_lock
+ * and pci_cfg_access_lock(), so this is not offered for writing.
+ */
+static int pci_mmap_config_ecam(struct file *filp, struct kobject *kobj,
+				struct bin_attribute *attr,
+				struct vm_area_struct *vma)
+{
+	struct pci_dev *pdev = to_pci_dev(container_of(kobj, struct device,
+						       kobj));
+	unsigned long size = vma->vm_end - vma->vm_start;
+	phys_addr_t phys;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (vma->vm_pgoff || size > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (!pci_config_ecam_mappable(pdev, &phys))
+		return -ENODEV;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	return io_remap_pfn_range(vma, vma->vm_start, phys >> PAGE_SHIFT,
+				  size, vma->vm_page_prot);
+}
+
+static struct bin_attribute pci_config_ecam_attr = {
+	.attr =	{
+		.name = "config_ecam",
+		.mode = S_IRUSR,
+	},
+	.size = PCI_CFG_SPACE_EXP_SIZE,
+	.mmap = pci_mmap_config_ecam,
+};
+
+static int pci_create_config_ecam_file(struct pci_dev *pdev)
+{
+	phys_addr_t phys;
+	int retval;
+
+	if (!pci_config_ecam_mappable(pdev, &phys))
+		return 0;
+
+	retval = sysfs_create_bin_file(&pdev->dev.kobj, &pci_config_ecam_attr);
+	if (!retval)
+		pdev->config_ecam_attr = 1;
+	return retval;
+}
+
+static void pci_remove_config_ecam_file(struct pci_dev *pdev)
+{
+	if (!pdev->config_ecam_attr)
+		return;
+
+	sysfs_remove_bin_file(&pdev->dev.kobj, &pci_config_ecam_attr);
+	pdev->config_ecam_attr = 0;
+}
+
 int __must_check pci_create_sysfs_dev_files(struct pci_dev *pdev)
 {
 	int retval;
@@ -1376,10 +1472,14 @@ int __must_check pci_create_sysfs_dev_files(struct pci_dev *pdev)
 	if (retval)
 		goto err;
 
-	retval = pci_create_resource_files(pdev);
+	retval = pci_create_config_ecam_file(pdev);
 	if (retval)
 		goto err_config_file;
 
+	retval = pci_create_resource_files(pdev);
+	if (retval)
+		goto err_ecam_file;
+
 	if (pci_resource_len(pdev, PCI_ROM_RESOURCE))
 		rom_size = pci_resource_len(pdev, PCI_ROM_RESOURCE);
 	else if (pdev->resource[PCI_ROM_RESOURCE].flags & IORESOURCE_ROM_SHADOW)
@@ -1423,6 +1523,8 @@ err_rom_file:
 	}
 err_resource_files:
 	pci_remove_resource_files(pdev);
+err_ecam_file:
+	pci_remove_config_ecam_file(pdev);
 err_config_file:
 	if (pdev->cfg_size < PCI_CFG_SPACE_EXP_SIZE)
 		sysfs_remove_bin_file(&pdev->dev.kobj, &pci_config_attr);
@@ -1466,6 +1568,7 @@ void pci_remove_sysfs_dev_files(struct pci_dev *pdev)
 	else
 		sysfs_remove_bin_file(&pdev->dev.kobj, &pcie_config_attr);
 
+	pci_remove_config_ecam_file(pdev);
 	pci_remove_resource_files(pdev);
 
 	if (pci_resource_len(pdev, PCI_ROM_RESOURCE))
@@ -1502,6 +1605,10 @@ late_initcall(pci_sysfs_init);
 
 static struct attribute *pci_dev_dev_attrs[] = {
 	&vga_attr.attr,
+	&dev_attr_pme_irq_count.attr,
+	&dev_attr_pme_poll_count.attr,
+	&dev_attr_vpd_fill_usecs.attr,
+	&dev_attr_vpd_cache_hits.attr,
 	NULL,
 };
 
@@ -1515,6 +1622,16 @@ static umode_t pci_dev_attrs_are_visible(struct kobject *kobj,
 		if ((pdev->class >> 8) != PCI_CLASS_DISPLAY_VGA)
 			return 0;
 
+	if (a == &dev_attr_pme_irq_count.attr ||
+	    a == &dev_attr_pme_poll_count.attr)
+		if (!pdev->pme_support)
+			return 0;
+
+	if (a == &dev_attr_vpd_fill_usecs.attr ||
+	    a == &dev_attr_vpd_cache_hits.attr)
+		if (!pdev->vpd)
+			return 0;
+
 	return a->mode;
 }
 
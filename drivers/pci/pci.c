@@ -23,6 +23,8 @@
 #include <linux/device.h>
 #include <linux/pm_runtime.h>
 #include <linux/pci_hotplug.h>
+#include <linux/tick.h>
+#include <linux/workqueue.h>
 #include <asm-generic/pci-bridge.h>
 #include <asm/setup.h>
 #include "pci.h"
@@ -45,6 +47,7 @@ static void pci_pme_list_scan(struct work_struct *work);
 static LIST_HEAD(pci_pme_list);
 static DEFINE_MUTEX(pci_pme_list_mutex);
 static DECLARE_DELAYED_WORK(pci_pme_work, pci_pme_list_scan);
+static struct workqueue_struct *pci_pme_wq;
 
 struct pci_pme_device {
 	struct list_head list;
@@ -52,6 +55,11 @@ struct pci_pme_device {
 };
 
 #define PME_TIMEOUT 1000 /* How long between PME checks */
+#define PME_TIMEOUT_MAX (8 * PME_TIMEOUT) /* Backoff limit for idle scans */
+
+/* Current scan interval and when the next scan is due, under the mutex */
+static unsigned int pci_pme_timeout = PME_TIMEOUT;
+static unsigned long pci_pme_next;
 
 static void pci_dev_d3_sleep(struct pci_dev *dev)
 {
@@ -99,6 +107,12 @@ unsigned int pcibios_max_latency = 255;
 /* If set, the PCIe ARI capability will not be used. */
 static bool pcie_ari_disabled;
 
+/* pci=noasyncprobe: attach every driver synchronously */
+bool pci_no_async_probe;
+
+/* pci=novpdcache: read VPD from the device on every access */
+bool pci_vpd_no_cache;
+
 /**
  * pci_bus_max_busnr - returns maximum PCI bus number of given bus' children
  * @bus: pointer to PCI bus structure to search
@@ -1657,12 +1671,28 @@ static int pci_pme_wakeup(struct pci_dev *dev, void *pme_poll_reset)
 		dev->pme_poll = false;
 
 	if (pci_check_pme_status(dev)) {
+		if (pme_poll_reset)
+			dev->pme_irq_count++;
 		pci_wakeup_event(dev);
 		pm_request_resume(&dev->dev);
 	}
 	return 0;
 }
 
+/**
+ * pci_pme_irq_seen - Note a PME of @dev delivered by interrupt.
+ * @dev: Device whose PME was signaled.
+ *
+ * Native PME signaling works for @dev, so stop polling it; the next scan
+ * drops it from the poll list.
+ */
+void pci_pme_irq_seen(struct pci_dev *dev)
+{
+	if (dev->pme_poll)
+		dev->pme_poll = false;
+	dev->pme_irq_count++;
+}
+
 /**
  * pci_pme_wakeup_bus - Walk given bus and wake up devices on it, if necessary.
  * @bus: Top bus of the subtree to walk.
@@ -1688,9 +1718,25 @@ bool pci_pme_capable(struct pci_dev *dev, pci_power_t state)
 }
 EXPORT_SYMBOL(pci_pme_capable);
 
+/*
+ * Arm the next poll.  The work runs on pci_pme_wq, which is kept off
+ * nohz_full CPUs.  It must not be deferrable: the poll is what catches
+ * wakeups from devices whose native PME doesn't work, so it can't wait for
+ * something else to wake an idle CPU.  Called with pci_pme_list_mutex held.
+ */
+static void pci_pme_schedule(unsigned int timeout)
+{
+	unsigned long delay = msecs_to_jiffies(timeout);
+
+	pci_pme_next = jiffies + delay;
+	mod_delayed_work(pci_pme_wq ? pci_pme_wq : system_wq,
+			 &pci_pme_work, delay);
+}
+
 static void pci_pme_list_scan(struct work_struct *work)
 {
 	struct pci_pme_device *pme_dev, *n;
+	bool found = false;
 
 	mutex_lock(&pci_pme_list_mutex);
 	list_for_each_entry_safe(pme_dev, n, &pci_pme_list, list) {
@@ -1705,18 +1751,53 @@ static void pci_pme_list_scan(struct work_struct *work)
 			 */
 			if (bridge && bridge->current_state != PCI_D0)
 				continue;
-			pci_pme_wakeup(pme_dev->dev, NULL);
+			if (pci_check_pme_status(pme_dev->dev)) {
+				pme_dev->dev->pme_poll_count++;
+				pci_wakeup_event(pme_dev->dev);
+				pm_request_resume(&pme_dev->dev->dev);
+				found = true;
+			}
 		} else {
 			list_del(&pme_dev->list);
 			kfree(pme_dev);
 		}
 	}
+
+	/* Back off while polling finds nothing, restart on activity. */
+	if (found)
+		pci_pme_timeout = PME_TIMEOUT;
+	else
+		pci_pme_timeout = min(2 * pci_pme_timeout,
+				      (unsigned int)PME_TIMEOUT_MAX);
+
 	if (!list_empty(&pci_pme_list))
-		schedule_delayed_work(&pci_pme_work,
-				      msecs_to_jiffies(PME_TIMEOUT));
+		pci_pme_schedule(pci_pme_timeout);
 	mutex_unlock(&pci_pme_list_mutex);
 }
 
+static int __init pci_pme_wq_init(void)
+{
+	pci_pme_wq = alloc_workqueue("pci_pme", WQ_UNBOUND | WQ_SYSFS, 1);
+	if (!pci_pme_wq)
+		return -ENOMEM;
+
+#ifdef CONFIG_NO_HZ_FULL
+	/* Keep the poll off CPUs isolated with nohz_full. */
+	if (tick_nohz_full_enabled()) {
+		struct workqueue_attrs *attrs;
+
+		attrs = alloc_workqueue_attrs(GFP_KERNEL);
+		if (attrs) {
+			cpumask_copy(attrs->cpumask, housekeeping_mask);
+			apply_workqueue_attrs(pci_pme_wq, attrs);
+			free_workqueue_attrs(attrs);
+		}
+	}
+#endif
+	return 0;
+}
+core_initcall(pci_pme_wq_init);
+
 /**
  * pci_pme_active - enable or disable PCI device's PME# function
  * @dev: PCI device to handle.
@@ -1760,33 +1841,43 @@ void pci_pme_active(struct pci_dev *dev, bool enable)
 	 * devices below.  So PME poll is used for PCIe devices too.
 	 */
 
-	if (dev->pme_poll) {
+	if (dev->pme_poll && enable) {
 		struct pci_pme_device *pme_dev;
-		if (enable) {
-			pme_dev = kmalloc(sizeof(struct pci_pme_device),
-					  GFP_KERNEL);
-			if (!pme_dev) {
-				dev_warn(&dev->dev, "can't enable PME#\n");
-				return;
-			}
-			pme_dev->dev = dev;
-			mutex_lock(&pci_pme_list_mutex);
-			list_add(&pme_dev->list, &pci_pme_list);
-			if (list_is_singular(&pci_pme_list))
-				schedule_delayed_work(&pci_pme_work,
-						      msecs_to_jiffies(PME_TIMEOUT));
-			mutex_unlock(&pci_pme_list_mutex);
-		} else {
-			mutex_lock(&pci_pme_list_mutex);
-			list_for_each_entry(pme_dev, &pci_pme_list, list) {
-				if (pme_dev->dev == dev) {
-					list_del(&pme_dev->list);
-					kfree(pme_dev);
-					break;
-				}
+
+		pme_dev = kmalloc(sizeof(struct pci_pme_device), GFP_KERNEL);
+		if (!pme_dev) {
+			dev_warn(&dev->dev, "can't enable PME#\n");
+			return;
+		}
+		pme_dev->dev = dev;
+		mutex_lock(&pci_pme_list_mutex);
+		list_add(&pme_dev->list, &pci_pme_list);
+		/*
+		 * Poll a newly added device within PME_TIMEOUT even if the
+		 * scan has backed off, without postponing a closer scan.
+		 */
+		pci_pme_timeout = PME_TIMEOUT;
+		if (list_is_singular(&pci_pme_list) ||
+		    time_after(pci_pme_next,
+			       jiffies + msecs_to_jiffies(PME_TIMEOUT)))
+			pci_pme_schedule(PME_TIMEOUT);
+		mutex_unlock(&pci_pme_list_mutex);
+	} else if (!enable) {
+		struct pci_pme_device *pme_dev;
+
+		/*
+		 * The entry may outlive pme_poll being cleared by a native
+		 * PME, so look for it regardless.
+		 */
+		mutex_lock(&pci_pme_list_mutex);
+		list_for_each_entry(pme_dev, &pci_pme_list, list) {
+			if (pme_dev->dev == dev) {
+				list_del(&pme_dev->list);
+				kfree(pme_dev);
+				break;
 			}
-			mutex_unlock(&pci_pme_list_mutex);
 		}
+		mutex_unlock(&pci_pme_list_mutex);
 	}
 
 	dev_dbg(&dev->dev, "PME# %s\n", enable ? "enabled" : "disabled");
@@ -3468,6 +3559,8 @@ static void pci_dev_save_and_disable(struct pci_dev *dev)
 
 static void pci_dev_restore(struct pci_dev *dev)
 {
+	/* A reset may load new firmware, ROM included. */
+	pci_rom_cache_invalidate(dev);
 	pci_restore_state(dev);
 	pci_reset_notify(dev, false);
 }
@@ -4554,6 +4647,10 @@ static int __init pci_setup(char *str)
 				pci_no_domains();
 			} else if (!strncmp(str, "noari", 5)) {
 				pcie_ari_disabled = true;
+			} else if (!strcmp(str, "noasyncprobe")) {
+				pci_no_async_probe = true;
+			} else if (!strcmp(str, "novpdcache")) {
+				pci_vpd_no_cache = true;
 			} else if (!strncmp(str, "cbiosize=", 9)) {
 				pci_cardbus_io_size = memparse(str + 9, &str);
 			} else if (!strncmp(str, "cbmemsize=", 10)) {
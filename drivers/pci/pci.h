@@ -22,6 +22,7 @@ void pci_create_firmware_label_files(struct pci_dev *pdev);
 void pci_remove_firmware_label_files(struct pci_dev *pdev);
 #endif
 void pci_cleanup_rom(struct pci_dev *dev);
+void pci_rom_cache_invalidate(struct pci_dev *dev);
 #ifdef HAVE_PCI_MMAP
 enum pci_mmap_api {
 	PCI_MMAP_SYSFS,	/* mmap on /sys/bus/pci/devices/<BDF>/resource<N> */
@@ -72,6 +73,7 @@ void pci_power_up(struct pci_dev *dev);
 void pci_disable_enabled_device(struct pci_dev *dev);
 int pci_finish_runtime_suspend(struct pci_dev *dev);
 int __pci_pme_wakeup(struct pci_dev *dev, void *ign);
+void pci_pme_irq_seen(struct pci_dev *dev);
 bool pci_dev_keep_suspended(struct pci_dev *dev);
 void pci_config_pm_runtime_get(struct pci_dev *dev);
 void pci_config_pm_runtime_put(struct pci_dev *dev);
@@ -100,6 +102,8 @@ struct pci_vpd {
 	unsigned int len;
 	const struct pci_vpd_ops *ops;
 	struct bin_attribute *attr; /* descriptor for sysfs VPD entry */
+	unsigned int fill_usecs;	/* time taken to cache the image */
+	unsigned long cache_hits;	/* reads served without the device */
 };
 
 int pci_vpd_pci22_init(struct pci_dev *dev);
@@ -134,9 +138,19 @@ static inline void pci_remove_legacy_files(struct pci_bus *bus) { return; }
 /* Lock for read/write access to pci device and bus lists */
 extern struct rw_semaphore pci_bus_sem;
 
+/* RCU lookup index by domain/bus/devfn and vendor/device, see search.c */
+void pci_dev_index_add(struct pci_dev *dev);
+void pci_dev_index_del(struct pci_dev *dev);
+
 extern raw_spinlock_t pci_lock;
 
 extern unsigned int pci_pm_d3_delay;
+extern bool pci_no_async_probe;
+extern bool pci_vpd_no_cache;
+
+bool pci_dev_async_probe(struct pci_dev *dev);
+void pci_dev_attach_async(struct pci_dev *dev);
+void pci_dev_wait_async_probe(struct pci_dev *dev);
 
 #ifdef CONFIG_PCI_MSI
 void pci_no_msi(void);
@@ -83,8 +83,7 @@ static bool pcie_pme_walk_bus(struct pci_bus *bus)
 	list_for_each_entry(dev, &bus->devices, bus_list) {
 		/* Skip PCIe devices in case we started from a root port. */
 		if (!pci_is_pcie(dev) && pci_check_pme_status(dev)) {
-			if (dev->pme_poll)
-				dev->pme_poll = false;
+			pci_pme_irq_seen(dev);
 
 			pci_wakeup_event(dev);
 			pm_request_resume(&dev->dev);
@@ -148,6 +147,7 @@ static void pcie_pme_handle_request(struct pci_dev *port, u16 req_id)
 			port->pme_poll = false;
 
 		if (pci_check_pme_status(port)) {
+			port->pme_irq_count++;
 			pm_request_resume(&port->dev);
 			found = true;
 		} else {
@@ -192,8 +192,7 @@ static void pcie_pme_handle_request(struct pci_dev *port, u16 req_id)
 		/* The device is there, but we have to check its PME status. */
 		found = pci_check_pme_status(dev);
 		if (found) {
-			if (dev->pme_poll)
-				dev->pme_poll = false;
+			pci_pme_irq_seen(dev);
 
 			pci_wakeup_event(dev);
 			pm_request_resume(&dev->dev);
@@ -1352,6 +1352,11 @@ static void pci_release_capabilities(struct pci_dev *dev)
 	pci_free_cap_save_buffers(dev);
 }
 
+static void pci_free_dev_rcu(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct pci_dev, rcu));
+}
+
 /**
  * pci_release_dev - free a pci device structure when all users of it are finished.
  * @dev: device that's been disconnected
@@ -1369,7 +1374,8 @@ static void pci_release_dev(struct device *dev)
 	pcibios_release_device(pci_dev);
 	pci_bus_put(pci_dev->bus);
 	kfree(pci_dev->driver_override);
-	kfree(pci_dev);
+	/* Lockless index lookups may still be looking at it */
+	call_rcu(&pci_dev->rcu, pci_free_dev_rcu);
 }
 
 struct pci_dev *pci_alloc_dev(struct pci_bus *bus)
@@ -1521,6 +1527,8 @@ void pci_device_add(struct pci_dev *dev, struct pci_bus *bus)
 	list_add_tail(&dev->bus_list, &bus->devices);
 	up_write(&pci_bus_sem);
 
+	pci_dev_index_add(dev);
+
 	ret = pcibios_add_device(dev);
 	WARN_ON(ret < 0);
 
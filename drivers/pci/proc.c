@@ -11,6 +11,7 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/capability.h>
+#include <linux/compat.h>
 #include <asm/uaccess.h>
 #include <asm/byteorder.h>
 #include "pci.h"
@@ -423,12 +424,150 @@ static int proc_bus_pci_dev_open(struct inode *inode, struct file *file)
 	return seq_open(file, &proc_bus_pci_devices_op);
 }
 
+/* Reads copied in from userspace at a time */
+#define PCI_CONFIG_READ_CHUNK	64
+
+/*
+ * Perform one read of a PCIIOC_READ_CONFIG_VEC request.  @dev is the
+ * device used by the previous read; the returned device (with a
+ * reference held) is reused if the next read targets it too.
+ */
+static struct pci_dev *proc_bus_pci_read_one(struct pci_dev *dev,
+					     struct pci_config_read *r,
+					     bool admin)
+{
+	unsigned int limit;
+	u8 b;
+	u16 w;
+	u32 d;
+	int ret;
+
+	if (!dev || pci_domain_nr(dev->bus) != r->domain ||
+	    dev->bus->number != r->bus || dev->devfn != r->devfn) {
+		pci_dev_put(dev);
+		dev = pci_get_domain_bus_and_slot(r->domain, r->bus, r->devfn);
+	}
+
+	r->value = ~0;
+	if (!dev) {
+		r->error = -ENODEV;
+		return NULL;
+	}
+
+	/* Same restriction as proc_bus_pci_read() */
+	if (admin)
+		limit = dev->cfg_size;
+	else if (dev->hdr_type == PCI_HEADER_TYPE_CARDBUS)
+		limit = 128;
+	else
+		limit = 64;
+
+	if ((r->size != 1 && r->size != 2 && r->size != 4) ||
+	    (r->offset & (r->size - 1)) || r->offset + r->size > limit) {
+		r->error = -EINVAL;
+		return dev;
+	}
+
+	pci_config_pm_runtime_get(dev);
+	switch (r->size) {
+	case 1:
+		ret = pci_user_read_config_byte(dev, r->offset, &b);
+		d = b;
+		break;
+	case 2:
+		ret = pci_user_read_config_word(dev, r->offset, &w);
+		d = w;
+		break;
+	default:
+		ret = pci_user_read_config_dword(dev, r->offset, &d);
+		break;
+	}
+	pci_config_pm_runtime_put(dev);
+
+	if (!ret)
+		r->value = d;
+	r->error = ret;
+	return dev;
+}
+
+static long proc_bus_pci_read_config_vec(void __user *arg)
+{
+	struct pci_config_read_vec vec;
+	struct pci_config_read __user *ureads;
+	struct pci_config_read *reads;
+	struct pci_dev *dev = NULL;
+	bool admin = capable(CAP_SYS_ADMIN);
+	unsigned int done, i, n;
+	long ret = 0;
+
+	if (copy_from_user(&vec, arg, sizeof(vec)))
+		return -EFAULT;
+	if (vec.flags)
+		return -EINVAL;
+	if (vec.count > PCI_CONFIG_READ_VEC_MAX)
+		return -E2BIG;
+
+	reads = kmalloc_array(PCI_CONFIG_READ_CHUNK, sizeof(*reads),
+			      GFP_KERNEL);
+	if (!reads)
+		return -ENOMEM;
+
+	ureads = (struct pci_config_read __user *)(unsigned long)vec.reads;
+	for (done = 0; done < vec.count; done += n) {
+		n = min_t(unsigned int, vec.count - done,
+			  PCI_CONFIG_READ_CHUNK);
+
+		if (copy_from_user(reads, ureads + done, n * sizeof(*reads))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			dev = proc_bus_pci_read_one(dev, &reads[i], admin);
+
+		if (copy_to_user(ureads + done, reads, n * sizeof(*reads))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		cond_resched();
+	}
+
+	pci_dev_put(dev);
+	kfree(reads);
+	return ret;
+}
+
+static long proc_bus_pci_dev_ioctl(struct file *file, unsigned int cmd,
+				   unsigned long arg)
+{
+	switch (cmd) {
+	case PCIIOC_READ_CONFIG_VEC:
+		return proc_bus_pci_read_config_vec((void __user *)arg);
+	default:
+		return -EINVAL;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long proc_bus_pci_dev_compat_ioctl(struct file *file, unsigned int cmd,
+					  unsigned long arg)
+{
+	return proc_bus_pci_dev_ioctl(file, cmd,
+				      (unsigned long)compat_ptr(arg));
+}
+#endif
+
 static const struct file_operations proc_bus_pci_dev_operations = {
 	.owner		= THIS_MODULE,
 	.open		= proc_bus_pci_dev_open,
 	.read		= seq_read,
 	.llseek		= seq_lseek,
 	.release	= seq_release,
+	.unlocked_ioctl	= proc_bus_pci_dev_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= proc_bus_pci_dev_compat_ioctl,
+#endif
 };
 
 static int __init pci_proc_init(void)
@@ -8,11 +8,31 @@
  */
 #include <linux/kernel.h>
 #include <linux/export.h>
+#include <linux/module.h>
 #include <linux/pci.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #include "pci.h"
 
+#ifdef MODULE_PARAM_PREFIX
+#undef MODULE_PARAM_PREFIX
+#endif
+#define MODULE_PARAM_PREFIX "pci_rom."
+
+/*
+ * Validated ROM images may be kept in memory so that repeated reads don't
+ * go to the ROM BAR byte by byte.  cache_kb bounds the memory used by all
+ * devices together; 0 (the default) disables the cache.
+ */
+static unsigned int pci_rom_cache_kb;
+module_param_named(cache_kb, pci_rom_cache_kb, uint, 0644);
+MODULE_PARM_DESC(cache_kb, "Memory budget for cached PCI ROM images in KiB");
+
+/* Protects every device's rom_cache and pci_rom_cache_used */
+static DEFINE_SPINLOCK(pci_rom_cache_lock);
+static size_t pci_rom_cache_used;
+
 /**
  * pci_enable_rom - enable ROM decoding for a PCI device
  * @pdev: PCI device to enable
@@ -193,16 +213,127 @@ void pci_unmap_rom(struct pci_dev *pdev, void __iomem *rom)
 }
 EXPORT_SYMBOL(pci_unmap_rom);
 
+static size_t pci_rom_copy_out(void *buf, const void *image, size_t size,
+			       loff_t off, size_t count)
+{
+	if (off >= size)
+		return 0;
+	if (off + count > size)
+		count = size - off;
+	memcpy(buf, image + off, count);
+	return count;
+}
+
+/**
+ * pci_read_rom_image - read from the ROM image of a PCI device
+ * @pdev: target PCI device
+ * @buf: where to put the data
+ * @off: offset into the ROM image
+ * @count: number of bytes to read
+ *
+ * Reads are served from the in-memory copy of the image when there is
+ * one.  Otherwise the ROM is mapped and its image chain parsed, and the
+ * validated image is kept if it fits in the cache budget.
+ *
+ * Returns the number of bytes read, 0 past the end of the image, or a
+ * negative error code if the ROM can't be mapped.
+ */
+ssize_t pci_read_rom_image(struct pci_dev *pdev, void *buf, loff_t off,
+			   size_t count)
+{
+	void __iomem *rom;
+	void *image = NULL;
+	unsigned int gen;
+	size_t size, budget;
+	ssize_t ret;
+
+	spin_lock(&pci_rom_cache_lock);
+	if (pdev->rom_cache) {
+		ret = pci_rom_copy_out(buf, pdev->rom_cache,
+				       pdev->rom_cache_size, off, count);
+		spin_unlock(&pci_rom_cache_lock);
+		return ret;
+	}
+	gen = pdev->rom_cache_gen;
+	spin_unlock(&pci_rom_cache_lock);
+
+	rom = pci_map_rom(pdev, &size);	/* size is the validated image size */
+	if (!rom || !size)
+		return -EIO;
+
+	budget = (size_t)ACCESS_ONCE(pci_rom_cache_kb) << 10;
+	if (size <= budget && pci_rom_cache_used + size <= budget) {
+		image = kmalloc(size, GFP_KERNEL);
+		if (image)
+			memcpy_fromio(image, rom, size);
+	}
+
+	if (image) {
+		ret = pci_rom_copy_out(buf, image, size, off, count);
+	} else if (off >= size) {
+		ret = 0;
+	} else {
+		if (off + count > size)
+			count = size - off;
+		memcpy_fromio(buf, rom + off, count);
+		ret = count;
+	}
+	pci_unmap_rom(pdev, rom);
+
+	if (image) {
+		/* Drop the copy if the ROM changed or others used the budget */
+		spin_lock(&pci_rom_cache_lock);
+		if (!pdev->rom_cache && pdev->rom_cache_gen == gen &&
+		    pci_rom_cache_used + size <= budget) {
+			pdev->rom_cache = image;
+			pdev->rom_cache_size = size;
+			pci_rom_cache_used += size;
+			image = NULL;
+		}
+		spin_unlock(&pci_rom_cache_lock);
+		kfree(image);
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(pci_read_rom_image);
+
+/**
+ * pci_rom_cache_invalidate - drop the cached ROM image of a device
+ * @pdev: PCI device whose ROM may have changed
+ *
+ * Called when the device is reset or a BAR is reassigned.  A cache fill
+ * racing with this is discarded rather than installed.
+ */
+void pci_rom_cache_invalidate(struct pci_dev *pdev)
+{
+	void *image;
+
+	spin_lock(&pci_rom_cache_lock);
+	pdev->rom_cache_gen++;
+	image = pdev->rom_cache;
+	if (image) {
+		pci_rom_cache_used -= pdev->rom_cache_size;
+		pdev->rom_cache = NULL;
+		pdev->rom_cache_size = 0;
+	}
+	spin_unlock(&pci_rom_cache_lock);
+
+	kfree(image);
+}
+
 /**
  * pci_cleanup_rom - free the ROM copy created by pci_map_rom_copy
  * @pdev: pointer to pci device struct
  *
- * Free the copied ROM if we allocated one.
+ * Free the copied ROM if we allocated one, and any cached ROM image.
  */
 void pci_cleanup_rom(struct pci_dev *pdev)
 {
 	struct resource *res = &pdev->resource[PCI_ROM_RESOURCE];
 
+	pci_rom_cache_invalidate(pdev);
+
 	if (res->flags & IORESOURCE_ROM_COPY) {
 		kfree((void *)(unsigned long)res->start);
 		res->flags |= IORESOURCE_UNSET;
@@ -11,11 +11,71 @@
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/interrupt.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 #include "pci.h"
 
 DECLARE_RWSEM(pci_bus_sem);
 EXPORT_SYMBOL_GPL(pci_bus_sem);
 
+/*
+ * Index of all added devices, by domain/bus/devfn and by vendor/device,
+ * so that the common lookups don't have to walk every device in the
+ * system.  Updates are serialized by pci_dev_index_lock, lookups only
+ * need rcu_read_lock().  The pci_dev itself is freed from call_rcu(),
+ * so a device found in the index stays valid for the RCU read side
+ * critical section even if it is being released concurrently.
+ */
+#define PCI_DEV_INDEX_BITS	9
+
+static DEFINE_HASHTABLE(pci_slot_index, PCI_DEV_INDEX_BITS);
+static DEFINE_HASHTABLE(pci_id_index, PCI_DEV_INDEX_BITS);
+static DEFINE_SPINLOCK(pci_dev_index_lock);
+
+static inline u64 pci_slot_key(int domain, unsigned int bus,
+			       unsigned int devfn)
+{
+	return ((u64)(u32)domain << 16) | PCI_DEVID(bus, devfn);
+}
+
+static inline u32 pci_id_key(unsigned int vendor, unsigned int device)
+{
+	return (vendor << 16) | (device & 0xffff);
+}
+
+void pci_dev_index_add(struct pci_dev *dev)
+{
+	dev->slot_key = pci_slot_key(pci_domain_nr(dev->bus),
+				     dev->bus->number, dev->devfn);
+
+	spin_lock(&pci_dev_index_lock);
+	hash_add_rcu(pci_slot_index, &dev->slot_node, dev->slot_key);
+	hash_add_rcu(pci_id_index, &dev->id_node,
+		     pci_id_key(dev->vendor, dev->device));
+	spin_unlock(&pci_dev_index_lock);
+}
+
+void pci_dev_index_del(struct pci_dev *dev)
+{
+	spin_lock(&pci_dev_index_lock);
+	if (hash_hashed(&dev->slot_node)) {
+		hash_del_rcu(&dev->slot_node);
+		hash_del_rcu(&dev->id_node);
+	}
+	spin_unlock(&pci_dev_index_lock);
+}
+
+/*
+ * Take a reference on a device found in the index, unless its last
+ * reference is already gone and it is on its way to being freed.
+ */
+static struct pci_dev *pci_dev_get_rcu(struct pci_dev *dev)
+{
+	if (!kref_get_unless_zero(&dev->dev.kobj.kref))
+		return NULL;
+	return dev;
+}
+
 /*
  * pci_for_each_dma_alias - Iterate over DMA aliases for a device
  * @pdev: starting downstream device
@@ -220,14 +280,19 @@ EXPORT_SYMBOL(pci_get_slot);
 struct pci_dev *pci_get_domain_bus_and_slot(int domain, unsigned int bus,
 					    unsigned int devfn)
 {
-	struct pci_dev *dev = NULL;
-
-	for_each_pci_dev(dev) {
-		if (pci_domain_nr(dev->bus) == domain &&
-		    (dev->bus->number == bus && dev->devfn == devfn))
-			return dev;
+	struct pci_dev *dev, *found = NULL;
+	u64 key = pci_slot_key(domain, bus, devfn);
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(pci_slot_index, dev, slot_node, key) {
+		if (dev->slot_key == key) {
+			found = pci_dev_get_rcu(dev);
+			break;
+		}
 	}
-	return NULL;
+	rcu_read_unlock();
+
+	return found;
 }
 EXPORT_SYMBOL(pci_get_domain_bus_and_slot);
 
@@ -356,6 +421,24 @@ struct pci_dev *pci_get_class(unsigned int class, struct pci_dev *from)
 }
 EXPORT_SYMBOL(pci_get_class);
 
+static bool pci_dev_present_indexed(const struct pci_device_id *id)
+{
+	struct pci_dev *dev;
+	bool found = false;
+	u32 key = pci_id_key(id->vendor, id->device);
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(pci_id_index, dev, id_node, key) {
+		if (pci_match_one_device(id, dev)) {
+			found = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
 /**
  * pci_dev_present - Returns 1 if device matching the device list is present, 0 if not.
  * @ids: A pointer to a null terminated list of struct pci_device_id structures
@@ -373,6 +456,14 @@ int pci_dev_present(const struct pci_device_id *ids)
 
 	WARN_ON(in_interrupt());
 	while (ids->vendor || ids->subvendor || ids->class_mask) {
+		/* Exact vendor/device matches can use the index */
+		if (ids->vendor != PCI_ANY_ID && ids->device != PCI_ANY_ID) {
+			if (pci_dev_present_indexed(ids))
+				return 1;
+			ids++;
+			continue;
+		}
+
 		found = pci_get_dev_by_id(ids, NULL);
 		if (found) {
 			pci_dev_put(found);
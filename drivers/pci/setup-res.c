@@ -54,6 +54,9 @@ void pci_update_resource(struct pci_dev *dev, int resno)
 	if (res->flags & IORESOURCE_PCI_FIXED)
 		return;
 
+	/* Whatever a cached ROM image was read through is moving */
+	pci_rom_cache_invalidate(dev);
+
 	pcibios_resource_to_bus(dev->bus, &region, res);
 
 	new = region.start | (res->flags & PCI_REGION_FLAG_MASK);
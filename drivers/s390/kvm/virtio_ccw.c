@@ -775,6 +775,11 @@ static int virtio_ccw_finalize_features(struct virtio_device *vdev)
 		ret = -ENOMEM;
 		goto out_free;
 	}
+	/*
+	 * We can only describe a split ring to the host; say so before
+	 * virtio_ring picks the ring features.
+	 */
+	__virtio_clear_bit(vdev, VIRTIO_F_RING_PACKED);
 	/* Give virtio_ring a chance to accept features. */
 	vring_transport_features(vdev);
 
@@ -37,6 +37,11 @@ module_param_named(nointxmask, nointxmask, bool, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(nointxmask,
 		  "Disable support for PCI 2.3 style INTx masking.  If this resolves problems for specific devices, report lspci -vvvxxx to linux-pci@vger.kernel.org so the device can be fixed automatically via the broken_intx_masking flag.");
 
+static bool allow_msix_mmap;
+module_param(allow_msix_mmap, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(allow_msix_mmap,
+		 "Allow mmap of the BAR pages containing the MSI-X vector table when the IOMMU provides interrupt remapping.  The table itself remains trapped for read/write, userspace must not access it through the mmap.");
+
 static DEFINE_MUTEX(driver_lock);
 
 static void vfio_pci_try_bus_reset(struct vfio_pci_device *vdev);
@@ -90,6 +95,16 @@ static int vfio_pci_enable(struct vfio_pci_device *vdev)
 		vdev->msix_bar = table & PCI_MSIX_TABLE_BIR;
 		vdev->msix_offset = table & PCI_MSIX_TABLE_OFFSET;
 		vdev->msix_size = ((flags & PCI_MSIX_FLAGS_QSIZE) + 1) * 16;
+
+		/*
+		 * With interrupt remapping, writes to the physical vector
+		 * table cannot be used to generate arbitrary DMA writes or
+		 * interrupts, so it's safe to let the user mmap the pages
+		 * surrounding it.  This lets devices which place doorbells
+		 * next to the table get direct access to them.
+		 */
+		vdev->msix_mmap = allow_msix_mmap &&
+			iommu_capable(pdev->dev.bus, IOMMU_CAP_INTR_REMAP);
 	} else
 		vdev->msix_bar = 0xFF;
 
@@ -411,8 +426,13 @@ static long vfio_pci_ioctl(void *device_data,
 				     VFIO_REGION_INFO_FLAG_WRITE;
 			if (IS_ENABLED(CONFIG_VFIO_PCI_MMAP) &&
 			    pci_resource_flags(pdev, info.index) &
-			    IORESOURCE_MEM && info.size >= PAGE_SIZE)
+			    IORESOURCE_MEM && info.size >= PAGE_SIZE) {
 				info.flags |= VFIO_REGION_INFO_FLAG_MMAP;
+				if (info.index == vdev->msix_bar &&
+				    vdev->msix_mmap)
+					info.flags |=
+					      VFIO_REGION_INFO_FLAG_MSIX_MAPPABLE;
+			}
 			break;
 		case VFIO_PCI_ROM_REGION_INDEX:
 		{
@@ -795,7 +815,7 @@ static int vfio_pci_mmap(void *device_data, struct vm_area_struct *vma)
 	if (phys_len < PAGE_SIZE || req_start + req_len > phys_len)
 		return -EINVAL;
 
-	if (index == vdev->msix_bar) {
+	if (index == vdev->msix_bar && !vdev->msix_mmap) {
 		/*
 		 * Disallow mmaps overlapping the MSI-X table; users don't
 		 * get to touch this directly.  We could find somewhere
@@ -803,6 +823,11 @@ static int vfio_pci_mmap(void *device_data, struct vm_area_struct *vma)
 		 * a recommendation, not a requirement, so the user needs
 		 * to know which bits are real.  Requiring them to mmap
 		 * around the table makes that clear.
+		 *
+		 * When msix_mmap is set the user has been told, via
+		 * VFIO_REGION_INFO_FLAG_MSIX_MAPPABLE, that the table is
+		 * still only accessible through read/write and is expected
+		 * to overlay its own emulation on that range.
 		 */
 
 		/* If neither entirely above nor below, then it overlaps */
@@ -131,6 +131,14 @@ static int vm_finalize_features(struct virtio_device *vdev)
 {
 	struct virtio_mmio_device *vm_dev = to_virtio_mmio_device(vdev);
 
+	/*
+	 * Version 1 devices only take a PFN, which implies a split ring.
+	 * Drop it before virtio_ring looks at the features, so it doesn't
+	 * give up indirect descriptors for a packed ring we won't use.
+	 */
+	if (vm_dev->version == 1)
+		__virtio_clear_bit(vdev, VIRTIO_F_RING_PACKED);
+
 	/* Give virtio_ring a chance to accept features. */
 	vring_transport_features(vdev);
 
@@ -58,6 +58,27 @@ static irqreturn_t vp_config_changed(int irq, void *opaque)
 	return IRQ_HANDLED;
 }
 
+/*
+ * Notify only the virtqueues bound to a shared MSI-X vector.  No lock: a
+ * vq's bit is only set once it is in vp_dev->vqs[], and vp_del_vq() waits
+ * for this handler after clearing the bit, so vector groups on different
+ * CPUs don't serialize on vp_dev->lock.
+ */
+static irqreturn_t vp_vring_vec_interrupt(int irq, void *opaque)
+{
+	struct virtio_pci_vec_info *vec = opaque;
+	struct virtio_pci_device *vp_dev = vec->vp_dev;
+	irqreturn_t ret = IRQ_NONE;
+	unsigned i;
+
+	for_each_set_bit(i, vec->vqs, vp_dev->nvqs) {
+		if (vring_interrupt(irq, vp_dev->vqs[i]->vq) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+	}
+
+	return ret;
+}
+
 /* Notify all virtqueues on an interrupt. */
 static irqreturn_t vp_vring_interrupt(int irq, void *opaque)
 {
@@ -113,12 +134,21 @@ static void vp_free_vectors(struct virtio_device *vdev)
 	}
 
 	for (i = 0; i < vp_dev->msix_used_vectors; ++i)
-		free_irq(vp_dev->msix_entries[i].vector, vp_dev);
+		free_irq(vp_dev->msix_entries[i].vector,
+			 i < VP_MSIX_VQ_VECTOR ? (void *)vp_dev :
+						 &vp_dev->msix_vec_info[i]);
 
 	for (i = 0; i < vp_dev->msix_vectors; i++)
 		if (vp_dev->msix_affinity_masks[i])
 			free_cpumask_var(vp_dev->msix_affinity_masks[i]);
 
+	if (vp_dev->msix_vec_info) {
+		for (i = 0; i < vp_dev->msix_vectors; i++)
+			kfree(vp_dev->msix_vec_info[i].vqs);
+		kfree(vp_dev->msix_vec_info);
+		vp_dev->msix_vec_info = NULL;
+	}
+
 	if (vp_dev->msix_enabled) {
 		/* Disable the vector used for configuration */
 		vp_dev->config_vector(vp_dev, VIRTIO_MSI_NO_VECTOR);
@@ -137,6 +167,8 @@ static void vp_free_vectors(struct virtio_device *vdev)
 	vp_dev->msix_affinity_masks = NULL;
 }
 
+/* nvectors includes the config vector; unless per_vq_vectors is set, the
+ * vectors after it are requested here and shared by groups of vqs. */
 static int vp_request_msix_vectors(struct virtio_device *vdev, int nvectors,
 				   bool per_vq_vectors)
 {
@@ -165,6 +197,22 @@ static int vp_request_msix_vectors(struct virtio_device *vdev, int nvectors,
 					GFP_KERNEL))
 			goto error;
 
+	if (!per_vq_vectors) {
+		vp_dev->msix_vec_info = kcalloc(nvectors,
+						sizeof *vp_dev->msix_vec_info,
+						GFP_KERNEL);
+		if (!vp_dev->msix_vec_info)
+			goto error;
+		for (i = VP_MSIX_VQ_VECTOR; i < nvectors; ++i) {
+			vp_dev->msix_vec_info[i].vp_dev = vp_dev;
+			vp_dev->msix_vec_info[i].vqs =
+				kcalloc(BITS_TO_LONGS(vp_dev->nvqs),
+					sizeof(unsigned long), GFP_KERNEL);
+			if (!vp_dev->msix_vec_info[i].vqs)
+				goto error;
+		}
+	}
+
 	for (i = 0; i < nvectors; ++i)
 		vp_dev->msix_entries[i].entry = i;
 
@@ -192,14 +240,22 @@ static int vp_request_msix_vectors(struct virtio_device *vdev, int nvectors,
 		goto error;
 	}
 
-	if (!per_vq_vectors) {
-		/* Shared vector for all VQs */
+	/* Shared vectors, each serving a group of VQs */
+	while (!per_vq_vectors && vp_dev->msix_used_vectors < nvectors) {
 		v = vp_dev->msix_used_vectors;
-		snprintf(vp_dev->msix_names[v], sizeof *vp_dev->msix_names,
-			 "%s-virtqueues", name);
+		if (nvectors == VP_MSIX_VQ_VECTOR + 1)
+			snprintf(vp_dev->msix_names[v],
+				 sizeof *vp_dev->msix_names,
+				 "%s-virtqueues", name);
+		else
+			snprintf(vp_dev->msix_names[v],
+				 sizeof *vp_dev->msix_names,
+				 "%s-virtqueues-%u", name,
+				 v - VP_MSIX_VQ_VECTOR);
 		err = request_irq(vp_dev->msix_entries[v].vector,
-				  vp_vring_interrupt, 0, vp_dev->msix_names[v],
-				  vp_dev);
+				  vp_vring_vec_interrupt, 0,
+				  vp_dev->msix_names[v],
+				  &vp_dev->msix_vec_info[v]);
 		if (err)
 			goto error;
 		++vp_dev->msix_used_vectors;
@@ -241,15 +297,20 @@ static struct virtqueue *vp_setup_vq(struct virtio_device *vdev, unsigned index,
 		goto out_info;
 
 	info->vq = vq;
+	vp_dev->vqs[index] = info;
 	if (callback) {
 		spin_lock_irqsave(&vp_dev->lock, flags);
 		list_add(&info->node, &vp_dev->virtqueues);
+		if (vp_dev->msix_vec_info && msix_vec != VIRTIO_MSI_NO_VECTOR) {
+			/* Publish vqs[index] before the lockless handler */
+			smp_wmb();
+			set_bit(index, vp_dev->msix_vec_info[msix_vec].vqs);
+		}
 		spin_unlock_irqrestore(&vp_dev->lock, flags);
 	} else {
 		INIT_LIST_HEAD(&info->node);
 	}
 
-	vp_dev->vqs[index] = info;
 	return vq;
 
 out_info:
@@ -265,8 +326,14 @@ static void vp_del_vq(struct virtqueue *vq)
 
 	spin_lock_irqsave(&vp_dev->lock, flags);
 	list_del(&info->node);
+	if (vp_dev->msix_vec_info && info->msix_vector != VIRTIO_MSI_NO_VECTOR)
+		clear_bit(vq->index, vp_dev->msix_vec_info[info->msix_vector].vqs);
 	spin_unlock_irqrestore(&vp_dev->lock, flags);
 
+	/* vp_vring_vec_interrupt() may still be looking at the vq */
+	if (vp_dev->msix_vec_info && info->msix_vector != VIRTIO_MSI_NO_VECTOR)
+		synchronize_irq(vp_dev->msix_entries[info->msix_vector].vector);
+
 	vp_dev->del_vq(info);
 	kfree(info);
 }
@@ -298,15 +365,22 @@ static int vp_try_to_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 			      vq_callback_t *callbacks[],
 			      const char *names[],
 			      bool use_msix,
-			      bool per_vq_vectors)
+			      bool per_vq_vectors,
+			      unsigned shared_vectors)
 {
 	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
 	u16 msix_vec;
 	int i, err, nvectors, allocated_vectors;
+	unsigned ncallbacks = 0, grouped = 0;
 
 	vp_dev->vqs = kmalloc(nvqs * sizeof *vp_dev->vqs, GFP_KERNEL);
 	if (!vp_dev->vqs)
 		return -ENOMEM;
+	vp_dev->nvqs = nvqs;
+
+	for (i = 0; i < nvqs; ++i)
+		if (names[i] && callbacks[i])
+			++ncallbacks;
 
 	if (!use_msix) {
 		/* Old style: one normal interrupt for change and all vqs. */
@@ -321,8 +395,11 @@ static int vp_try_to_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 				if (callbacks[i])
 					++nvectors;
 		} else {
-			/* Second best: one for change, shared for all vqs. */
-			nvectors = 2;
+			/* Otherwise: one for change, the rest shared by
+			 * groups of vqs. */
+			shared_vectors = clamp(shared_vectors, 1U,
+					       max(ncallbacks, 1U));
+			nvectors = VP_MSIX_VQ_VECTOR + shared_vectors;
 		}
 
 		err = vp_request_msix_vectors(vdev, nvectors, per_vq_vectors);
@@ -341,7 +418,12 @@ static int vp_try_to_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 		else if (vp_dev->per_vq_vectors)
 			msix_vec = allocated_vectors++;
 		else
-			msix_vec = VP_MSIX_VQ_VECTOR;
+			/* Bind neighbouring vqs to the same vector: drivers
+			 * number queues meant for one CPU (e.g. an rx/tx
+			 * pair) consecutively, so a group tends to share
+			 * the affinity set by vp_set_vq_affinity(). */
+			msix_vec = VP_MSIX_VQ_VECTOR +
+				   grouped++ * shared_vectors / ncallbacks;
 		vqs[i] = vp_setup_vq(vdev, i, callbacks[i], names[i], msix_vec);
 		if (IS_ERR(vqs[i])) {
 			err = PTR_ERR(vqs[i]);
@@ -378,20 +460,34 @@ int vp_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 		vq_callback_t *callbacks[],
 		const char *names[])
 {
-	int err;
+	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
+	int err, nvec;
+	unsigned shared;
 
 	/* Try MSI-X with one vector per queue. */
-	err = vp_try_to_find_vqs(vdev, nvqs, vqs, callbacks, names, true, true);
+	err = vp_try_to_find_vqs(vdev, nvqs, vqs, callbacks, names,
+				 true, true, 0);
 	if (!err)
 		return 0;
-	/* Fallback: MSI-X with one vector for config, one shared for queues. */
+	/* Fallback: MSI-X with one vector for config and as many as the
+	 * device has left for groups of queues, halving on failure. */
+	nvec = pci_msix_vec_count(vp_dev->pci_dev);
+	for (shared = nvec > VP_MSIX_VQ_VECTOR + 1 ?
+		      nvec - VP_MSIX_VQ_VECTOR : 0;
+	     shared > 1; shared /= 2) {
+		err = vp_try_to_find_vqs(vdev, nvqs, vqs, callbacks, names,
+					 true, false, shared);
+		if (!err)
+			return 0;
+	}
+	/* Then one vector for config, one shared for all queues. */
 	err = vp_try_to_find_vqs(vdev, nvqs, vqs, callbacks, names,
-				 true, false);
+				 true, false, 1);
 	if (!err)
 		return 0;
 	/* Finally fall back to regular interrupts. */
 	return vp_try_to_find_vqs(vdev, nvqs, vqs, callbacks, names,
-				  false, false);
+				  false, false, 0);
 }
 
 const char *vp_bus_name(struct virtio_device *vdev)
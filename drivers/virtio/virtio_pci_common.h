@@ -48,6 +48,14 @@ struct virtio_pci_vq_info {
 	unsigned msix_vector;
 };
 
+/* A MSI-X vector shared by a group of virtqueues */
+struct virtio_pci_vec_info {
+	struct virtio_pci_device *vp_dev;
+
+	/* bitmap of the virtqueue indexes bound to this vector */
+	unsigned long *vqs;
+};
+
 /* Our device structure */
 struct virtio_pci_device {
 	struct virtio_device vdev;
@@ -85,6 +93,7 @@ struct virtio_pci_device {
 
 	/* array of all queues for house-keeping */
 	struct virtio_pci_vq_info **vqs;
+	unsigned nvqs;
 
 	/* MSI-X support */
 	int msix_enabled;
@@ -98,6 +107,8 @@ struct virtio_pci_device {
 	unsigned msix_vectors;
 	/* Vectors allocated, excluding per-vq vectors if any */
 	unsigned msix_used_vectors;
+	/* Per vector dispatch state for vectors shared by several vqs */
+	struct virtio_pci_vec_info *msix_vec_info;
 
 	/* Whether we have vector per vq */
 	bool per_vq_vectors;
@@ -115,7 +126,8 @@ struct virtio_pci_device {
 
 /* Constants for MSI-X */
 /* Use first vector for configuration changes, second and the rest for
- * virtqueues Thus, we need at least 2 vectors for MSI. */
+ * virtqueues Thus, we need at least 2 vectors for MSI.  When there are
+ * fewer vq vectors than vqs, each vq vector serves a group of vqs. */
 enum {
 	VP_MSIX_CONFIG_VECTOR = 0,
 	VP_MSIX_VQ_VECTOR = 1,
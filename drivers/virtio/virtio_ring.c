@@ -54,6 +54,17 @@
 #define END_USE(vq)
 #endif
 
+static bool packed_ring;
+module_param(packed_ring, bool, S_IRUGO);
+MODULE_PARM_DESC(packed_ring,
+		 "Use the packed ring layout with devices that offer it");
+
+/* Per buffer state of a packed ring, indexed by buffer id. */
+struct vring_desc_state_packed {
+	u16 num;		/* Descriptor list length. */
+	u16 next;		/* The next id on the free id list. */
+};
+
 struct vring_virtqueue {
 	struct virtqueue vq;
 
@@ -72,14 +83,38 @@ struct vring_virtqueue {
 	/* Host publishes avail event idx */
 	bool event;
 
+	/* Packed ring layout negotiated; vring below only holds num */
+	bool packed;
+
 	/* Head of free buffer list. */
 	unsigned int free_head;
 	/* Number we've added since last sync. */
 	unsigned int num_added;
 
+	/* Split ring avail->idx as the driver sees it; may run ahead of
+	 * the shared copy while a batch is open. */
+	u16 avail_idx_shadow;
+	/* Defer avail->idx updates until virtqueue_batch_end()/kick. */
+	bool batching;
+
 	/* Last used index we've seen. */
 	u16 last_used_idx;
 
+	/* Packed ring state */
+	struct vring_packed_desc *packed_desc;
+	struct vring_packed_desc_event *driver_event;
+	struct vring_packed_desc_event *device_event;
+	struct vring_desc_state_packed *desc_state;
+	/* Next descriptor slot we will make available, and its wrap count. */
+	u16 next_avail_idx;
+	bool avail_wrap_counter;
+	/* AVAIL/USED flag bits for descriptors we make available. */
+	u16 avail_used_flags;
+	/* Wrap count matching last_used_idx. */
+	bool used_wrap_counter;
+	/* Last value written to driver_event->flags. */
+	u16 event_flags_shadow;
+
 	/* How to notify other side. FIXME: commonalize hcalls! */
 	bool (*notify)(struct virtqueue *vq);
 
@@ -120,6 +155,399 @@ static struct vring_desc *alloc_indirect(struct virtqueue *_vq,
 	return desc;
 }
 
+/*
+ * Packed ring.
+ *
+ * Descriptors are made available in place at next_avail_idx and written
+ * back in place by the device, so adding and completing a buffer touches
+ * the descriptor ring only.  Ownership of a slot is tracked by the AVAIL
+ * and USED flag bits compared against a wrap counter that flips each
+ * time an index passes the end of the ring.  Buffer ids are independent
+ * of slot positions and come from a free list in desc_state.
+ *
+ * The packed layout requires VIRTIO_F_VERSION_1, so everything in the
+ * ring is little endian.
+ */
+static inline bool is_used_desc_packed(const struct vring_virtqueue *vq,
+				       u16 idx, bool used_wrap_counter)
+{
+	u16 flags = le16_to_cpu(vq->packed_desc[idx].flags);
+	bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+	bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+	return avail == used && used == used_wrap_counter;
+}
+
+static inline bool more_used_packed(const struct vring_virtqueue *vq)
+{
+	return is_used_desc_packed(vq, vq->last_used_idx,
+				   vq->used_wrap_counter);
+}
+
+static inline u16 packed_event_off_wrap(u16 idx, bool wrap_counter)
+{
+	return idx | (wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+}
+
+static int virtqueue_add_packed(struct vring_virtqueue *vq,
+				struct scatterlist *sgs[],
+				unsigned int total_sg,
+				unsigned int out_sgs,
+				unsigned int in_sgs,
+				void *data)
+{
+	struct vring_packed_desc *desc = vq->packed_desc;
+	struct scatterlist *sg;
+	unsigned int n, c = 0;
+	u16 head, i, id, flags, head_flags = 0;
+
+	START_USE(vq);
+
+	BUG_ON(data == NULL);
+
+	if (unlikely(vq->broken)) {
+		END_USE(vq);
+		return -EIO;
+	}
+
+	BUG_ON(total_sg > vq->vring.num);
+	BUG_ON(total_sg == 0);
+
+	if (vq->vq.num_free < total_sg) {
+		pr_debug("Can't add buf len %i - avail = %i\n",
+			 total_sg, vq->vq.num_free);
+		if (out_sgs)
+			vq->notify(&vq->vq);
+		END_USE(vq);
+		return -ENOSPC;
+	}
+
+	id = vq->free_head;
+	head = i = vq->next_avail_idx;
+
+	for (n = 0; n < out_sgs + in_sgs; n++) {
+		for (sg = sgs[n]; sg; sg = sg_next(sg)) {
+			flags = vq->avail_used_flags;
+			if (++c != total_sg)
+				flags |= VRING_DESC_F_NEXT;
+			if (n >= out_sgs)
+				flags |= VRING_DESC_F_WRITE;
+
+			desc[i].addr = cpu_to_le64(sg_phys(sg));
+			desc[i].len = cpu_to_le32(sg->length);
+			desc[i].id = cpu_to_le16(id);
+
+			/* The head is only exposed once the chain is done. */
+			if (i == head)
+				head_flags = flags;
+			else
+				desc[i].flags = cpu_to_le16(flags);
+
+			if (++i >= vq->vring.num) {
+				i = 0;
+				vq->avail_wrap_counter ^= 1;
+				vq->avail_used_flags ^=
+					1 << VRING_PACKED_DESC_F_AVAIL |
+					1 << VRING_PACKED_DESC_F_USED;
+			}
+		}
+	}
+
+	vq->vq.num_free -= total_sg;
+	vq->next_avail_idx = i;
+
+	vq->desc_state[id].num = total_sg;
+	vq->free_head = vq->desc_state[id].next;
+	vq->data[id] = data;
+
+	/* The rest of the chain must be visible before the head is. */
+	virtio_wmb(vq->weak_barriers);
+	desc[head].flags = cpu_to_le16(head_flags);
+	vq->num_added += total_sg;
+
+	pr_debug("Added buffer id %i at %i to %p\n", id, head, vq);
+	END_USE(vq);
+
+	/* As for the split ring, kick before the event index can wrap. */
+	if (unlikely(vq->num_added >= (1 << 15) - 1))
+		virtqueue_kick(&vq->vq);
+
+	return 0;
+}
+
+static bool virtqueue_kick_prepare_packed(struct vring_virtqueue *vq)
+{
+	union {
+		struct {
+			__le16 off_wrap;
+			__le16 flags;
+		};
+		u32 u32;
+	} snapshot;
+	u16 new, old, off_wrap, flags, event_idx;
+	bool needs_kick;
+
+	START_USE(vq);
+	/* We need to expose the new descriptors before checking for events. */
+	virtio_mb(vq->weak_barriers);
+
+	old = vq->next_avail_idx - vq->num_added;
+	new = vq->next_avail_idx;
+	vq->num_added = 0;
+
+	/* Read off_wrap and flags in one go so they are consistent. */
+	snapshot.u32 = ACCESS_ONCE(*(u32 *)vq->device_event);
+	flags = le16_to_cpu(snapshot.flags);
+
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC) {
+		needs_kick = (flags != VRING_PACKED_EVENT_FLAG_DISABLE);
+		goto out;
+	}
+
+	off_wrap = le16_to_cpu(snapshot.off_wrap);
+	event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+	    vq->avail_wrap_counter)
+		event_idx -= vq->vring.num;
+
+	needs_kick = vring_need_event(event_idx, new, old);
+out:
+	END_USE(vq);
+	return needs_kick;
+}
+
+static void detach_buf_packed(struct vring_virtqueue *vq, unsigned int id)
+{
+	vq->data[id] = NULL;
+	vq->vq.num_free += vq->desc_state[id].num;
+	vq->desc_state[id].next = vq->free_head;
+	vq->free_head = id;
+}
+
+static void *virtqueue_get_buf_packed(struct vring_virtqueue *vq,
+				      unsigned int *len)
+{
+	u16 last_used, id;
+	void *ret;
+
+	START_USE(vq);
+
+	if (unlikely(vq->broken)) {
+		END_USE(vq);
+		return NULL;
+	}
+
+	if (!more_used_packed(vq)) {
+		pr_debug("No more buffers in queue\n");
+		END_USE(vq);
+		return NULL;
+	}
+
+	/* Only get used elements after they have been exposed by host. */
+	virtio_rmb(vq->weak_barriers);
+
+	last_used = vq->last_used_idx;
+	id = le16_to_cpu(vq->packed_desc[last_used].id);
+	*len = le32_to_cpu(vq->packed_desc[last_used].len);
+
+	if (unlikely(id >= vq->vring.num)) {
+		BAD_RING(vq, "id %u out of range\n", id);
+		return NULL;
+	}
+	if (unlikely(!vq->data[id])) {
+		BAD_RING(vq, "id %u is not a head!\n", id);
+		return NULL;
+	}
+
+	/* detach_buf_packed clears data, so grab it now. */
+	ret = vq->data[id];
+	vq->last_used_idx += vq->desc_state[id].num;
+	if (vq->last_used_idx >= vq->vring.num) {
+		vq->last_used_idx -= vq->vring.num;
+		vq->used_wrap_counter ^= 1;
+	}
+	detach_buf_packed(vq, id);
+
+	/* If we expect an interrupt for the next entry, tell host
+	 * by writing event index and flush out the write before
+	 * the read in the next get_buf call. */
+	if (vq->event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+		vq->driver_event->off_wrap = cpu_to_le16(
+			packed_event_off_wrap(vq->last_used_idx,
+					      vq->used_wrap_counter));
+		virtio_mb(vq->weak_barriers);
+	}
+
+#ifdef DEBUG
+	vq->last_add_time_valid = false;
+#endif
+
+	END_USE(vq);
+	return ret;
+}
+
+static void virtqueue_disable_cb_packed(struct vring_virtqueue *vq)
+{
+	if (vq->event_flags_shadow != VRING_PACKED_EVENT_FLAG_DISABLE) {
+		vq->event_flags_shadow = VRING_PACKED_EVENT_FLAG_DISABLE;
+		vq->driver_event->flags = cpu_to_le16(vq->event_flags_shadow);
+	}
+}
+
+static void virtqueue_enable_events_packed(struct vring_virtqueue *vq)
+{
+	if (vq->event_flags_shadow == VRING_PACKED_EVENT_FLAG_DISABLE) {
+		vq->event_flags_shadow = vq->event ?
+					 VRING_PACKED_EVENT_FLAG_DESC :
+					 VRING_PACKED_EVENT_FLAG_ENABLE;
+		vq->driver_event->flags = cpu_to_le16(vq->event_flags_shadow);
+	}
+}
+
+static unsigned virtqueue_enable_cb_prepare_packed(struct vring_virtqueue *vq)
+{
+	u16 off_wrap;
+
+	START_USE(vq);
+
+	off_wrap = packed_event_off_wrap(vq->last_used_idx,
+					 vq->used_wrap_counter);
+	if (vq->event) {
+		vq->driver_event->off_wrap = cpu_to_le16(off_wrap);
+		/* The event offset must be visible before the flags. */
+		virtio_wmb(vq->weak_barriers);
+	}
+	virtqueue_enable_events_packed(vq);
+
+	END_USE(vq);
+	return off_wrap;
+}
+
+static bool virtqueue_poll_packed(struct vring_virtqueue *vq, u16 off_wrap)
+{
+	bool wrap_counter = off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR;
+	u16 used_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+	virtio_mb(vq->weak_barriers);
+	return is_used_desc_packed(vq, used_idx, wrap_counter);
+}
+
+static bool virtqueue_enable_cb_delayed_packed(struct vring_virtqueue *vq)
+{
+	u16 used_idx, bufs;
+	bool wrap_counter;
+
+	START_USE(vq);
+
+	used_idx = vq->last_used_idx;
+	wrap_counter = vq->used_wrap_counter;
+
+	if (vq->event) {
+		/* TODO: tune this threshold */
+		bufs = (vq->vring.num - vq->vq.num_free) * 3 / 4;
+		used_idx += bufs;
+		if (used_idx >= vq->vring.num) {
+			used_idx -= vq->vring.num;
+			wrap_counter ^= 1;
+		}
+		vq->driver_event->off_wrap =
+			cpu_to_le16(packed_event_off_wrap(used_idx,
+							  wrap_counter));
+		/* The event offset must be visible before the flags. */
+		virtio_wmb(vq->weak_barriers);
+	}
+	virtqueue_enable_events_packed(vq);
+
+	virtio_mb(vq->weak_barriers);
+	if (is_used_desc_packed(vq, used_idx, wrap_counter)) {
+		END_USE(vq);
+		return false;
+	}
+
+	END_USE(vq);
+	return true;
+}
+
+static void *virtqueue_detach_unused_buf_packed(struct vring_virtqueue *vq)
+{
+	unsigned int i;
+	void *buf;
+
+	START_USE(vq);
+
+	for (i = 0; i < vq->vring.num; i++) {
+		if (!vq->data[i])
+			continue;
+		/* detach_buf_packed clears data, so grab it now. */
+		buf = vq->data[i];
+		detach_buf_packed(vq, i);
+		END_USE(vq);
+		return buf;
+	}
+	/* That should have freed everything. */
+	BUG_ON(vq->vq.num_free != vq->vring.num);
+
+	END_USE(vq);
+	return NULL;
+}
+
+static int vring_init_packed(struct vring_virtqueue *vq, unsigned int num,
+			     void *pages)
+{
+	unsigned int i;
+
+	vq->desc_state = kmalloc_array(num, sizeof(*vq->desc_state),
+				       GFP_KERNEL);
+	if (!vq->desc_state)
+		return -ENOMEM;
+
+	/*
+	 * The transport sized the pages for a split ring, which is always
+	 * larger than the descriptors plus the two event structures.
+	 */
+	vq->vring.num = num;
+	vq->packed_desc = pages;
+	vq->driver_event = pages + num * sizeof(struct vring_packed_desc);
+	vq->device_event = vq->driver_event + 1;
+
+	vq->next_avail_idx = 0;
+	vq->avail_wrap_counter = 1;
+	vq->avail_used_flags = 1 << VRING_PACKED_DESC_F_AVAIL;
+	vq->used_wrap_counter = 1;
+
+	/* No callback?  Tell other side not to bother us. */
+	vq->event_flags_shadow = vq->vq.callback ?
+				 VRING_PACKED_EVENT_FLAG_ENABLE :
+				 VRING_PACKED_EVENT_FLAG_DISABLE;
+	vq->driver_event->flags = cpu_to_le16(vq->event_flags_shadow);
+
+	/* Put everything in free lists. */
+	vq->free_head = 0;
+	for (i = 0; i < num; i++) {
+		vq->desc_state[i].next = i + 1;
+		vq->data[i] = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Expose every avail ring entry written since the last update with a
+ * single barrier and index store.
+ */
+static void virtqueue_publish(struct vring_virtqueue *vq)
+{
+	__virtio16 idx = cpu_to_virtio16(vq->vq.vdev, vq->avail_idx_shadow);
+
+	if (vq->vring.avail->idx == idx)
+		return;
+
+	/* Descriptors and available array need to be set before we expose the
+	 * new available array entries. */
+	virtio_wmb(vq->weak_barriers);
+	vq->vring.avail->idx = idx;
+}
+
 static inline int virtqueue_add(struct virtqueue *_vq,
 				struct scatterlist *sgs[],
 				unsigned int total_sg,
@@ -135,6 +563,10 @@ static inline int virtqueue_add(struct virtqueue *_vq,
 	int head;
 	bool indirect;
 
+	if (vq->packed)
+		return virtqueue_add_packed(vq, sgs, total_sg, out_sgs, in_sgs,
+					    data);
+
 	START_USE(vq);
 
 	BUG_ON(data == NULL);
@@ -235,13 +667,13 @@ static inline int virtqueue_add(struct virtqueue *_vq,
 
 	/* Put entry in available array (but don't update avail->idx until they
 	 * do sync). */
-	avail = virtio16_to_cpu(_vq->vdev, vq->vring.avail->idx) & (vq->vring.num - 1);
+	avail = vq->avail_idx_shadow & (vq->vring.num - 1);
 	vq->vring.avail->ring[avail] = cpu_to_virtio16(_vq->vdev, head);
+	vq->avail_idx_shadow++;
 
-	/* Descriptors and available array need to be set before we expose the
-	 * new available array entries. */
-	virtio_wmb(vq->weak_barriers);
-	vq->vring.avail->idx = cpu_to_virtio16(_vq->vdev, virtio16_to_cpu(_vq->vdev, vq->vring.avail->idx) + 1);
+	/* Inside a batch the index is published once, by virtqueue_publish. */
+	if (!vq->batching)
+		virtqueue_publish(vq);
 	vq->num_added++;
 
 	pr_debug("Added buffer head %i to %p\n", head, vq);
@@ -332,6 +764,54 @@ int virtqueue_add_inbuf(struct virtqueue *vq,
 }
 EXPORT_SYMBOL_GPL(virtqueue_add_inbuf);
 
+/**
+ * virtqueue_batch_start - defer exposing added buffers
+ * @vq: the struct virtqueue we're talking about.
+ *
+ * Buffers added after this call are written into the ring but the
+ * available index is not advanced until virtqueue_batch_end() or
+ * virtqueue_kick_prepare(), so a burst of adds costs one write barrier
+ * and one shared index update instead of one per buffer.
+ *
+ * Caller must ensure we don't call this with other virtqueue
+ * operations at the same time (except where noted).
+ */
+void virtqueue_batch_start(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	/* Each packed descriptor is published by its own flags update. */
+	if (vq->packed)
+		return;
+
+	vq->batching = true;
+}
+EXPORT_SYMBOL_GPL(virtqueue_batch_start);
+
+/**
+ * virtqueue_batch_end - expose buffers added since virtqueue_batch_start
+ * @vq: the struct virtqueue we're talking about.
+ *
+ * This does not notify the other side; use virtqueue_kick() for that,
+ * which also ends the batch.
+ *
+ * Caller must ensure we don't call this with other virtqueue
+ * operations at the same time (except where noted).
+ */
+void virtqueue_batch_end(struct virtqueue *_vq)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+
+	if (vq->packed)
+		return;
+
+	START_USE(vq);
+	virtqueue_publish(vq);
+	vq->batching = false;
+	END_USE(vq);
+}
+EXPORT_SYMBOL_GPL(virtqueue_batch_end);
+
 /**
  * virtqueue_kick_prepare - first half of split virtqueue_kick call.
  * @vq: the struct virtqueue
@@ -349,13 +829,20 @@ bool virtqueue_kick_prepare(struct virtqueue *_vq)
 	u16 new, old;
 	bool needs_kick;
 
+	if (vq->packed)
+		return virtqueue_kick_prepare_packed(vq);
+
 	START_USE(vq);
+	/* Close any open batch so the device sees everything we added. */
+	virtqueue_publish(vq);
+	vq->batching = false;
+
 	/* We need to expose available array entries before checking avail
 	 * event. */
 	virtio_mb(vq->weak_barriers);
 
-	old = virtio16_to_cpu(_vq->vdev, vq->vring.avail->idx) - vq->num_added;
-	new = virtio16_to_cpu(_vq->vdev, vq->vring.avail->idx);
+	old = vq->avail_idx_shadow - vq->num_added;
+	new = vq->avail_idx_shadow;
 	vq->num_added = 0;
 
 #ifdef DEBUG
@@ -474,6 +961,9 @@ void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 	unsigned int i;
 	u16 last_used;
 
+	if (vq->packed)
+		return virtqueue_get_buf_packed(vq, len);
+
 	START_USE(vq);
 
 	if (unlikely(vq->broken)) {
@@ -524,6 +1014,92 @@ void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 }
 EXPORT_SYMBOL_GPL(virtqueue_get_buf);
 
+/**
+ * virtqueue_get_bufs - get several used buffers at once
+ * @vq: the struct virtqueue we're talking about.
+ * @bufs: array receiving the "data" tokens handed to virtqueue_add_*().
+ * @lens: array receiving the length written into each buffer, or NULL.
+ * @max: number of entries in @bufs (and @lens).
+ *
+ * Like calling virtqueue_get_buf() up to @max times, but the used index
+ * is read once, a single read barrier orders all the entries, and the
+ * used event index is written once for the whole batch.
+ *
+ * Caller must ensure we don't call this with other virtqueue
+ * operations at the same time (except where noted).
+ *
+ * Returns the number of buffers stored in @bufs.
+ */
+unsigned int virtqueue_get_bufs(struct virtqueue *_vq, void **bufs,
+				unsigned int *lens, unsigned int max)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+	unsigned int i, n = 0, len;
+	u16 used_idx, last_used;
+
+	if (vq->packed) {
+		while (n < max &&
+		       (bufs[n] = virtqueue_get_buf_packed(vq, &len))) {
+			if (lens)
+				lens[n] = len;
+			n++;
+		}
+		return n;
+	}
+
+	START_USE(vq);
+
+	if (unlikely(vq->broken)) {
+		END_USE(vq);
+		return 0;
+	}
+
+	used_idx = virtio16_to_cpu(_vq->vdev, vq->vring.used->idx);
+	if (vq->last_used_idx == used_idx) {
+		END_USE(vq);
+		return 0;
+	}
+
+	/* Only get used array entries after they have been exposed by host. */
+	virtio_rmb(vq->weak_barriers);
+
+	while (n < max && vq->last_used_idx != used_idx) {
+		last_used = (vq->last_used_idx & (vq->vring.num - 1));
+		i = virtio32_to_cpu(_vq->vdev, vq->vring.used->ring[last_used].id);
+		len = virtio32_to_cpu(_vq->vdev, vq->vring.used->ring[last_used].len);
+
+		if (unlikely(i >= vq->vring.num)) {
+			BAD_RING(vq, "id %u out of range\n", i);
+			break;
+		}
+		if (unlikely(!vq->data[i])) {
+			BAD_RING(vq, "id %u is not a head!\n", i);
+			break;
+		}
+
+		/* detach_buf clears data, so grab it now. */
+		bufs[n] = vq->data[i];
+		if (lens)
+			lens[n] = len;
+		detach_buf(vq, i);
+		vq->last_used_idx++;
+		n++;
+	}
+
+	if (n && !(vq->vring.avail->flags & cpu_to_virtio16(_vq->vdev, VRING_AVAIL_F_NO_INTERRUPT))) {
+		vring_used_event(&vq->vring) = cpu_to_virtio16(_vq->vdev, vq->last_used_idx);
+		virtio_mb(vq->weak_barriers);
+	}
+
+#ifdef DEBUG
+	vq->last_add_time_valid = false;
+#endif
+
+	END_USE(vq);
+	return n;
+}
+EXPORT_SYMBOL_GPL(virtqueue_get_bufs);
+
 /**
  * virtqueue_disable_cb - disable callbacks
  * @vq: the struct virtqueue we're talking about.
@@ -537,6 +1113,11 @@ void virtqueue_disable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed) {
+		virtqueue_disable_cb_packed(vq);
+		return;
+	}
+
 	vq->vring.avail->flags |= cpu_to_virtio16(_vq->vdev, VRING_AVAIL_F_NO_INTERRUPT);
 }
 EXPORT_SYMBOL_GPL(virtqueue_disable_cb);
@@ -558,6 +1139,9 @@ unsigned virtqueue_enable_cb_prepare(struct virtqueue *_vq)
 	struct vring_virtqueue *vq = to_vvq(_vq);
 	u16 last_used_idx;
 
+	if (vq->packed)
+		return virtqueue_enable_cb_prepare_packed(vq);
+
 	START_USE(vq);
 
 	/* We optimistically turn back on interrupts, then check if there was
@@ -585,6 +1169,9 @@ bool virtqueue_poll(struct virtqueue *_vq, unsigned last_used_idx)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed)
+		return virtqueue_poll_packed(vq, last_used_idx);
+
 	virtio_mb(vq->weak_barriers);
 	return (u16)last_used_idx != virtio16_to_cpu(_vq->vdev, vq->vring.used->idx);
 }
@@ -626,6 +1213,9 @@ bool virtqueue_enable_cb_delayed(struct virtqueue *_vq)
 	struct vring_virtqueue *vq = to_vvq(_vq);
 	u16 bufs;
 
+	if (vq->packed)
+		return virtqueue_enable_cb_delayed_packed(vq);
+
 	START_USE(vq);
 
 	/* We optimistically turn back on interrupts, then check if there was
@@ -635,7 +1225,7 @@ bool virtqueue_enable_cb_delayed(struct virtqueue *_vq)
 	 * entry. Always do both to keep code simple. */
 	vq->vring.avail->flags &= cpu_to_virtio16(_vq->vdev, ~VRING_AVAIL_F_NO_INTERRUPT);
 	/* TODO: tune this threshold */
-	bufs = (u16)(virtio16_to_cpu(_vq->vdev, vq->vring.avail->idx) - vq->last_used_idx) * 3 / 4;
+	bufs = (u16)(vq->avail_idx_shadow - vq->last_used_idx) * 3 / 4;
 	vring_used_event(&vq->vring) = cpu_to_virtio16(_vq->vdev, vq->last_used_idx + bufs);
 	virtio_mb(vq->weak_barriers);
 	if (unlikely((u16)(virtio16_to_cpu(_vq->vdev, vq->vring.used->idx) - vq->last_used_idx) > bufs)) {
@@ -662,6 +1252,9 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 	unsigned int i;
 	void *buf;
 
+	if (vq->packed)
+		return virtqueue_detach_unused_buf_packed(vq);
+
 	START_USE(vq);
 
 	for (i = 0; i < vq->vring.num; i++) {
@@ -670,7 +1263,8 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 		/* detach_buf clears data, so grab it now. */
 		buf = vq->data[i];
 		detach_buf(vq, i);
-		vq->vring.avail->idx = cpu_to_virtio16(_vq->vdev, virtio16_to_cpu(_vq->vdev, vq->vring.avail->idx) - 1);
+		vq->avail_idx_shadow--;
+		vq->vring.avail->idx = cpu_to_virtio16(_vq->vdev, vq->avail_idx_shadow);
 		END_USE(vq);
 		return buf;
 	}
@@ -686,7 +1280,7 @@ irqreturn_t vring_interrupt(int irq, void *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
-	if (!more_used(vq)) {
+	if (vq->packed ? !more_used_packed(vq) : !more_used(vq)) {
 		pr_debug("virtqueue interrupt with no work for %p\n", vq);
 		return IRQ_NONE;
 	}
@@ -725,7 +1319,8 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 	if (!vq)
 		return NULL;
 
-	vring_init(&vq->vring, num, pages, vring_align);
+	vq->packed = virtio_has_feature(vdev, VIRTIO_F_RING_PACKED);
+	vq->desc_state = NULL;
 	vq->vq.callback = callback;
 	vq->vq.vdev = vdev;
 	vq->vq.name = name;
@@ -736,7 +1331,8 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 	vq->broken = false;
 	vq->last_used_idx = 0;
 	vq->num_added = 0;
-	list_add_tail(&vq->vq.list, &vdev->vqs);
+	vq->avail_idx_shadow = 0;
+	vq->batching = false;
 #ifdef DEBUG
 	vq->in_use = false;
 	vq->last_add_time_valid = false;
@@ -745,6 +1341,22 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
 	vq->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
+	if (vq->packed) {
+		/* Only the packed layout is used; the split ring stays unset. */
+		vq->vring.desc = NULL;
+		vq->vring.avail = NULL;
+		vq->vring.used = NULL;
+		if (vring_init_packed(vq, num, pages)) {
+			kfree(vq);
+			return NULL;
+		}
+		list_add_tail(&vq->vq.list, &vdev->vqs);
+		return &vq->vq;
+	}
+
+	vring_init(&vq->vring, num, pages, vring_align);
+	list_add_tail(&vq->vq.list, &vdev->vqs);
+
 	/* No callback?  Tell other side not to bother us. */
 	if (!callback)
 		vq->vring.avail->flags |= cpu_to_virtio16(vdev, VRING_AVAIL_F_NO_INTERRUPT);
@@ -764,6 +1376,7 @@ EXPORT_SYMBOL_GPL(vring_new_virtqueue);
 void vring_del_virtqueue(struct virtqueue *vq)
 {
 	list_del(&vq->list);
+	kfree(to_vvq(vq)->desc_state);
 	kfree(to_vvq(vq));
 }
 EXPORT_SYMBOL_GPL(vring_del_virtqueue);
@@ -781,11 +1394,26 @@ void vring_transport_features(struct virtio_device *vdev)
 			break;
 		case VIRTIO_F_VERSION_1:
 			break;
+		case VIRTIO_F_RING_PACKED:
+			/* The packed layout only exists for virtio 1.0+ */
+			if (!packed_ring ||
+			    !__virtio_test_bit(vdev, VIRTIO_F_VERSION_1))
+				__virtio_clear_bit(vdev, i);
+			break;
 		default:
 			/* We don't understand this bit. */
 			__virtio_clear_bit(vdev, i);
 		}
 	}
+
+	/*
+	 * Indirect descriptors are not implemented for the packed ring, so
+	 * don't negotiate them: the device then sizes its segment limits for
+	 * direct descriptors only.  Transports that can't use the packed
+	 * ring clear it before calling us.
+	 */
+	if (__virtio_test_bit(vdev, VIRTIO_F_RING_PACKED))
+		__virtio_clear_bit(vdev, VIRTIO_RING_F_INDIRECT_DESC);
 }
 EXPORT_SYMBOL_GPL(vring_transport_features);
 
@@ -832,6 +1460,9 @@ void *virtqueue_get_avail(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed)
+		return vq->driver_event;
+
 	return vq->vring.avail;
 }
 EXPORT_SYMBOL_GPL(virtqueue_get_avail);
@@ -840,6 +1471,9 @@ void *virtqueue_get_used(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed)
+		return vq->device_event;
+
 	return vq->vring.used;
 }
 EXPORT_SYMBOL_GPL(virtqueue_get_used);
@@ -37,6 +37,17 @@ struct async_domain {
 	struct async_domain _name = { .pending = LIST_HEAD_INIT(_name.pending), \
 				      .registered = 0 }
 
+/*
+ * initialise a domain embedded in a dynamically allocated object, @registered
+ * as for ASYNC_DOMAIN() and ASYNC_DOMAIN_EXCLUSIVE() above
+ */
+static inline void async_domain_init(struct async_domain *domain,
+				     bool registered)
+{
+	INIT_LIST_HEAD(&domain->pending);
+	domain->registered = registered;
+}
+
 extern async_cookie_t async_schedule(async_func_t func, void *data);
 extern async_cookie_t async_schedule_domain(async_func_t func, void *data,
 					    struct async_domain *domain);
@@ -37,6 +37,7 @@ struct blk_mq_hw_ctx {
 	struct blk_flush_queue	*fq;
 
 	void			*driver_data;
+	void			*sched_data;	/* blk-mq I/O scheduler */
 
 	struct blk_mq_ctxmap	ctx_map;
 
@@ -57,6 +58,10 @@ struct blk_mq_hw_ctx {
 
 	atomic_t		nr_active;
 
+	unsigned long		poll_invoked;
+	unsigned long		poll_success;
+	u64			poll_spin_ns;
+
 	struct blk_mq_cpu_notifier	cpu_notifier;
 	struct kobject		kobj;
 };
@@ -94,6 +99,9 @@ typedef int (init_request_fn)(void *, struct request *, unsigned int,
 typedef void (exit_request_fn)(void *, struct request *, unsigned int,
 		unsigned int);
 
+typedef int (poll_fn)(struct blk_mq_hw_ctx *);
+typedef void (commit_rqs_fn)(struct blk_mq_hw_ctx *);
+
 typedef void (busy_iter_fn)(struct blk_mq_hw_ctx *, struct request *, void *,
 		bool);
 
@@ -103,6 +111,14 @@ struct blk_mq_ops {
 	 */
 	queue_rq_fn		*queue_rq;
 
+	/*
+	 * Drivers may defer kicking the hardware until ->queue_rq() sees
+	 * bd->last set.  If a dispatch batch ends early (busy or error),
+	 * ->commit_rqs() is called so that the requests already queued
+	 * get issued.
+	 */
+	commit_rqs_fn		*commit_rqs;
+
 	/*
 	 * Map to specific hardware queue
 	 */
@@ -115,6 +131,13 @@ struct blk_mq_ops {
 
 	softirq_done_fn		*complete;
 
+	/*
+	 * Reap completions on the hardware queue without waiting for an
+	 * interrupt.  Returns the number of requests completed, or a
+	 * negative value if the queue can't be polled right now.
+	 */
+	poll_fn			*poll;
+
 	/*
 	 * Called when the block layer side of a hardware queue has been
 	 * set up, allowing the driver to allocate/init matching structures.
@@ -212,6 +235,7 @@ void blk_mq_cancel_requeue_work(struct request_queue *q);
 void blk_mq_kick_requeue_list(struct request_queue *q);
 void blk_mq_abort_requeue_list(struct request_queue *q);
 void blk_mq_complete_request(struct request *rq);
+void blk_mq_complete_requests(struct list_head *list);
 
 void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
 void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx);
@@ -19,6 +19,8 @@
 #include <linux/pci.h>
 #include <linux/kref.h>
 #include <linux/blk-mq.h>
+#include <linux/async.h>
+#include <linux/ktime.h>
 
 struct nvme_bar {
 	__u64			cap;	/* Controller Capabilities */
@@ -32,6 +34,8 @@ struct nvme_bar {
 	__u32			aqa;	/* Admin Queue Attributes */
 	__u64			asq;	/* Admin SQ Base Address */
 	__u64			acq;	/* Admin CQ Base Address */
+	__u32			cmbloc; /* Controller Memory Buffer Location */
+	__u32			cmbsz;  /* Controller Memory Buffer Size */
 };
 
 #define NVME_CAP_MQES(cap)	((cap) & 0xffff)
@@ -40,6 +44,17 @@ struct nvme_bar {
 #define NVME_CAP_MPSMIN(cap)	(((cap) >> 48) & 0xf)
 #define NVME_CAP_MPSMAX(cap)	(((cap) >> 52) & 0xf)
 
+#define NVME_CMB_BIR(cmbloc)	((cmbloc) & 0x7)
+#define NVME_CMB_OFST(cmbloc)	(((cmbloc) >> 12) & 0xfffff)
+#define NVME_CMB_SZ(cmbsz)	(((cmbsz) >> 12) & 0xfffff)
+#define NVME_CMB_SZU(cmbsz)	(((cmbsz) >> 8) & 0xf)
+
+#define NVME_CMB_WDS(cmbsz)	((cmbsz) & 0x10)
+#define NVME_CMB_RDS(cmbsz)	((cmbsz) & 0x8)
+#define NVME_CMB_LISTS(cmbsz)	((cmbsz) & 0x4)
+#define NVME_CMB_CQS(cmbsz)	((cmbsz) & 0x2)
+#define NVME_CMB_SQS(cmbsz)	((cmbsz) & 0x1)
+
 enum {
 	NVME_CC_ENABLE		= 1 << 0,
 	NVME_CC_CSS_NVM		= 0 << 4,
@@ -64,6 +79,25 @@ enum {
 extern unsigned char nvme_io_timeout;
 #define NVME_IO_TIMEOUT	(nvme_io_timeout * HZ)
 
+enum {
+	NVME_LAT_READ,
+	NVME_LAT_WRITE,
+	NVME_LAT_FLUSH,
+	NVME_LAT_DISCARD,
+	NVME_LAT_CLASSES,
+};
+
+#define NVME_LAT_BUCKETS	24
+
+/*
+ * Completion latency histogram.  Bucket 0 counts commands that took less
+ * than a microsecond, bucket n those that took [2^(n-1), 2^n) microseconds;
+ * the last bucket also takes everything slower.
+ */
+struct nvme_lat_hist {
+	unsigned long count[NVME_LAT_CLASSES][NVME_LAT_BUCKETS];
+};
+
 /*
  * Represents an NVM Express device.  Each nvme_dev is a PCI function.
  */
@@ -74,6 +108,10 @@ struct nvme_dev {
 	struct blk_mq_tag_set tagset;
 	struct blk_mq_tag_set admin_tagset;
 	u32 __iomem *dbs;
+	u32 *dbbuf_dbs;
+	dma_addr_t dbbuf_dbs_dma_addr;
+	u32 *dbbuf_eis;
+	dma_addr_t dbbuf_eis_dma_addr;
 	struct pci_dev *pci_dev;
 	struct dma_pool *prp_page_pool;
 	struct dma_pool *prp_small_pool;
@@ -87,6 +125,10 @@ struct nvme_dev {
 	struct msix_entry *entry;
 	struct nvme_bar __iomem *bar;
 	struct list_head namespaces;
+	struct dentry *debugfs_dir;
+	struct async_domain ns_domain;	/* Namespace scan and disk add */
+	ktime_t probe_start;
+	unsigned nr_ns;
 	struct kref kref;
 	struct device *device;
 	work_func_t reset_workfn;
@@ -100,9 +142,16 @@ struct nvme_dev {
 	u32 stripe_size;
 	u32 page_size;
 	u16 oncs;
+	u16 oacs;
 	u16 abort_limit;
+	u32 sgls;
 	u8 event_limit;
 	u8 vwc;
+	void __iomem *cmb;
+	dma_addr_t cmb_dma_addr;
+	u64 cmb_size;
+	u32 cmbsz;
+	int cmb_q_depth;	/* SQ depth the CMB layout was made for */
 };
 
 /*
@@ -121,6 +170,8 @@ struct nvme_ns {
 	int pi_type;
 	u64 mode_select_num_blocks;
 	u32 mode_select_block_len;
+	struct nvme_lat_hist __percpu *lat;
+	struct dentry *lat_file;
 };
 
 /*
@@ -2,6 +2,15 @@
 #define LINUX_PCI_ATS_H
 
 #include <linux/pci.h>
+#include <linux/spinlock.h>
+
+/* ATS invalidation statistics, see pci_ats_inv_get_stats() */
+struct pci_ats_inv_stats {
+	u64 queued;		/* ranges added with pci_ats_inv_add() */
+	u64 issued;		/* invalidate requests handed out */
+	u64 throttled;		/* times the invalidate queue was full */
+	int max_busy;		/* high-water mark of outstanding requests */
+};
 
 /* Address Translation Service */
 struct pci_ats {
@@ -10,6 +19,12 @@ struct pci_ats {
 	int qdep;       /* Invalidate Queue Depth */
 	int ref_cnt;    /* Physical Function reference count */
 	unsigned int is_enabled:1;      /* Enable bit is set */
+	spinlock_t inv_lock;		/* protects the fields below */
+	int inv_busy;			/* invalidations not yet completed */
+	bool inv_pending;		/* a range is pending: */
+	u64 inv_start;			/* ... its first byte */
+	u64 inv_last;			/* ... and its last byte */
+	struct pci_ats_inv_stats inv_stats;
 };
 
 #ifdef CONFIG_PCI_ATS
@@ -17,6 +32,11 @@ struct pci_ats {
 int pci_enable_ats(struct pci_dev *dev, int ps);
 void pci_disable_ats(struct pci_dev *dev);
 int pci_ats_queue_depth(struct pci_dev *dev);
+int pci_ats_inv_add(struct pci_dev *dev, u64 addr, u64 size);
+bool pci_ats_inv_get(struct pci_dev *dev, u64 *addr, unsigned int *order);
+void pci_ats_inv_complete(struct pci_dev *dev);
+int pci_ats_inv_get_stats(struct pci_dev *dev,
+			  struct pci_ats_inv_stats *stats);
 
 /**
  * pci_ats_enabled - query the ATS status
@@ -45,6 +65,27 @@ static inline int pci_ats_queue_depth(struct pci_dev *dev)
 	return -ENODEV;
 }
 
+static inline int pci_ats_inv_add(struct pci_dev *dev, u64 addr, u64 size)
+{
+	return -ENODEV;
+}
+
+static inline bool pci_ats_inv_get(struct pci_dev *dev, u64 *addr,
+				   unsigned int *order)
+{
+	return false;
+}
+
+static inline void pci_ats_inv_complete(struct pci_dev *dev)
+{
+}
+
+static inline int pci_ats_inv_get_stats(struct pci_dev *dev,
+					struct pci_ats_inv_stats *stats)
+{
+	return -ENODEV;
+}
+
 static inline int pci_ats_enabled(struct pci_dev *dev)
 {
 	return 0;
@@ -57,6 +98,9 @@ static inline int pci_ats_enabled(struct pci_dev *dev)
 int pci_enable_pri(struct pci_dev *pdev, u32 reqs);
 void pci_disable_pri(struct pci_dev *pdev);
 int pci_reset_pri(struct pci_dev *pdev);
+int pci_pri_credits(struct pci_dev *pdev);
+bool pci_pri_request_get(struct pci_dev *pdev);
+void pci_pri_request_put(struct pci_dev *pdev, int n);
 
 #else /* CONFIG_PCI_PRI */
 
@@ -74,6 +118,20 @@ static inline int pci_reset_pri(struct pci_dev *pdev)
 	return -ENODEV;
 }
 
+static inline int pci_pri_credits(struct pci_dev *pdev)
+{
+	return -ENODEV;
+}
+
+static inline bool pci_pri_request_get(struct pci_dev *pdev)
+{
+	return false;
+}
+
+static inline void pci_pri_request_put(struct pci_dev *pdev, int n)
+{
+}
+
 #endif /* CONFIG_PCI_PRI */
 
 #ifdef CONFIG_PCI_PASID
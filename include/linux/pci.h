@@ -30,6 +30,7 @@
 #include <linux/device.h>
 #include <linux/io.h>
 #include <linux/resource_ext.h>
+#include <linux/async.h>
 #include <uapi/linux/pci.h>
 
 #include <linux/pci_ids.h>
@@ -311,6 +312,8 @@ struct pci_dev {
 	unsigned int	ignore_hotplug:1;	/* Ignore hotplug events */
 	unsigned int	d3_delay;	/* D3->D0 transition time in ms */
 	unsigned int	d3cold_delay;	/* D3cold->D0 transition time in ms */
+	unsigned int	pme_irq_count;	/* PMEs delivered by interrupt */
+	unsigned int	pme_poll_count;	/* PMEs found by polling */
 
 #ifdef CONFIG_PCIEASPM
 	struct pcie_link_state	*link_state;	/* ASPM link state */
@@ -329,6 +332,7 @@ struct pci_dev {
 	struct resource resource[DEVICE_COUNT_RESOURCE]; /* I/O and memory regions + expansion ROMs */
 
 	bool match_driver;		/* Skip attaching driver */
+	async_cookie_t	probe_cookie;	/* Asynchronous driver attach, if any */
 	/* These fields are used by common fixups */
 	unsigned int	transparent:1;	/* Subtractive decode PCI bridge */
 	unsigned int	multifunction:1;/* Part of multi-function device */
@@ -355,6 +359,7 @@ struct pci_dev {
 	unsigned int	broken_intx_masking:1;
 	unsigned int	io_window_1k:1;	/* Intel P2P bridge 1K I/O windows */
 	unsigned int	irq_managed:1;
+	unsigned int	config_ecam_attr:1;	/* "config_ecam" file exists */
 	pci_dev_flags_t dev_flags;
 	atomic_t	enable_cnt;	/* pci_enable_device has been called */
 
@@ -375,10 +380,22 @@ struct pci_dev {
 		struct pci_dev *physfn;	/* the PF this VF is associated with */
 	};
 	struct pci_ats	*ats;	/* Address Translation Service */
+#endif
+#ifdef CONFIG_PCI_PRI
+	u32		pri_reqs_alloc;	/* Page Requests allocated to the device */
+	atomic_t	pri_reqs_pending; /* Page Requests not yet responded to */
+	atomic_long_t	pri_overflows;	/* Requests received beyond allocation */
 #endif
 	phys_addr_t rom; /* Physical address of ROM if it's not from the BAR */
 	size_t romlen; /* Length of ROM if it's not from the BAR */
+	void		*rom_cache;	/* Validated copy of the ROM image */
+	size_t		rom_cache_size;
+	unsigned int	rom_cache_gen;	/* Bumped when the ROM may change */
 	char *driver_override; /* Driver name to force a match */
+	struct hlist_node slot_node;	/* in the domain/bus/devfn index */
+	struct hlist_node id_node;	/* in the vendor/device index */
+	u64		slot_key;	/* domain/bus/devfn at index time */
+	struct rcu_head	rcu;		/* index lookups are RCU protected */
 };
 
 static inline struct pci_dev *pci_physfn(struct pci_dev *dev)
@@ -661,6 +678,8 @@ struct pci_driver {
 	void (*shutdown) (struct pci_dev *dev);
 	int (*sriov_configure) (struct pci_dev *dev, int num_vfs); /* PF pdev */
 	const struct pci_error_handlers *err_handler;
+	bool async_probe;	/* Probe may run concurrently with other probes */
+	bool async_registering;	/* Private: matching held off while registering */
 	struct device_driver	driver;
 	struct pci_dynids dynids;
 };
@@ -1019,6 +1038,8 @@ void pci_disable_rom(struct pci_dev *pdev);
 void __iomem __must_check *pci_map_rom(struct pci_dev *pdev, size_t *size);
 void pci_unmap_rom(struct pci_dev *pdev, void __iomem *rom);
 size_t pci_get_rom_size(struct pci_dev *pdev, void __iomem *rom, size_t size);
+ssize_t pci_read_rom_image(struct pci_dev *pdev, void *buf, loff_t off,
+			   size_t count);
 void __iomem __must_check *pci_platform_rom(struct pci_dev *pdev, size_t *size);
 
 /* Power management related routines */
@@ -1650,6 +1671,7 @@ int pcibios_set_pcie_reset_state(struct pci_dev *dev,
 int pcibios_add_device(struct pci_dev *dev);
 void pcibios_release_device(struct pci_dev *dev);
 void pcibios_penalize_isa_irq(int irq, int active);
+int pcibios_config_ecam_phys(struct pci_dev *dev, phys_addr_t *phys);
 
 #ifdef CONFIG_HIBERNATE_CALLBACKS
 extern struct dev_pm_ops pcibios_pm_ops;
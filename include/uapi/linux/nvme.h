@@ -90,6 +90,8 @@ enum {
 	NVME_CTRL_ONCS_WRITE_UNCORRECTABLE	= 1 << 1,
 	NVME_CTRL_ONCS_DSM			= 1 << 2,
 	NVME_CTRL_VWC_PRESENT			= 1 << 0,
+	NVME_CTRL_OACS_DBBUF_SUPP		= 1 << 8,
+	NVME_CTRL_SGLS_SUPP			= 3 << 0,
 };
 
 struct nvme_lbaf {
@@ -243,6 +245,22 @@ struct nvme_common_command {
 	__le32			cdw10[6];
 };
 
+/*
+ * A single SGL Data Block descriptor, which may be placed directly in the
+ * data pointer of a command instead of PRP entries.
+ */
+struct nvme_sgl_desc {
+	__le64			addr;
+	__le32			length;
+	__u8			rsvd[3];
+	__u8			type;
+};
+
+enum {
+	NVME_SGL_FMT_DATA_DESC	= 0x00,
+	NVME_CMD_SGL_METABUF	= (1 << 6),
+};
+
 struct nvme_rw_command {
 	__u8			opcode;
 	__u8			flags;
@@ -250,8 +268,13 @@ struct nvme_rw_command {
 	__le32			nsid;
 	__u64			rsvd2;
 	__le64			metadata;
-	__le64			prp1;
-	__le64			prp2;
+	union {
+		struct {
+			__le64	prp1;
+			__le64	prp2;
+		};
+		struct nvme_sgl_desc	sgl;
+	};
 	__le64			slba;
 	__le16			length;
 	__le16			control;
@@ -325,6 +348,7 @@ enum nvme_admin_opcode {
 	nvme_admin_async_event		= 0x0c,
 	nvme_admin_activate_fw		= 0x10,
 	nvme_admin_download_fw		= 0x11,
+	nvme_admin_dbbuf		= 0x7C,
 	nvme_admin_format_nvm		= 0x80,
 	nvme_admin_security_send	= 0x81,
 	nvme_admin_security_recv	= 0x82,
@@ -17,6 +17,7 @@
 #ifndef _UAPILINUX_PCI_H
 #define _UAPILINUX_PCI_H
 
+#include <linux/types.h>
 #include <linux/pci_regs.h>	/* The pci register defines */
 
 /*
@@ -38,4 +39,32 @@
 #define PCIIOC_MMAP_IS_MEM	(PCIIOC_BASE | 0x02)	/* Set mmap state to MEM space. */
 #define PCIIOC_WRITE_COMBINE	(PCIIOC_BASE | 0x03)	/* Enable/disable write-combining. */
 
+/* Ioctls for /proc/bus/pci/devices. */
+#define PCIIOC_READ_CONFIG_VEC	(PCIIOC_BASE | 0x04)	/* Batched config reads. */
+
+/*
+ * One config read for PCIIOC_READ_CONFIG_VEC.  @size is 1, 2 or 4 and
+ * @offset must be aligned to it.  The kernel fills in @value and sets
+ * @error to 0 or a negative errno.  Keeping the reads for one device
+ * next to each other saves a device lookup per read.
+ */
+struct pci_config_read {
+	__u32	domain;
+	__u8	bus;
+	__u8	devfn;
+	__u16	offset;
+	__u32	size;
+	__u32	value;
+	__s32	error;
+	__u32	reserved;
+};
+
+#define PCI_CONFIG_READ_VEC_MAX	4096
+
+struct pci_config_read_vec {
+	__u64	reads;		/* pointer to struct pci_config_read[count] */
+	__u32	count;		/* at most PCI_CONFIG_READ_VEC_MAX */
+	__u32	flags;		/* must be 0 */
+};
+
 #endif /* _UAPILINUX_PCI_H */
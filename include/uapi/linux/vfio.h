@@ -183,6 +183,13 @@ struct vfio_region_info {
 #define VFIO_REGION_INFO_FLAG_READ	(1 << 0) /* Region supports read */
 #define VFIO_REGION_INFO_FLAG_WRITE	(1 << 1) /* Region supports write */
 #define VFIO_REGION_INFO_FLAG_MMAP	(1 << 2) /* Region supports mmap */
+/*
+ * The MSI-X vector table of a vfio-pci device may be covered by an mmap of
+ * this region.  Accesses to the table through the mmap are not supported;
+ * the table range must still be accessed via read/write (where it remains
+ * trapped), but the rest of the pages containing it may be mapped directly.
+ */
+#define VFIO_REGION_INFO_FLAG_MSIX_MAPPABLE	(1 << 3)
 	__u32	index;		/* Region index */
 	__u32	resv;		/* Reserved for alignment */
 	__u64	size;		/* Region size (bytes) */